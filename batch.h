@@ -0,0 +1,502 @@
+/**
+ * @file batch.h Provides a headless batch mode that matches a list of needle/haystack
+ * jobs through a pipeline of decode, edge detection, distance transform and search stages.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+// Standard library
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <stdio.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "preprocess.h"
+#include "preprocesscache.h"
+
+// Search algorithms
+#include "search.h"
+#include "branchandbound.h"
+#include "boundedqueue.h"
+#include "profiler.h"
+#include "textescape.h"
+
+/**
+ * One needle to find in one haystack.
+ */
+struct BatchJob
+{
+    BatchJob()
+        : index(0)
+    {}
+
+    // Position of the job in the manifest
+    size_t index;
+
+    std::string needleFilename;
+    std::string haystackFilename;
+};
+
+/**
+ * The outcome of a BatchJob.
+ */
+struct BatchResult
+{
+    BatchResult()
+        : succeeded(false), translation(cvPoint(0, 0)),
+          distance(std::numeric_limits<double>::max()), seconds(0)
+    {}
+
+    BatchJob job;
+
+    // Whether the job ran; if not, error says why
+    bool succeeded;
+    std::string error;
+
+    // The best translation of the needle and its Hausdorff distance
+    CvPoint translation;
+    double distance;
+
+    // Time from the start of decoding to the end of the search
+    double seconds;
+};
+
+/**
+ * Parameters of a batch run.
+ */
+struct BatchOptions
+{
+    BatchOptions()
+        : decodeThreads(2), edgeThreads(2), transformThreads(2), searchThreads(0),
+          queueCapacity(4), exact(false), initialStep(32),
+          forwardFraction(1.0), reverseFraction(1.0), densityRatio(0)
+    {}
+
+    // Worker threads of each stage; 0 searchThreads uses one per hardware thread
+    unsigned decodeThreads;
+    unsigned edgeThreads;
+    unsigned transformThreads;
+    unsigned searchThreads;
+
+    // Jobs that may wait between two stages before the earlier stage blocks
+    size_t queueCapacity;
+
+    // Search with the exact branch-and-bound search rather than the coarse-to-fine search
+    bool exact;
+
+    // Initial step of the coarse-to-fine search
+    int initialStep;
+
+    // The fractions of the points that must match, as in SearchContext
+    double forwardFraction;
+    double reverseFraction;
+
+    // How far the edge count under the needle may stray from the needle's, as in
+    // SearchContext; 0 turns the check off
+    double densityRatio;
+
+    // If not empty, a directory of PreprocessedImage files: images found there
+    // aren't decoded or preprocessed again, and images that aren't are added
+    std::string cacheDirectory;
+};
+
+/**
+ * Reads a batch manifest: one job per line, the needle filename then the haystack
+ * filename, separated by a comma or, if there is no comma, by whitespace. Blank
+ * lines and lines starting with '#' are skipped.
+ *
+ * @throws std::runtime_error if the manifest can't be read or a line has no haystack
+ */
+inline std::vector<BatchJob> readBatchManifest(const std::string& filename)
+{
+    std::ifstream file(filename.c_str());
+    if (!file)
+        throw std::runtime_error("Failed to open " + filename + ".");
+
+    const char* const whitespace = " \t\r\n";
+    std::vector<BatchJob> jobs;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber)
+    {
+        const size_t first = line.find_first_not_of(whitespace);
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        line = line.substr(first, line.find_last_not_of(whitespace) - first + 1);
+
+        // Split at the comma, or else at the first run of whitespace
+        size_t separator = line.find(',');
+        size_t haystackStart = separator;
+        if (separator == std::string::npos)
+            separator = line.find_first_of(whitespace);
+        if (separator != std::string::npos)
+            haystackStart = line.find_first_not_of(whitespace, separator + 1);
+
+        BatchJob job;
+        job.index = jobs.size();
+        if (separator != std::string::npos && haystackStart != std::string::npos)
+        {
+            const size_t needleEnd = line.find_last_not_of(whitespace, separator == 0 ? 0 : separator - 1);
+            if (separator > 0 && needleEnd != std::string::npos && needleEnd < separator)
+                job.needleFilename = line.substr(0, needleEnd + 1);
+            job.haystackFilename = line.substr(haystackStart);
+        }
+        if (job.needleFilename.empty() || job.haystackFilename.empty())
+        {
+            std::ostringstream message;
+            message << filename << ":" << lineNumber << ": expected a needle and a haystack.";
+            throw std::runtime_error(message.str());
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+/**
+* Runs batch jobs through a pipeline of four stages, each with its own threads:
+*
+*   1. decode: loads the needle and haystack images
+*   2. edges: finds their edges and edge points (detectEdges())
+*   3. transform: computes their distance transforms
+*   4. search: finds the best translation of the needle
+*
+* With a cache directory, the decode stage first looks each image up in the
+* cache by the hash of its file, and an image found there skips straight to the
+* search with its mapped edge points and distance transform. The transform stage
+* adds the images it preprocesses to the cache.
+*
+* The stages are connected by BoundedQueues, so while one job is being searched
+* the next ones are being loaded and preprocessed, and a slow stage holds the
+* earlier ones back rather than letting decoded images pile up in memory.
+*
+* A job that fails (e.g. because an image can't be loaded) passes through the
+* remaining stages with its error and doesn't stop the batch.
+*
+* Example:
+* @code
+*   std::vector<BatchResult> results = BatchPipeline(BatchOptions()).run(readBatchManifest("jobs.txt"));
+*   writeBatchResultsJson(std::cout, results);
+* @endcode
+*/
+class BatchPipeline
+{
+public:
+    explicit BatchPipeline(const BatchOptions& options)
+        : options(options)
+    {}
+
+    /**
+     * Runs the jobs and returns their results in the order of the jobs.
+     */
+    std::vector<BatchResult> run(const std::vector<BatchJob>& jobs)
+    {
+        std::vector<BatchResult> results(jobs.size());
+        ItemQueue decodeQueue(options.queueCapacity);
+        ItemQueue edgeQueue(options.queueCapacity);
+        ItemQueue transformQueue(options.queueCapacity);
+        ItemQueue searchQueue(options.queueCapacity);
+        ItemQueue doneQueue(options.queueCapacity);
+
+        std::vector<std::thread> threads;
+        startStage(threads, options.decodeThreads, decodeQueue, edgeQueue, &BatchPipeline::decode);
+        startStage(threads, options.edgeThreads, edgeQueue, transformQueue, &BatchPipeline::findEdges);
+        startStage(threads, options.transformThreads, transformQueue, searchQueue, &BatchPipeline::transform);
+        startStage(threads, options.searchThreads, searchQueue, doneQueue, &BatchPipeline::search);
+
+        // Collect results as they come out of the pipeline
+        std::thread collector([&]() {
+            ItemPtr item;
+            while (doneQueue.pop(item))
+            {
+                BatchResult& result = results[item->result.job.index];
+                result = item->result;
+                result.seconds = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - item->start).count();
+            }
+        });
+
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            ItemPtr item(new Item);
+            item->result.job = jobs[i];
+            item->result.job.index = i;
+            decodeQueue.push(item);
+        }
+        decodeQueue.close();
+
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        collector.join();
+
+        return results;
+    }
+
+private:
+
+    // A job on its way through the pipeline
+    struct Item
+    {
+        Item()
+            : start(std::chrono::steady_clock::now()), needleKey(0), haystackKey(0)
+        {}
+
+        BatchResult result;
+        std::chrono::steady_clock::time_point start;
+
+        // Cache keys of the images (0 if not cached), and their cached data if found
+        uint64_t needleKey;
+        uint64_t haystackKey;
+        std::shared_ptr<PreprocessedImage> needleCache;
+        std::shared_ptr<PreprocessedImage> haystackCache;
+
+        std::shared_ptr<Image<Rgb> > needleImage;
+        std::shared_ptr<Image<Rgb> > haystackImage;
+        std::shared_ptr<Image<Intensity> > needleEdges;
+        std::shared_ptr<Image<Intensity> > haystackEdges;
+        EdgePointList needlePoints;
+        EdgePointList haystackPoints;
+        EdgeIndex haystackIndex;
+        std::shared_ptr<Image<Intensity32F> > needleDistanceTransform;
+        std::shared_ptr<Image<Intensity32F> > haystackDistanceTransform;
+    };
+    typedef std::shared_ptr<Item> ItemPtr;
+    typedef BoundedQueue<ItemPtr> ItemQueue;
+    typedef void (BatchPipeline::*Stage)(Item& item);
+
+    // Starts a stage's threads; the last of them to finish closes the stage's output
+    void startStage(std::vector<std::thread>& threads, unsigned threadCount,
+                    ItemQueue& input, ItemQueue& output, Stage stage)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        std::shared_ptr<std::atomic<unsigned> > running(new std::atomic<unsigned>(threadCount));
+        for (unsigned i = 0; i < threadCount; ++i)
+        {
+            threads.push_back(std::thread([this, running, &input, &output, stage]() {
+                ItemPtr item;
+                while (input.pop(item))
+                {
+                    if (item->result.error.empty())
+                    {
+                        try
+                        {
+                            (this->*stage)(*item);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            item->result.error = e.what();
+                        }
+                    }
+                    output.push(item);
+                }
+                if (-- *running == 0)
+                    output.close();
+            }));
+        }
+    }
+
+    void decode(Item& item)
+    {
+        ProfileScope profile(PROFILE_DECODE);
+        item.start = std::chrono::steady_clock::now();
+        try
+        {
+            if (!loadCached(item.result.job.needleFilename, needleParameters(), item.needleKey, item.needleCache,
+                            item.needlePoints, item.needleDistanceTransform))
+                item.needleImage.reset(new Image<Rgb>(item.result.job.needleFilename));
+        }
+        catch (const std::runtime_error&)
+        {
+            throw std::runtime_error("Could not open " + item.result.job.needleFilename + ".");
+        }
+        try
+        {
+            if (!loadCached(item.result.job.haystackFilename, haystackParameters(), item.haystackKey, item.haystackCache,
+                            item.haystackPoints, item.haystackDistanceTransform))
+                item.haystackImage.reset(new Image<Rgb>(item.result.job.haystackFilename));
+        }
+        catch (const std::runtime_error&)
+        {
+            throw std::runtime_error("Could not open " + item.result.job.haystackFilename + ".");
+        }
+    }
+
+    void findEdges(Item& item)
+    {
+        if (item.needleImage)
+        {
+            item.needleEdges.reset(new Image<Intensity>(item.needleImage->width(), item.needleImage->height()));
+            detectEdges(*item.needleImage, *item.needleEdges, &item.needlePoints);
+            reorderEdgePoints(item.needlePoints, EDGE_ORDER_DISCRIMINATIVE);
+            item.needleImage.reset();
+        }
+
+        if (item.haystackImage)
+        {
+            item.haystackEdges.reset(new Image<Intensity>(item.haystackImage->width(), item.haystackImage->height()));
+            detectEdges(*item.haystackImage, *item.haystackEdges, &item.haystackPoints);
+            reorderEdgePoints(item.haystackPoints, EDGE_ORDER_RANDOM);
+            item.haystackImage.reset();
+        }
+        item.haystackIndex.assign(item.haystackPoints);
+    }
+
+    void transform(Item& item)
+    {
+        if (item.needleEdges)
+        {
+            item.needleDistanceTransform.reset(new Image<Intensity32F>(item.needleEdges->width(), item.needleEdges->height()));
+            computeDistanceTransform(*item.needleEdges, *item.needleDistanceTransform);
+            saveCached(item.needleKey, needleParameters(), *item.needleEdges, item.needlePoints,
+                       *item.needleDistanceTransform);
+            item.needleEdges.reset();
+        }
+        if (item.haystackEdges)
+        {
+            item.haystackDistanceTransform.reset(new Image<Intensity32F>(item.haystackEdges->width(), item.haystackEdges->height()));
+            computeDistanceTransform(*item.haystackEdges, *item.haystackDistanceTransform);
+            saveCached(item.haystackKey, haystackParameters(), *item.haystackEdges, item.haystackPoints,
+                       *item.haystackDistanceTransform);
+            item.haystackEdges.reset();
+        }
+    }
+
+    void search(Item& item)
+    {
+        SearchContext context(item.needlePoints, *item.needleDistanceTransform,
+                              item.haystackPoints, *item.haystackDistanceTransform);
+        context.haystackIndex = &item.haystackIndex;
+        context.forwardFraction = options.forwardFraction;
+        context.reverseFraction = options.reverseFraction;
+        context.densityRatio = options.densityRatio;
+        if (context.maxOffsetX() <= 0 || context.maxOffsetY() <= 0)
+            throw std::runtime_error("The needle is larger than the haystack.");
+
+        BatchResult& result = item.result;
+        if (options.exact)
+            result.translation = findBestTranslationBranchAndBound(context, &result.distance);
+        else
+            result.translation = findBestTranslationRecursive(context, options.initialStep, &result.distance);
+        result.succeeded = true;
+
+        item.needleDistanceTransform.reset();
+        item.haystackDistanceTransform.reset();
+        item.needleCache.reset();
+        item.haystackCache.reset();
+    }
+
+    static PreprocessingParameters needleParameters()
+    {
+        return PreprocessingParameters(EDGE_ORDER_DISCRIMINATIVE);
+    }
+    static PreprocessingParameters haystackParameters()
+    {
+        return PreprocessingParameters(EDGE_ORDER_RANDOM);
+    }
+
+    // Looks an image up in the cache, finding its key first. On a hit, points and
+    // distanceTransform refer to the cached data, which cached keeps mapped.
+    bool loadCached(const std::string& filename, const PreprocessingParameters& parameters, uint64_t& key,
+                    std::shared_ptr<PreprocessedImage>& cached, EdgePointList& points,
+                    std::shared_ptr<Image<Intensity32F> >& distanceTransform) const
+    {
+        if (options.cacheDirectory.empty())
+            return false;
+
+        key = preprocessingCacheKey(filename, parameters);
+        cached.reset(new PreprocessedImage);
+        if (!cached->tryLoad(preprocessingCacheFilename(options.cacheDirectory, key)) ||
+                !cached->matches(key, parameters))
+        {
+            cached.reset();
+            return false;
+        }
+
+        points = cached->points();
+        distanceTransform.reset(new Image<Intensity32F>(cached->distanceTransform()));
+        return true;
+    }
+
+    // Adds a freshly preprocessed image to the cache, if there is one
+    void saveCached(uint64_t key, const PreprocessingParameters& parameters, const Image<Intensity>& edges,
+                    const EdgePointList& points, const Image<Intensity32F>& distanceTransform) const
+    {
+        if (options.cacheDirectory.empty())
+            return;
+
+        PreprocessedImage cached;
+        cached.assign(key, parameters, edges, points, distanceTransform);
+        try
+        {
+            cached.save(preprocessingCacheFilename(options.cacheDirectory, key));
+        }
+        catch (const std::runtime_error&)
+        {
+            // The cache only saves time; a job doesn't fail because it can't be written
+        }
+    }
+
+    BatchOptions options;
+};
+
+/*
+ * Writes batch results as a JSON array with one object per job.
+ */
+inline void writeBatchResultsJson(std::ostream& out, const std::vector<BatchResult>& results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BatchResult& result = results[i];
+        out << "  {\"needle\": \"" << escapeJson(result.job.needleFilename)
+            << "\", \"haystack\": \"" << escapeJson(result.job.haystackFilename) << "\", ";
+        if (result.succeeded)
+        {
+            out << "\"x\": " << result.translation.x << ", \"y\": " << result.translation.y
+                << ", \"distance\": " << result.distance;
+        }
+        else
+        {
+            out << "\"error\": \"" << escapeJson(result.error) << "\"";
+        }
+        out << ", \"seconds\": " << result.seconds << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+/*
+ * Writes batch results as CSV with a header row and one row per job.
+ */
+inline void writeBatchResultsCsv(std::ostream& out, const std::vector<BatchResult>& results)
+{
+    out << "needle,haystack,x,y,distance,seconds,error\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BatchResult& result = results[i];
+        out << escapeCsv(result.job.needleFilename) << "," << escapeCsv(result.job.haystackFilename) << ",";
+        if (result.succeeded)
+            out << result.translation.x << "," << result.translation.y << "," << result.distance;
+        else
+            out << ",,";
+        out << "," << result.seconds << "," << escapeCsv(result.error) << "\n";
+    }
+}
+
+#endif
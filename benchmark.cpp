@@ -0,0 +1,635 @@
+/*=================================================================
+* This benchmark times the translation and pose searches on
+* synthetic scenes with known ground truth, and reports their
+* throughput, latency and accuracy.
+*=================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Standard library
+#include <string>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+// Image processing stuff
+#include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "preprocess.h"
+#include "search.h"
+#include "parallelsearch.h"
+#include "branchandbound.h"
+#include "chamfer.h"
+#include "pyramid.h"
+#include "bitplane.h"
+#include "posesearch.h"
+#include "templatebank.h"
+#include "profiler.h"
+#include "synthetic.h"
+
+// Levels of the pyramid search, including full resolution
+const int PYRAMID_LEVELS = 4;
+
+/*
+ * The settings of a benchmark run: the sweeps of scene parameters, and what to run on them.
+ */
+struct BenchmarkOptions
+{
+    BenchmarkOptions()
+        : dropout(0), fraction(1.0), trials(5), seed(1), threads(0), tolerance(1), withinDistance(2)
+    {
+        sizes.push_back(cvSize(640, 480));
+        needleSize = cvSize(64, 64);
+        segments.push_back(12);
+        clutter.push_back(0);
+        clutter.push_back(4);
+        clutter.push_back(16);
+        rotations.push_back(0);
+        scales.push_back(1.0);
+        densityRatios.push_back(0);
+    }
+
+    std::vector<CvSize> sizes;
+    CvSize needleSize;
+    std::vector<int> segments;
+    std::vector<double> clutter;
+    double dropout;
+    std::vector<int> rotations;
+    std::vector<double> scales;
+    std::vector<std::string> engines;
+
+    // The fraction of the points that must match, as in SearchContext
+    double fraction;
+
+    // The density ratios to search with, as in SearchContext (0 turns the check off).
+    // Every scene is searched with each of them.
+    std::vector<double> densityRatios;
+
+    // Scenes generated per combination of the sweeps
+    int trials;
+    unsigned long seed;
+    unsigned threads;
+
+    // The largest error, in pixels along each axis, of a translation that counts as found
+    int tolerance;
+
+    // The distance the bitplane_within engine decides translations against. It reports
+    // the first translation in raster order within it, not the best one.
+    int withinDistance;
+
+    std::string jsonFilename;
+};
+
+/*
+ * A scene and everything the searches read about it.
+ */
+struct PreparedScene
+{
+    PreparedScene(const SyntheticScene& scene, double fraction)
+        : scene(scene), fraction(fraction), densityRatio(0),
+          needlePoints(scene.needleEdges),
+          needleDistanceTransform(scene.needleEdges.width(), scene.needleEdges.height()),
+          haystackPoints(scene.haystackEdges),
+          haystackDistanceTransform(scene.haystackEdges.width(), scene.haystackEdges.height())
+    {
+        reorderEdgePoints(needlePoints, EDGE_ORDER_DISCRIMINATIVE);
+        reorderEdgePoints(haystackPoints, EDGE_ORDER_RANDOM);
+        haystackIndex.assign(haystackPoints);
+        computeDistanceTransform(scene.needleEdges, needleDistanceTransform);
+        computeDistanceTransform(scene.haystackEdges, haystackDistanceTransform);
+    }
+
+    SearchContext context() const
+    {
+        SearchContext context(needlePoints, needleDistanceTransform, haystackPoints, haystackDistanceTransform);
+        context.haystackIndex = &haystackIndex;
+        context.forwardFraction = fraction;
+        context.reverseFraction = fraction;
+        context.densityRatio = densityRatio;
+        return context;
+    }
+
+    const SyntheticScene& scene;
+    const double fraction;
+    double densityRatio;
+    EdgePointList needlePoints;
+    Image<Intensity32F> needleDistanceTransform;
+    EdgePointList haystackPoints;
+    EdgeIndex haystackIndex;
+    Image<Intensity32F> haystackDistanceTransform;
+};
+
+/*
+ * A search under test. Translation-only engines are only run on scenes where the
+ * needle is unrotated and unscaled, and engines whose bounds need full Hausdorff
+ * distances only without --fraction. Preparation (pyramids, template banks) is not
+ * timed, any more than the distance transforms are.
+ */
+struct Engine
+{
+    typedef std::function<void (const PreparedScene&)> Prepare;
+    typedef std::function<PoseMatch (const PreparedScene&)> Search;
+
+    Engine(const std::string& name, bool findsPose, bool needsFullDistances,
+           const Search& search, const Prepare& prepare = Prepare())
+        : name(name), findsPose(findsPose), needsFullDistances(needsFullDistances), search(search), prepare(prepare)
+    {}
+
+    // Whether the engine runs on a scenario
+    bool runsOn(const SyntheticSceneOptions& scene, double fraction) const
+    {
+        const bool posed = scene.rotation != 0 || scene.scale != 1.0;
+        return (findsPose || !posed) && (!needsFullDistances || fraction >= 1.0);
+    }
+
+    std::string name;
+    bool findsPose;
+    bool needsFullDistances;
+    Search search;
+    Prepare prepare;
+};
+
+/*
+ * A translation as a PoseMatch of the unrotated, unscaled needle.
+ */
+PoseMatch translationMatch(const CvPoint& translation, double distance)
+{
+    PoseMatch match;
+    match.translation = translation;
+    match.distance = distance;
+    return match;
+}
+
+/*
+ * Checks a decision of the bitplane_within engine against the distance transforms:
+ * the translation found must have the distance findBidirectionalHausdorffDistance()
+ * gives it, and if none was found, the planted needle must be further than distance.
+ */
+void checkBitplaneDecision(const PreparedScene& prepared, int distance, bool found,
+                           const CvPoint& translation, double dist)
+{
+    const CvPoint checked = found ? translation : prepared.scene.translation;
+    const double expected = findBidirectionalHausdorffDistance(
+                                prepared.needlePoints, prepared.needleDistanceTransform,
+                                prepared.haystackPoints, prepared.haystackDistanceTransform, checked);
+    if (found ? dist != expected : expected <= distance)
+    {
+        std::cerr << "bitplane_within disagrees with findBidirectionalHausdorffDistance at ("
+                  << checked.x << ", " << checked.y << "): " << (found ? dist : -1) << " vs " << expected
+                  << std::endl;
+    }
+}
+
+/*
+ * The engines that can be benchmarked. The state they share (the thread pool,
+ * pyramids and template bank) lives in the objects passed in.
+ */
+std::vector<Engine> createEngines(WorkStealingPool& pool, const BenchmarkOptions& options,
+                                  std::unique_ptr<EdgePyramid>& needlePyramid,
+                                  std::unique_ptr<DistancePyramid>& haystackPyramid,
+                                  TemplateBank& bank)
+{
+    std::vector<Engine> engines;
+    engines.push_back(Engine("serial", false, false, [](const PreparedScene& prepared) {
+        double dist;
+        const CvPoint translation = findBestTranslation(prepared.context(), 1, &dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("recursive", false, false, [](const PreparedScene& prepared) {
+        double dist;
+        const CvPoint translation = findBestTranslationRecursive(prepared.context(), 32, &dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("parallel_recursive", false, false, [&pool](const PreparedScene& prepared) {
+        double dist;
+        ParallelTranslationSearch search(pool);
+        const CvPoint translation = search.findBestTranslationRecursive(prepared.context(), 32, &dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("branch_and_bound", false, false, [](const PreparedScene& prepared) {
+        double dist;
+        const CvPoint translation = findBestTranslationBranchAndBound(prepared.context(), &dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("chamfer", false, true, [](const PreparedScene& prepared) {
+        double dist;
+        ChamferPrescreenOptions chamferOptions;
+        chamferOptions.exact = true;
+        const CvPoint translation = findBestTranslationPrescreened(prepared.context(), chamferOptions, &dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("bitplane_within", false, true, [&options](const PreparedScene& prepared) {
+        BitplaneHausdorff evaluator(prepared.scene.needleEdges, prepared.scene.haystackEdges);
+        CvPoint translation = cvPoint(0, 0);
+        const bool found = findTranslationWithin(evaluator, options.withinDistance, &translation);
+        const double dist = found ? evaluator.distanceAt(translation) : std::numeric_limits<double>::max();
+        checkBitplaneDecision(prepared, options.withinDistance, found, translation, dist);
+        return translationMatch(translation, dist);
+    }));
+    engines.push_back(Engine("pyramid", false, true, [&](const PreparedScene& prepared) {
+        double dist;
+        const CvPoint translation = findBestTranslationPyramid(prepared.context(), *needlePyramid, *haystackPyramid,
+                                    &dist);
+        return translationMatch(translation, dist);
+    }, [&](const PreparedScene& prepared) {
+        needlePyramid.reset(new EdgePyramid(prepared.scene.needleEdges, PYRAMID_LEVELS));
+        haystackPyramid.reset(new DistancePyramid(prepared.haystackDistanceTransform, PYRAMID_LEVELS));
+    }));
+
+    // The pose engines try every pose of the sweep
+    std::vector<NeedlePose> poses;
+    for (size_t i = 0; i < options.rotations.size(); ++i)
+        for (size_t j = 0; j < options.scales.size(); ++j)
+            poses.push_back(NeedlePose(options.rotations[i], options.scales[j]));
+    const auto buildBank = [&, poses](const PreparedScene& prepared) {
+        bank.build(prepared.scene.needleEdges, poses, &pool);
+    };
+    for (int exact = 0; exact < 2; ++exact)
+    {
+        engines.push_back(Engine(exact ? "pose_exact" : "pose", true, false, [&, exact](const PreparedScene& prepared) {
+            PoseSearchOptions poseOptions;
+            poseOptions.exactTranslation = exact != 0;
+            poseOptions.forwardFraction = prepared.fraction;
+            poseOptions.reverseFraction = prepared.fraction;
+            poseOptions.densityRatio = prepared.densityRatio;
+            PoseSearch search(pool);
+            PoseMatch match;
+            search.findBestTranslationScaleAndRotation(bank, prepared.haystackPoints,
+                    prepared.haystackDistanceTransform, poseOptions, &match, 0, &prepared.haystackIndex);
+            return match;
+        }, buildBank));
+    }
+
+    return engines;
+}
+
+/*
+ * The measurements of one engine on one combination of the sweeps.
+ */
+struct EngineResult
+{
+    EngineResult()
+        : found(0), translationError(0), offsetsEvaluated(0)
+    {}
+
+    std::string scenario;
+    std::string engine;
+    std::vector<double> seconds;
+    int found;
+    double translationError;
+    unsigned long long offsetsEvaluated;
+
+    int trials() const
+    {
+        return static_cast<int>(seconds.size());
+    }
+
+    double totalSeconds() const
+    {
+        double total = 0;
+        for (size_t i = 0; i < seconds.size(); ++i)
+            total += seconds[i];
+        return total;
+    }
+
+    // The nearest-rank percentile of the latencies, in seconds
+    double percentile(double p) const
+    {
+        if (seconds.empty())
+            return 0;
+        std::vector<double> sorted(seconds);
+        std::sort(sorted.begin(), sorted.end());
+        const size_t rank = static_cast<size_t>(ceil(p / 100.0 * sorted.size()));
+        return sorted[std::max<size_t>(rank, 1) - 1];
+    }
+};
+
+/*
+ * Runs an engine on a prepared scene and adds the outcome to result.
+ */
+void runEngine(const Engine& engine, const PreparedScene& prepared, int tolerance, EngineResult& result)
+{
+    if (engine.prepare)
+        engine.prepare(prepared);
+
+    Profiler profiler;
+    profiler.start();
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const PoseMatch match = engine.search(prepared);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    profiler.stop();
+
+    const SyntheticScene& scene = prepared.scene;
+    const int errorX = abs(match.translation.x - scene.translation.x);
+    const int errorY = abs(match.translation.y - scene.translation.y);
+    const bool poseFound = match.rotation == scene.rotation && fabs(match.scale - scene.scale) < 1e-9;
+
+    result.seconds.push_back(seconds);
+    result.translationError += sqrt(static_cast<double>(errorX * errorX + errorY * errorY));
+    if (errorX <= tolerance && errorY <= tolerance && poseFound)
+        ++ result.found;
+    result.offsetsEvaluated += profiler.totals().counters[PROFILE_OFFSETS_EVALUATED];
+}
+
+/*
+ * Prints a table of results.
+ */
+void printResults(const std::vector<EngineResult>& results)
+{
+    printf("%-52s %-20s %6s %8s %8s %9s %9s %9s %10s %12s\n", "scenario", "engine", "trials", "found", "error",
+           "p50 ms", "p90 ms", "p99 ms", "searches/s", "offsets/s");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const EngineResult& result = results[i];
+        const double total = result.totalSeconds();
+        printf("%-52s %-20s %6d %7.1f%% %8.2f %9.3f %9.3f %9.3f %10.2f %12.0f\n",
+               result.scenario.c_str(), result.engine.c_str(), result.trials(),
+               100.0 * result.found / std::max(1, result.trials()),
+               result.translationError / std::max(1, result.trials()),
+               1000 * result.percentile(50), 1000 * result.percentile(90), 1000 * result.percentile(99),
+               total > 0 ? result.trials() / total : 0.0,
+               total > 0 ? result.offsetsEvaluated / total : 0.0);
+    }
+}
+
+/*
+ * Writes the results as a JSON array.
+ */
+void writeResultsJson(std::ostream& out, const std::vector<EngineResult>& results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const EngineResult& result = results[i];
+        const double total = result.totalSeconds();
+        out << "  {\"scenario\": \"" << result.scenario << "\", \"engine\": \"" << result.engine << "\""
+            << ", \"trials\": " << result.trials() << ", \"found\": " << result.found
+            << ", \"mean_translation_error\": " << result.translationError / std::max(1, result.trials())
+            << ", \"p50_seconds\": " << result.percentile(50) << ", \"p90_seconds\": " << result.percentile(90)
+            << ", \"p99_seconds\": " << result.percentile(99)
+            << ", \"searches_per_second\": " << (total > 0 ? result.trials() / total : 0.0)
+            << ", \"offsets_evaluated\": " << result.offsetsEvaluated << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+/*
+ * Lists the scenes of every combination of the sweeps.
+ */
+std::vector<SyntheticSceneOptions> enumerateScenarios(const BenchmarkOptions& options)
+{
+    std::vector<SyntheticSceneOptions> scenarios;
+    SyntheticSceneOptions scene;
+    scene.needleWidth = options.needleSize.width;
+    scene.needleHeight = options.needleSize.height;
+    scene.dropout = options.dropout;
+    for (size_t size = 0; size < options.sizes.size(); ++size)
+    {
+        scene.haystackWidth = options.sizes[size].width;
+        scene.haystackHeight = options.sizes[size].height;
+        for (size_t segments = 0; segments < options.segments.size(); ++segments)
+        {
+            scene.needleSegments = options.segments[segments];
+            for (size_t clutter = 0; clutter < options.clutter.size(); ++clutter)
+            {
+                scene.clutter = options.clutter[clutter];
+                for (size_t rotation = 0; rotation < options.rotations.size(); ++rotation)
+                {
+                    scene.rotation = options.rotations[rotation];
+                    for (size_t scale = 0; scale < options.scales.size(); ++scale)
+                    {
+                        scene.scale = options.scales[scale];
+                        scenarios.push_back(scene);
+                    }
+                }
+            }
+        }
+    }
+    return scenarios;
+}
+
+/*
+ * Splits a comma-separated argument.
+ */
+std::vector<std::string> splitList(const char* argument)
+{
+    std::vector<std::string> items;
+    std::string item;
+    for (const char* c = argument; ; ++c)
+    {
+        if (*c == ',' || *c == 0)
+        {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+            if (*c == 0)
+                break;
+        }
+        else
+        {
+            item += *c;
+        }
+    }
+    return items;
+}
+
+/*
+ * Parses a size written as WIDTHxHEIGHT.
+ */
+bool parseSize(const std::string& text, CvSize& size)
+{
+    return sscanf(text.c_str(), "%dx%d", &size.width, &size.height) == 2 && size.width > 0 && size.height > 0;
+}
+
+void printUsage(const char* program)
+{
+    std::cerr << "Usage " << program << " [--sizes 640x480,...] [--needle 64x64] [--segments n,...]"
+              << " [--clutter c,...] [--dropout f] [--rotations r,...] [--scales s,...] [--trials n]"
+              << " [--seed n] [--threads n] [--engines name,...] [--fraction f] [--density-ratios r,...]"
+              << " [--tolerance pixels] [--within pixels] [--json results.json]"
+              << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    // Every option takes a value
+    BenchmarkOptions options;
+    bool valid = argc % 2 == 1;
+    for (int i = 1; i + 1 < argc && valid; i += 2)
+    {
+        const char* const value = argv[i + 1];
+        const std::vector<std::string> items = splitList(value);
+        if (strcmp(argv[i], "--sizes") == 0)
+        {
+            options.sizes.clear();
+            for (size_t j = 0; j < items.size() && valid; ++j)
+            {
+                CvSize size;
+                valid = parseSize(items[j], size);
+                options.sizes.push_back(size);
+            }
+        }
+        else if (strcmp(argv[i], "--needle") == 0)
+            valid = parseSize(value, options.needleSize);
+        else if (strcmp(argv[i], "--segments") == 0)
+        {
+            options.segments.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                options.segments.push_back(std::max(1, atoi(items[j].c_str())));
+        }
+        else if (strcmp(argv[i], "--clutter") == 0)
+        {
+            options.clutter.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                options.clutter.push_back(std::max(0.0, atof(items[j].c_str())));
+        }
+        else if (strcmp(argv[i], "--dropout") == 0)
+            options.dropout = std::min(1.0, std::max(0.0, atof(value)));
+        else if (strcmp(argv[i], "--rotations") == 0)
+        {
+            options.rotations.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                options.rotations.push_back(atoi(items[j].c_str()));
+        }
+        else if (strcmp(argv[i], "--scales") == 0)
+        {
+            options.scales.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                options.scales.push_back(atof(items[j].c_str()));
+        }
+        else if (strcmp(argv[i], "--trials") == 0)
+            options.trials = std::max(1, atoi(value));
+        else if (strcmp(argv[i], "--seed") == 0)
+            options.seed = strtoul(value, 0, 10);
+        else if (strcmp(argv[i], "--threads") == 0)
+            options.threads = std::max(0, atoi(value));
+        else if (strcmp(argv[i], "--engines") == 0)
+            options.engines = items;
+        else if (strcmp(argv[i], "--fraction") == 0)
+            options.fraction = std::min(1.0, std::max(0.0, atof(value)));
+        else if (strcmp(argv[i], "--density-ratios") == 0)
+        {
+            options.densityRatios.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                options.densityRatios.push_back(std::max(0.0, atof(items[j].c_str())));
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0)
+            options.tolerance = std::max(0, atoi(value));
+        else if (strcmp(argv[i], "--within") == 0)
+            options.withinDistance = std::max(0, atoi(value));
+        else if (strcmp(argv[i], "--json") == 0)
+            options.jsonFilename = value;
+        else
+            valid = false;
+    }
+    if (!valid || options.sizes.empty() || options.segments.empty() || options.clutter.empty() ||
+            options.rotations.empty() || options.scales.empty() || options.densityRatios.empty())
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    WorkStealingPool pool(options.threads);
+    std::unique_ptr<EdgePyramid> needlePyramid;
+    std::unique_ptr<DistancePyramid> haystackPyramid;
+    TemplateBank bank;
+    std::vector<Engine> engines = createEngines(pool, options, needlePyramid, haystackPyramid, bank);
+    if (!options.engines.empty())
+    {
+        std::vector<Engine> selected;
+        for (size_t i = 0; i < options.engines.size(); ++i)
+        {
+            size_t j = 0;
+            while (j < engines.size() && engines[j].name != options.engines[i])
+                ++j;
+            if (j == engines.size())
+            {
+                std::cerr << "Unknown engine " << options.engines[i] << "." << std::endl;
+                return 1;
+            }
+            selected.push_back(engines[j]);
+        }
+        engines.swap(selected);
+    }
+
+    // Every scenario has its own run of seeds
+    std::vector<EngineResult> results;
+    const std::vector<SyntheticSceneOptions> scenarios = enumerateScenarios(options);
+    for (size_t scenarioNumber = 0; scenarioNumber < scenarios.size(); ++scenarioNumber)
+    {
+        const SyntheticSceneOptions& sceneOptions = scenarios[scenarioNumber];
+        if (sceneOptions.needleWidth >= sceneOptions.haystackWidth ||
+                sceneOptions.needleHeight >= sceneOptions.haystackHeight)
+        {
+            std::cerr << "The needle must be smaller than the haystack." << std::endl;
+            return 1;
+        }
+
+        char scenario[128];
+        sprintf(scenario, "%dx%d seg=%d clutter=%g rot=%d scale=%g", sceneOptions.haystackWidth,
+                sceneOptions.haystackHeight, sceneOptions.needleSegments, sceneOptions.clutter,
+                sceneOptions.rotation, sceneOptions.scale);
+
+        // One row per density ratio and engine; the ratio is only named when the check is on
+        const size_t first = results.size();
+        for (size_t ratio = 0; ratio < options.densityRatios.size(); ++ratio)
+        {
+            std::string label = scenario;
+            if (options.densityRatios[ratio] > 1.0)
+            {
+                char density[32];
+                sprintf(density, " density=%g", options.densityRatios[ratio]);
+                label += density;
+            }
+            for (size_t i = 0; i < engines.size(); ++i)
+            {
+                if (!engines[i].runsOn(sceneOptions, options.fraction))
+                    continue;
+                results.push_back(EngineResult());
+                results.back().scenario = label;
+                results.back().engine = engines[i].name;
+            }
+        }
+
+        for (int trial = 0; trial < options.trials; ++trial)
+        {
+            const uint64_t seed = SyntheticRandom(options.seed * 1000003ULL + scenarioNumber * 7919ULL + trial).next();
+            const SyntheticScene scene = generateSyntheticScene(sceneOptions, seed);
+            PreparedScene prepared(scene, options.fraction);
+
+            size_t resultIndex = first;
+            for (size_t ratio = 0; ratio < options.densityRatios.size(); ++ratio)
+            {
+                prepared.densityRatio = options.densityRatios[ratio];
+                for (size_t i = 0; i < engines.size(); ++i)
+                {
+                    if (!engines[i].runsOn(sceneOptions, options.fraction))
+                        continue;
+                    runEngine(engines[i], prepared, options.tolerance, results[resultIndex++]);
+                }
+            }
+        }
+    }
+
+    printResults(results);
+    if (!options.jsonFilename.empty())
+    {
+        std::ofstream file(options.jsonFilename.c_str());
+        if (!file)
+        {
+            std::cerr << "Could not create " << options.jsonFilename << "." << std::endl;
+            return 1;
+        }
+        writeResultsJson(file, results);
+    }
+    return 0;
+}
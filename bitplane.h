@@ -0,0 +1,487 @@
+/**
+ * @file bitplane.h Provides bit-packed edge images and a decision-mode Hausdorff
+ * evaluator that answers "is the distance at most d?" with word-wide bit operations.
+ */
+
+#ifndef BITPLANE_H
+#define BITPLANE_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "hausdorff.h"
+
+/**
+ * Counts the set bits of a word.
+ */
+inline unsigned countBits(uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return static_cast<unsigned>(__popcnt64(word));
+#elif defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_popcountll(word));
+#else
+    unsigned count = 0;
+    for (; word; word &= word - 1)
+        ++ count;
+    return count;
+#endif
+}
+
+/**
+* A binary image packed 64 pixels to a word: bit i of word j of a row is the pixel
+* at x = 64 * j + i. Each row has one spare word, always zero, so that 64 pixels
+* can be read from any x with two word loads.
+*
+* One bit per pixel is a 32nd of the memory of a float distance transform.
+*
+* Like an EdgePointList, a Bitplane normally owns its words, but attach() can
+* point it at words owned by someone else (e.g. a memory-mapped file). Copies of
+* such a plane share the words until dilate() gives a plane a private copy.
+*/
+class Bitplane
+{
+public:
+    Bitplane()
+        : planeWidth(0), planeHeight(0), wordsPerRow(0), wordData(0)
+    {}
+
+    /**
+     * Packs the edge (black) pixels of an edge image.
+     */
+    explicit Bitplane(const Image<Intensity>& edges)
+        : planeWidth(edges.width()), planeHeight(edges.height()),
+          wordsPerRow((edges.width() + 63) / 64 + 1),
+          words(static_cast<size_t>(wordsPerRow) * edges.height(), 0),
+          wordData(words.empty() ? 0 : &words[0])
+    {
+        for (int y = 0; y < planeHeight; ++y)
+        {
+            const Intensity* const pixels = edges[y];
+            uint64_t* const bits = row(y);
+            for (int x = 0; x < planeWidth; ++x)
+            {
+                if (pixels[x] == 0)
+                    bits[x >> 6] |= uint64_t(1) << (x & 63);
+            }
+        }
+    }
+
+    Bitplane(const Bitplane& other)
+        : planeWidth(other.planeWidth), planeHeight(other.planeHeight), wordsPerRow(other.wordsPerRow),
+          words(other.words), wordData(other.wordData)
+    {
+        if (other.ownsWords())
+            wordData = words.empty() ? 0 : &words[0];
+    }
+
+    Bitplane& operator= (const Bitplane& rhs)
+    {
+        if (this != &rhs)
+        {
+            planeWidth = rhs.planeWidth;
+            planeHeight = rhs.planeHeight;
+            wordsPerRow = rhs.wordsPerRow;
+            words = rhs.words;
+            wordData = rhs.ownsWords() ? (words.empty() ? 0 : &words[0]) : rhs.wordData;
+        }
+        return *this;
+    }
+
+    /**
+     * Makes the plane an empty plane of the given size, in its own words, for the
+     * caller to set pixels in through row().
+     */
+    void assign(int width, int height)
+    {
+        planeWidth = width;
+        planeHeight = height;
+        wordsPerRow = (width + 63) / 64 + 1;
+        words.assign(static_cast<size_t>(wordsPerRow) * height, 0);
+        wordData = words.empty() ? 0 : &words[0];
+    }
+
+    /**
+     * Makes the plane use words stored elsewhere, laid out as by the constructor
+     * with rowWords() words per row, without copying them. The words must outlive
+     * the plane (and any copies of it).
+     */
+    void attach(uint64_t* data, int width, int height, int rowWords)
+    {
+        words.clear();
+        planeWidth = width;
+        planeHeight = height;
+        wordsPerRow = rowWords;
+        wordData = data;
+    }
+
+    // Dimensions of the image
+    int width() const
+    {
+        return planeWidth;
+    }
+    int height() const
+    {
+        return planeHeight;
+    }
+
+    // The number of words in a row, including the spare word
+    int rowWords() const
+    {
+        return wordsPerRow;
+    }
+
+    // The words of a row
+    uint64_t* row(int y)
+    {
+        return wordData + static_cast<size_t>(y) * wordsPerRow;
+    }
+    const uint64_t* row(int y) const
+    {
+        return wordData + static_cast<size_t>(y) * wordsPerRow;
+    }
+
+    // The 64 pixels of row y starting at x, for 0 <= x < width(); pixels past the
+    // end of the row read as 0
+    uint64_t bitsAt(int y, int x) const
+    {
+        const uint64_t* const bits = row(y) + (x >> 6);
+        const int shift = x & 63;
+        return shift == 0 ? bits[0] : (bits[0] >> shift) | (bits[1] << (64 - shift));
+    }
+
+    // The number of set pixels
+    unsigned long count() const
+    {
+        const size_t wordCount = static_cast<size_t>(wordsPerRow) * planeHeight;
+        unsigned long total = 0;
+        for (size_t i = 0; i < wordCount; ++i)
+            total += countBits(wordData[i]);
+        return total;
+    }
+
+    /**
+     * Dilates the set pixels by one pixel in the L1 (4-connected) sense: a pixel is
+     * set afterwards if it or one of its four neighbours was set. Dilating distance
+     * times sets exactly the pixels within L1 distance of a set pixel, which are the
+     * pixels where a CV_DIST_L1 distance transform is at most distance.
+     */
+    void dilate()
+    {
+        if (planeWidth == 0)
+            return;
+        if (!ownsWords())
+        {
+            words.assign(wordData, wordData + static_cast<size_t>(wordsPerRow) * planeHeight);
+            wordData = &words[0];
+        }
+
+        const int lastWord = (planeWidth - 1) >> 6;
+        const uint64_t lastMask = (planeWidth & 63) ? (uint64_t(1) << (planeWidth & 63)) - 1 : ~uint64_t(0);
+
+        std::vector<uint64_t> previous(wordsPerRow, 0);
+        std::vector<uint64_t> current(wordsPerRow, 0);
+        for (int y = 0; y < planeHeight; ++y)
+        {
+            uint64_t* const bits = row(y);
+            const uint64_t* const below = y + 1 < planeHeight ? row(y + 1) : 0;
+            std::copy(bits, bits + wordsPerRow, current.begin());
+
+            for (int j = 0; j <= lastWord; ++j)
+            {
+                const uint64_t left = (current[j] << 1) | (j > 0 ? current[j - 1] >> 63 : 0);
+                const uint64_t right = (current[j] >> 1) | (current[j + 1] << 63);
+                bits[j] = current[j] | left | right | previous[j] | (below ? below[j] : 0);
+            }
+            bits[lastWord] &= lastMask;
+
+            previous.swap(current);
+        }
+    }
+
+private:
+    // Whether the words are in our own storage rather than attached ones
+    bool ownsWords() const
+    {
+        return words.empty() ? wordData == 0 : wordData == &words[0];
+    }
+
+    int planeWidth;
+    int planeHeight;
+    int wordsPerRow;
+
+    // Storage for words owned by the plane
+    std::vector<uint64_t> words;
+
+    // The words in use, either in the storage above or attached
+    uint64_t* wordData;
+};
+
+/**
+* Decides whether the bidirectional Hausdorff distance between the needle and the
+* haystack at a translation is at most d, in the sense of
+* findBidirectionalHausdorffDistance() with CV_DIST_L1 distance transforms.
+*
+* The needle's edges are within d of the haystack's exactly when they are a subset
+* of the haystack's edges dilated by d, and likewise the other way around. With
+* both edge images and their dilations packed into Bitplanes, each direction is
+* tested 64 pixels at a time with AND/ANDNOT, and popcount counts the haystack
+* edges under the needle. No distance transform is needed. When the exact distance
+* is needed, distanceAt() finds it by searching over d.
+*
+* Dilations are computed on demand. Those at the distances within() is asked about,
+* and at powers of two, are cached; the others distanceAt() probes are not, so the
+* cache stays small. An evaluator must not be used by several threads at once. Translations must keep the needle inside the haystack:
+* 0 <= x <= haystack width - needle width, and likewise for y.
+*
+* Example:
+* @code
+*   BitplaneHausdorff evaluator(*needleEdges, *haystackEdges);
+*   CvPoint match;
+*   if (findTranslationWithin(evaluator, 3, &match))
+*       std::cout << "Found within 3 pixels at " << match.x << ", " << match.y << std::endl;
+* @endcode
+*/
+class BitplaneHausdorff
+{
+public:
+    /**
+     * @param needleEdges the needle's edges
+     * @param haystackEdges the haystack's edges
+     */
+    BitplaneHausdorff(const Image<Intensity>& needleEdges, const Image<Intensity>& haystackEdges)
+        : needlePointCount(0)
+    {
+        needleDilations[0] = Bitplane(needleEdges);
+        haystackDilations[0] = Bitplane(haystackEdges);
+        needlePointCount = needleDilations[0].count();
+    }
+
+    /**
+     * @param needleEdges, haystackEdges the needle's and haystack's edges, already
+     *     packed; attached planes are used in place
+     */
+    BitplaneHausdorff(const Bitplane& needleEdges, const Bitplane& haystackEdges)
+        : needlePointCount(0)
+    {
+        needleDilations[0] = needleEdges;
+        haystackDilations[0] = haystackEdges;
+        needlePointCount = needleDilations[0].count();
+    }
+
+    // The exclusive upper bounds of the translations, as in SearchContext
+    int maxOffsetX() const
+    {
+        return haystack().width() - needle().width();
+    }
+    int maxOffsetY() const
+    {
+        return haystack().height() - needle().height();
+    }
+
+    // The largest distance distanceAt() searches; no two pixels of the haystack are further apart
+    int maxDistance() const
+    {
+        return haystack().width() + haystack().height();
+    }
+
+    /**
+     * Decides whether the directed distance from the needle at offset to the
+     * haystack is at most distance.
+     */
+    bool forwardWithin(const CvPoint& offset, int distance)
+    {
+        return forwardWithin(offset, distance, dilation(haystackDilations, distance));
+    }
+
+    /**
+     * Decides whether the directed distance from the haystack edges under the needle
+     * at offset to the needle is at most distance.
+     */
+    bool reverseWithin(const CvPoint& offset, int distance)
+    {
+        return reverseWithin(offset, distance, dilation(needleDilations, distance));
+    }
+
+    /**
+     * Decides whether the bidirectional distance at offset is at most distance.
+     */
+    bool within(const CvPoint& offset, int distance)
+    {
+        return forwardWithin(offset, distance) && reverseWithin(offset, distance);
+    }
+
+    /**
+     * Finds the bidirectional distance at offset by searching for the smallest
+     * distance d for which within() holds: first doubling d from 1, then bisecting.
+     * Only the dilations at powers of two are kept.
+     *
+     * @return the distance; like findBidirectionalHausdorffDistance(), a perfect
+     *     match is std::numeric_limits<double>::min() rather than 0, and if either
+     *     side has no edges the distance is MAX_HAUSDORFF_DISTANCE. Distances beyond
+     *     maxDistance() are returned as MAX_HAUSDORFF_DISTANCE.
+     */
+    double distanceAt(const CvPoint& offset)
+    {
+        if (probeWithin(offset, 0))
+            return std::numeric_limits<double>::min();
+
+        // probeWithin(low) is false and probeWithin(high) is true
+        int low = 0;
+        int high = 1;
+        while (!probeWithin(offset, high))
+        {
+            if (high >= maxDistance())
+                return MAX_HAUSDORFF_DISTANCE;
+            low = high;
+            high = std::min(maxDistance(), 2 * high);
+        }
+        while (high - low > 1)
+        {
+            const int middle = low + (high - low) / 2;
+            if (probeWithin(offset, middle))
+                high = middle;
+            else
+                low = middle;
+        }
+        return high;
+    }
+
+private:
+
+    bool forwardWithin(const CvPoint& offset, int distance, const Bitplane& dilatedHaystack) const
+    {
+        if (needlePointCount == 0)
+            return distance >= MAX_HAUSDORFF_DISTANCE;
+
+        const Bitplane& needleEdges = needle();
+        const int needleWords = (needleEdges.width() + 63) / 64;
+        for (int y = 0; y < needleEdges.height(); ++y)
+        {
+            const uint64_t* const needleRow = needleEdges.row(y);
+            for (int j = 0; j < needleWords; ++j)
+            {
+                if (needleRow[j] & ~dilatedHaystack.bitsAt(offset.y + y, offset.x + 64 * j))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool reverseWithin(const CvPoint& offset, int distance, const Bitplane& dilatedNeedle) const
+    {
+        const Bitplane& haystackEdges = haystack();
+        const int needleWidth = dilatedNeedle.width();
+        const int needleWords = (needleWidth + 63) / 64;
+
+        bool contained = true;
+        unsigned long pointsUnderNeedle = 0;
+        for (int y = 0; y < dilatedNeedle.height() && contained; ++y)
+        {
+            const uint64_t* const needleRow = dilatedNeedle.row(y);
+            for (int j = 0; j < needleWords; ++j)
+            {
+                uint64_t haystackBits = haystackEdges.bitsAt(offset.y + y, offset.x + 64 * j);
+                if (needleWidth - 64 * j < 64)
+                    haystackBits &= (uint64_t(1) << (needleWidth - 64 * j)) - 1;
+
+                pointsUnderNeedle += countBits(haystackBits);
+                if (haystackBits & ~needleRow[j])
+                {
+                    contained = false;
+                    break;
+                }
+            }
+        }
+
+        // With no haystack edges under the needle the distance is MAX_HAUSDORFF_DISTANCE
+        if (contained && pointsUnderNeedle == 0)
+            return distance >= MAX_HAUSDORFF_DISTANCE;
+        return contained;
+    }
+
+    // within() for distanceAt(), which caches only the dilations at powers of two
+    bool probeWithin(const CvPoint& offset, int distance)
+    {
+        const bool keep = (distance & (distance - 1)) == 0;
+        return forwardWithin(offset, distance, dilation(haystackDilations, distance, keep ? 0 : &haystackScratch)) &&
+               reverseWithin(offset, distance, dilation(needleDilations, distance, keep ? 0 : &needleScratch));
+    }
+
+    const Bitplane& needle() const
+    {
+        return needleDilations.find(0)->second;
+    }
+    const Bitplane& haystack() const
+    {
+        return haystackDilations.find(0)->second;
+    }
+
+    // Finds a cached dilation, or computes it from the largest smaller one. The
+    // result is cached, unless scratch is given to compute it in instead.
+    static const Bitplane& dilation(std::map<int, Bitplane>& dilations, int distance, Bitplane* scratch = 0)
+    {
+        std::map<int, Bitplane>::iterator found = dilations.upper_bound(distance);
+        --found;
+        if (found->first == distance)
+            return found->second;
+
+        Bitplane& dilated = scratch ? *scratch : dilations[distance];
+        dilated = found->second;
+        for (int d = found->first; d < distance; ++d)
+            dilated.dilate();
+        return dilated;
+    }
+
+    // Dilations of the needle and haystack edges, keyed by distance; 0 is the edges themselves
+    std::map<int, Bitplane> needleDilations;
+    std::map<int, Bitplane> haystackDilations;
+
+    // The uncached dilations of distanceAt()'s probes
+    Bitplane needleScratch;
+    Bitplane haystackScratch;
+
+    unsigned long needlePointCount;
+};
+
+/*
+ * Decides whether the needle appears anywhere in the haystack within a bidirectional
+ * Hausdorff distance of distance, trying translations in raster order.
+ *
+ * @param evaluator the needle and haystack
+ * @param distance the largest acceptable distance
+ * @param match if not null, receives the first translation in raster order within distance
+ * @param step the spacing of the translations tried
+ * @return whether such a translation exists
+ */
+inline bool findTranslationWithin(BitplaneHausdorff& evaluator, int distance, CvPoint* match = 0, int step = 1)
+{
+    for (int y = 0; y < evaluator.maxOffsetY(); y += step)
+    {
+        for (int x = 0; x < evaluator.maxOffsetX(); x += step)
+        {
+            if (evaluator.within(cvPoint(x, y), distance))
+            {
+                if (match)
+                    *match = cvPoint(x, y);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+#endif
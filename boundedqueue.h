@@ -0,0 +1,110 @@
+/**
+ * @file boundedqueue.h Provides a blocking queue of limited capacity for handing work
+ * between threads.
+ */
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+// Standard library
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+
+/**
+* A first-in, first-out queue shared by producer and consumer threads.
+*
+* push() blocks while the queue is full, so a fast producer is held back to the
+* pace of its consumers (backpressure) instead of piling up work in memory. pop()
+* blocks while the queue is empty. Once the producers are done they close() the
+* queue; consumers then drain what is left, after which pop() returns false.
+*
+* Example:
+* @code
+*   BoundedQueue<Job> queue(4);
+*   std::thread consumer([&]() {
+*       Job job;
+*       while (queue.pop(job))
+*           process(job);
+*   });
+*   for (size_t i = 0; i < jobs.size(); ++i)
+*       queue.push(jobs[i]);
+*   queue.close();
+*   consumer.join();
+* @endcode
+*/
+template <typename T>
+class BoundedQueue
+{
+public:
+    /**
+     * @param capacity the most items the queue holds before push() blocks
+     */
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity > 0 ? capacity : 1), closed(false)
+    {}
+
+    /**
+     * Adds an item to the back of the queue, waiting for room if it is full.
+     *
+     * @return false if the queue was closed, in which case the item is dropped
+     */
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]() {
+            return closed || items.size() < capacity;
+        });
+        if (closed)
+            return false;
+
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * Removes the item at the front of the queue, waiting for one if it is empty.
+     *
+     * @return false if the queue is closed and empty
+     */
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]() {
+            return closed || !items.empty();
+        });
+        if (items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * Stops the queue accepting items and wakes every waiting thread.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator= (const BoundedQueue&);
+
+    const size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * @file branchandbound.h Provides an exact branch-and-bound search for the translation of
+ * a needle that minimizes the Hausdorff distance.
+ */
+
+#ifndef BRANCHANDBOUND_H
+#define BRANCHANDBOUND_H
+
+// Standard library
+#include <limits>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// Opencv
+#include "cv.h"
+
+// Search algorithms
+#include "search.h"
+
+/**
+ * Counters describing the work done by a branch-and-bound search.
+ */
+struct BranchAndBoundStats
+{
+    BranchAndBoundStats()
+        : cellsExpanded(0), cellsPruned(0), translationsEvaluated(0), pointsEvaluated(0)
+    {}
+
+    // Cells that were split into smaller cells
+    unsigned long cellsExpanded;
+
+    // Cells that were discarded because their lower bound could not beat the best match
+    unsigned long cellsPruned;
+
+    // Single translations whose exact distance was evaluated
+    unsigned long translationsEvaluated;
+
+    // Edge points looked up in a distance transform, for bounds and evaluations
+    unsigned long pointsEvaluated;
+};
+
+/**
+ * A rectangular cell of translations, [x, x + width) x [y, y + height), together
+ * with a lower bound on the Hausdorff distance of every translation in it.
+ */
+struct TranslationCell
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    double lowerBound;
+};
+
+/**
+ * Orders cells for std::priority_queue so that the cell with the smallest lower
+ * bound comes out first, with ties going to the cell that comes first in raster order.
+ */
+struct TranslationCellOrder
+{
+    bool operator()(const TranslationCell& a, const TranslationCell& b) const
+    {
+        if (a.lowerBound != b.lowerBound)
+            return a.lowerBound > b.lowerBound;
+        return a.y > b.y || (a.y == b.y && a.x > b.x);
+    }
+};
+
+/**
+ * Decides whether a cell can't contain a translation that beats the best match,
+ * i.e. whether its lower bound is worse or, if it is equal, whether every translation
+ * in it comes after the best translation in raster order.
+ */
+inline bool cellCannotWin(const TranslationCell& cell, double bestDistance, const CvPoint& bestPoint)
+{
+    return !isBetterTranslation(cell.lowerBound, cvPoint(cell.x, cell.y), bestDistance, bestPoint);
+}
+
+/**
+ * Bounds the Hausdorff distance of every translation in a cell from below.
+ *
+ * A distance transform changes by at most 1 between pixels 1 apart, so for any
+ * translation t in the cell and the cell's centre c, DT(p + t) >= DT(p + c) - |t - c|,
+ * where |t - c| is at most r, the L1 radius of the cell around c. The forward
+ * Hausdorff distance, and with it the full distance, is therefore at least the
+ * forward distance at c minus r. This holds for L1, L2 and chessboard distance
+ * transforms alike, since none of them grows faster than the L1 distance, and for
+ * their quantized versions, since truncating to whole units and saturating at a
+ * cap keep that property for the whole-unit radius r * distanceScale.
+ * Lowering every point's value by at most r lowers any of their ranked values by at
+ * most r too, so the partial forward distance at c bounds partial distances the same way.
+ *
+ * @param context the needle and haystack
+ * @param cell the cell to bound
+ * @param threshold the bound only needs to be exact up to threshold; if it exceeds
+ *     threshold, some value greater than threshold is returned
+ * @param stats receives the number of points evaluated
+ * @return the lower bound
+ */
+template <typename DistanceT>
+double boundTranslationCell(
+    const BasicSearchContext<DistanceT>& context,
+    const TranslationCell& cell,
+    double threshold,
+    BranchAndBoundStats& stats)
+{
+    const int centreX = cell.x + (cell.width - 1) / 2;
+    const int centreY = cell.y + (cell.height - 1) / 2;
+    const int radius = std::max(centreX - cell.x, cell.x + cell.width - 1 - centreX) +
+                       std::max(centreY - cell.y, cell.y + cell.height - 1 - centreY);
+
+    unsigned long points = 0;
+    const double centreDistance = findPartialHausdorffDistanceBounded(
+                                      *context.needlePoints, *context.haystackDistanceTransform,
+                                      cvPoint(centreX, centreY), context.forwardFraction,
+                                      context.toUnits(threshold + radius), &points);
+    stats.pointsEvaluated += points;
+
+    return context.toPixels(centreDistance) - radius;
+}
+
+/*
+ * Finds the translation of needle in haystack that results in the minimal Hausdorff distance
+ * using a branch-and-bound search over cells of translations, in the style of Huttenlocher
+ * and Rucklidge.
+ *
+ * The translation range is covered with square cells of initialCellSize offsets. Cells are
+ * kept in a priority queue ordered by their lower bound (see boundTranslationCell()); the
+ * most promising cell is split into four, and cells that can't beat the best translation
+ * found so far are discarded. Single translations are evaluated exactly.
+ *
+ * The result is exactly that of the exhaustive findBestTranslation(context, 1, ...) over
+ * the same range, including which translation wins a tie, but usually only a small
+ * fraction of the translations are evaluated.
+ *
+ * @param context the needle and haystack
+ * @param dist if not null, receives the distance of the best translation
+ * @param stats if not null, receives counters describing the search
+ * @param minX, minY, maxX, maxY the range of translations to search, as for findBestTranslation()
+ * @param initialCellSize the size of the cells the range is first divided into
+ * @param upperBound only translations with a distance of at most upperBound are of interest;
+ *     if none exists, the result is (0, 0) with a distance of std::numeric_limits<double>::max()
+ * @param sharedUpperBound if not null, a bound shared with searches running on other threads
+ *     (e.g. for other poses of the needle). It is read throughout the search as a further
+ *     upper bound, so that the search stops as soon as none of its cells can beat the best
+ *     match found by any of them, and is lowered whenever this search finds a better match.
+ * @return the best translation
+ */
+template <typename DistanceT>
+CvPoint findBestTranslationBranchAndBound(
+    const BasicSearchContext<DistanceT>& context,
+    double* dist = 0,
+    BranchAndBoundStats* stats = 0,
+    int minX = 0, int minY = 0,
+    int maxX = -1, int maxY = -1,
+    int initialCellSize = 32,
+    double upperBound = std::numeric_limits<double>::max(),
+    std::atomic<double>* sharedUpperBound = 0)
+{
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+    BranchAndBoundStats localStats;
+    BranchAndBoundStats& counters = stats ? *stats : localStats;
+    const unsigned long cellsPrunedBefore = counters.cellsPruned;
+
+    const int maxOffsetX = maxX != -1 ? maxX : context.maxOffsetX();
+    const int maxOffsetY = maxY != -1 ? maxY : context.maxOffsetY();
+
+    // Anything worse than upperBound is treated as a loss
+    double bestDistance = upperBound;
+    CvPoint bestPoint = cvPoint(std::numeric_limits<int>::max(), std::numeric_limits<int>::max());
+    bool found = false;
+
+    std::priority_queue<TranslationCell, std::vector<TranslationCell>, TranslationCellOrder> cells;
+
+    // The largest distance still of interest: the best found here, or a better one
+    // found by another search
+    auto limit = [&]() {
+        return sharedUpperBound ?
+               std::min(bestDistance, sharedUpperBound->load(std::memory_order_relaxed)) :
+               bestDistance;
+    };
+    auto cannotWin = [&](const TranslationCell& cell) {
+        return cell.lowerBound > limit() || (found && cellCannotWin(cell, bestDistance, bestPoint));
+    };
+
+    // Evaluates a single translation exactly, or bounds and queues a larger cell
+    auto visit = [&](TranslationCell cell) {
+        if (cell.width == 1 && cell.height == 1)
+        {
+            unsigned long points = 0;
+            const CvPoint point = cvPoint(cell.x, cell.y);
+            const double bound = limit();
+            const double distance = context.distanceAt(point, bound, &points);
+            counters.pointsEvaluated += points;
+            ++ counters.translationsEvaluated;
+
+            if (distance <= bound && (!found || isBetterTranslation(distance, point, bestDistance, bestPoint)))
+            {
+                bestDistance = distance;
+                bestPoint = point;
+                found = true;
+                if (sharedUpperBound)
+                    lowerSharedDistance(*sharedUpperBound, distance);
+            }
+            return;
+        }
+
+        cell.lowerBound = boundTranslationCell(context, cell, limit(), counters);
+        if (cannotWin(cell))
+        {
+            ++ counters.cellsPruned;
+            return;
+        }
+        cells.push(cell);
+    };
+
+    for (int y = minY; y < maxOffsetY; y += initialCellSize)
+    {
+        for (int x = minX; x < maxOffsetX; x += initialCellSize)
+        {
+            TranslationCell cell;
+            cell.x = x;
+            cell.y = y;
+            cell.width = std::min(initialCellSize, maxOffsetX - x);
+            cell.height = std::min(initialCellSize, maxOffsetY - y);
+            visit(cell);
+        }
+    }
+
+    while (!cells.empty())
+    {
+        const TranslationCell cell = cells.top();
+        cells.pop();
+
+        // The queue is ordered by lower bound, so once one cell can't win, none can
+        if (cannotWin(cell))
+        {
+            counters.cellsPruned += 1 + cells.size();
+            break;
+        }
+
+        // Split the cell into (up to) four quarters
+        ++ counters.cellsExpanded;
+        const int leftWidth = (cell.width + 1) / 2;
+        const int topHeight = (cell.height + 1) / 2;
+        for (int half = 0; half < 4; ++half)
+        {
+            TranslationCell child;
+            child.x = (half & 1) ? cell.x + leftWidth : cell.x;
+            child.y = (half & 2) ? cell.y + topHeight : cell.y;
+            child.width = (half & 1) ? cell.width - leftWidth : leftWidth;
+            child.height = (half & 2) ? cell.height - topHeight : topHeight;
+            if (child.width > 0 && child.height > 0)
+                visit(child);
+        }
+    }
+
+    profileCount(PROFILE_CELLS_PRUNED, counters.cellsPruned - cellsPrunedBefore);
+    if (dist)
+        *dist = found ? bestDistance : std::numeric_limits<double>::max();
+
+    return found ? bestPoint : cvPoint(0, 0);
+}
+
+#endif
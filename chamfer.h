@@ -0,0 +1,348 @@
+/**
+ * @file chamfer.h Provides a chamfer pre-screen that scores every translation of a needle
+ * at once by FFT correlation, so that the exact Hausdorff distance only needs to be
+ * evaluated for the most promising translations.
+ */
+
+#ifndef CHAMFER_H
+#define CHAMFER_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <stdexcept>
+
+// Opencv
+#include "cv.h"
+
+// Search algorithms
+#include "search.h"
+
+/**
+ * A translation of the needle and its mean chamfer distance.
+ */
+struct ChamferCandidate
+{
+    CvPoint offset;
+    double meanChamfer;
+};
+
+/**
+ * Orders candidates by mean chamfer distance, with ties going to the candidate that
+ * comes first in raster order.
+ */
+struct ChamferCandidateOrder
+{
+    bool operator()(const ChamferCandidate& a, const ChamferCandidate& b) const
+    {
+        if (a.meanChamfer != b.meanChamfer)
+            return a.meanChamfer < b.meanChamfer;
+        return a.offset.y < b.offset.y || (a.offset.y == b.offset.y && a.offset.x < b.offset.x);
+    }
+};
+
+/**
+* The mean chamfer distance of the needle at every translation in the haystack.
+*
+* The chamfer distance at a translation t is the sum of DT(p + t) over the needle's
+* edge points p, where DT is the haystack's distance transform. That is the
+* correlation of the needle's edge indicator image with DT, so it is computed for
+* all translations at once as IDFT(DFT(DT) * conj(DFT(needle))), in
+* O(N log N) for an N pixel haystack, instead of O(translations x points).
+*
+* The mean of DT(p + t) over the needle points can't exceed their maximum, the
+* forward Hausdorff distance, so the mean chamfer distance is a lower bound on the
+* Hausdorff distance at every translation.
+*
+* Example:
+* @code
+*   ChamferMap map(context);
+*   std::vector<ChamferCandidate> best = map.candidates(100);
+* @endcode
+*/
+class ChamferMap
+{
+public:
+    /**
+     * Scores every translation in [0, maxOffsetX) x [0, maxOffsetY) of the context.
+     */
+    template <typename DistanceT>
+    explicit ChamferMap(const BasicSearchContext<DistanceT>& context)
+        : columns(std::max(0, context.maxOffsetX())),
+          rows(std::max(0, context.maxOffsetY())),
+          slack(0)
+    {
+        const EdgePointList& needlePoints = *context.needlePoints;
+        const Image<DistanceT>& distanceTransform = *context.haystackDistanceTransform;
+        if (columns == 0 || rows == 0)
+            return;
+
+        scores.assign(static_cast<size_t>(columns) * rows, 0.0);
+        if (needlePoints.empty())
+            return;
+
+        // Translations never move a needle point past the haystack, so a transform the
+        // size of the haystack (rounded up to a fast size) never wraps around
+        const CvSize size = cvSize(cvGetOptimalDFTSize(distanceTransform.width()),
+                                   cvGetOptimalDFTSize(distanceTransform.height()));
+        CvImage haystackSpectrum(size, IPL_DEPTH_64F, 2);
+        CvImage needleSpectrum(size, IPL_DEPTH_64F, 2);
+        cvZero(haystackSpectrum);
+        cvZero(needleSpectrum);
+
+        double distanceNorm = 0;
+        for (int y = 0; y < distanceTransform.height(); ++y)
+        {
+            const DistanceT* const row = distanceTransform[y];
+            double* const complexRow = reinterpret_cast<double*>(haystackSpectrum.data() + y * haystackSpectrum.step());
+            for (int x = 0; x < distanceTransform.width(); ++x)
+            {
+                complexRow[2 * x] = row[x];
+                distanceNorm += static_cast<double>(row[x]) * row[x];
+            }
+        }
+
+        const int* const xs = needlePoints.xs();
+        const int* const ys = needlePoints.ys();
+        for (size_t i = 0; i < needlePoints.size(); ++i)
+        {
+            double* const complexRow = reinterpret_cast<double*>(needleSpectrum.data() + ys[i] * needleSpectrum.step());
+            complexRow[2 * xs[i]] = 1.0;
+        }
+
+        // Correlate
+        cvDFT(haystackSpectrum, haystackSpectrum, CV_DXT_FORWARD);
+        cvDFT(needleSpectrum, needleSpectrum, CV_DXT_FORWARD);
+        cvMulSpectrums(haystackSpectrum, needleSpectrum, haystackSpectrum, CV_DXT_MUL_CONJ);
+        cvDFT(haystackSpectrum, haystackSpectrum, CV_DXT_INV_SCALE);
+
+        const double pointCount = static_cast<double>(needlePoints.size());
+        const double unitsPerPoint = pointCount * context.distanceScale;
+        for (int y = 0; y < rows; ++y)
+        {
+            const double* const complexRow = reinterpret_cast<const double*>(haystackSpectrum.data() + y * haystackSpectrum.step());
+            double* const scoreRow = &scores[static_cast<size_t>(y) * columns];
+            for (int x = 0; x < columns; ++x)
+                scoreRow[x] = std::max(0.0, complexRow[2 * x]) / unitsPerPoint;
+        }
+
+        // Rounding in the transforms perturbs each correlation by at most a small
+        // multiple of eps * log2(N) * |DT| * |needle| (2-norms); lowerBound() allows
+        // for that so that it never prunes a translation it shouldn't
+        slack = 16 * DBL_EPSILON * std::log(static_cast<double>(size.width) * size.height) / std::log(2.0) *
+                std::sqrt(distanceNorm) * std::sqrt(pointCount) / unitsPerPoint;
+    }
+
+    // The number of translations scored along each axis
+    int width() const
+    {
+        return columns;
+    }
+    int height() const
+    {
+        return rows;
+    }
+
+    // The mean chamfer distance of the needle at offset (x, y)
+    double meanChamfer(int x, int y) const
+    {
+        return scores[static_cast<size_t>(y) * columns + x];
+    }
+
+    // A lower bound on the Hausdorff distance of the needle at offset (x, y)
+    double lowerBound(int x, int y) const
+    {
+        return meanChamfer(x, y) - slack;
+    }
+
+    /**
+     * Lists the translations with a mean chamfer distance of at most maxMeanChamfer,
+     * in no particular order.
+     */
+    std::vector<ChamferCandidate> unsortedCandidates(
+        double maxMeanChamfer = std::numeric_limits<double>::max()) const
+    {
+        std::vector<ChamferCandidate> result;
+        for (int y = 0; y < rows; ++y)
+        {
+            for (int x = 0; x < columns; ++x)
+            {
+                if (meanChamfer(x, y) <= maxMeanChamfer)
+                {
+                    ChamferCandidate candidate;
+                    candidate.offset = cvPoint(x, y);
+                    candidate.meanChamfer = meanChamfer(x, y);
+                    result.push_back(candidate);
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Lists the translations with the lowest mean chamfer distance, best first.
+     *
+     * @param maxCandidates the most translations to list, or 0 for no limit
+     * @param maxMeanChamfer only translations with a mean chamfer distance of at most
+     *     this are listed
+     */
+    std::vector<ChamferCandidate> candidates(
+        size_t maxCandidates = 0,
+        double maxMeanChamfer = std::numeric_limits<double>::max()) const
+    {
+        std::vector<ChamferCandidate> result = unsortedCandidates(maxMeanChamfer);
+        if (maxCandidates != 0 && result.size() > maxCandidates)
+        {
+            std::nth_element(result.begin(), result.begin() + maxCandidates, result.end(), ChamferCandidateOrder());
+            result.resize(maxCandidates);
+        }
+        std::sort(result.begin(), result.end(), ChamferCandidateOrder());
+        return result;
+    }
+
+private:
+    int columns;
+    int rows;
+    std::vector<double> scores;
+    double slack;
+};
+
+/**
+ * Parameters of a chamfer pre-screened translation search.
+ */
+struct ChamferPrescreenOptions
+{
+    ChamferPrescreenOptions()
+        : maxCandidates(256),
+          maxMeanChamfer(std::numeric_limits<double>::max()),
+          exact(false)
+    {}
+
+    // Verify at most this many of the best translations (0 for no limit)
+    size_t maxCandidates;
+
+    // Verify only translations with a mean chamfer distance of at most this
+    double maxMeanChamfer;
+
+    // Ignore the limits above and verify translations in order of mean chamfer
+    // distance until the mean chamfer distance proves that none of the rest can win.
+    // The result is then exactly that of findBestTranslation(context, 1, ...).
+    bool exact;
+};
+
+/**
+ * Counters describing the work done by a chamfer pre-screened search.
+ */
+struct ChamferPrescreenStats
+{
+    ChamferPrescreenStats()
+        : translationsScreened(0), candidatesKept(0), translationsEvaluated(0), pointsEvaluated(0)
+    {}
+
+    // Translations scored by the chamfer pre-screen
+    unsigned long translationsScreened;
+
+    // Translations that passed the pre-screen (not counted in exact mode)
+    unsigned long candidatesKept;
+
+    // Translations whose exact distance was evaluated
+    unsigned long translationsEvaluated;
+
+    // Edge points looked up in a distance transform by the evaluations
+    unsigned long pointsEvaluated;
+};
+
+/*
+ * Finds the translation of needle in haystack that results in the minimal Hausdorff distance,
+ * evaluating the exact distance only for translations that a chamfer pre-screen (see
+ * ChamferMap) picks out.
+ *
+ * By default only the options.maxCandidates translations with the lowest mean chamfer
+ * distance are verified, which usually, but not always, includes the best translation.
+ * With options.exact, translations are verified in order of mean chamfer distance until
+ * the rest can't win, and the result is exactly that of findBestTranslation(context, 1, ...).
+ * The mean chamfer distance does not bound partial Hausdorff distances, so exact mode
+ * needs a context with fractions of 1.
+ *
+ * @param context the needle and haystack
+ * @param options which translations to verify
+ * @param dist if not null, receives the distance of the best translation
+ * @param stats if not null, receives counters describing the search
+ * @return the best translation, or (0, 0) if no translation was verified
+ * @throws std::invalid_argument if options.exact is set and the context uses partial distances
+ */
+template <typename DistanceT>
+CvPoint findBestTranslationPrescreened(
+    const BasicSearchContext<DistanceT>& context,
+    const ChamferPrescreenOptions& options = ChamferPrescreenOptions(),
+    double* dist = 0,
+    ChamferPrescreenStats* stats = 0)
+{
+    if (options.exact && context.isPartial())
+        throw std::invalid_argument("An exact chamfer pre-screened search can't use partial distances.");
+
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+    ChamferPrescreenStats localStats;
+    ChamferPrescreenStats& counters = stats ? *stats : localStats;
+
+    const ChamferMap map(context);
+    counters.translationsScreened += static_cast<unsigned long>(map.width()) * map.height();
+
+    double bestDistance = std::numeric_limits<double>::max();
+    CvPoint bestPoint = cvPoint(0, 0);
+    bool found = false;
+
+    // Keeps the translation if it beats the best so far
+    auto verify = [&](const CvPoint& point) {
+        unsigned long points = 0;
+        const double distance = context.distanceAt(point, bestDistance, &points);
+        counters.pointsEvaluated += points;
+        ++ counters.translationsEvaluated;
+
+        if (distance <= bestDistance && (!found || isBetterTranslation(distance, point, bestDistance, bestPoint)))
+        {
+            bestDistance = distance;
+            bestPoint = point;
+            found = true;
+        }
+    };
+
+    if (options.exact)
+    {
+        // Pop translations off a heap so that only the ones that are verified get sorted
+        std::vector<ChamferCandidate> heap = map.unsortedCandidates();
+        const auto worseFirst = [](const ChamferCandidate& a, const ChamferCandidate& b) {
+            return ChamferCandidateOrder()(b, a);
+        };
+        std::make_heap(heap.begin(), heap.end(), worseFirst);
+        while (!heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), worseFirst);
+            const CvPoint point = heap.back().offset;
+            heap.pop_back();
+
+            // Candidates come out in order of their lower bound, so once one can't
+            // reach the best distance, none of the rest can
+            if (found && map.lowerBound(point.x, point.y) > bestDistance)
+                break;
+            verify(point);
+        }
+    }
+    else
+    {
+        const std::vector<ChamferCandidate> candidates = map.candidates(options.maxCandidates, options.maxMeanChamfer);
+        counters.candidatesKept += candidates.size();
+        for (size_t i = 0; i < candidates.size(); ++i)
+            verify(candidates[i].offset);
+    }
+
+    if (dist)
+        *dist = bestDistance;
+
+    return bestPoint;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/**
+ * @file detection.h Provides a search for every instance of the needle in the haystack.
+ */
+
+#ifndef DETECTION_H
+#define DETECTION_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+// Opencv
+#include "cv.h"
+
+// Search algorithms
+#include "search.h"
+
+/**
+* One placement of the needle in the haystack.
+*/
+struct Detection
+{
+    Detection()
+        : translation(cvPoint(0, 0)), distance(std::numeric_limits<double>::max())
+    {}
+    Detection(const CvPoint& translation, double distance)
+        : translation(translation), distance(distance)
+    {}
+
+    CvPoint translation;
+    double distance;
+};
+
+/**
+* Orders detections from best to worst, breaking ties the way isBetterTranslation() does.
+*/
+struct DetectionOrder
+{
+    bool operator()(const Detection& a, const Detection& b) const
+    {
+        return isBetterTranslation(a.distance, a.translation, b.distance, b.translation);
+    }
+};
+
+/**
+* Settings of findDetections().
+*/
+struct DetectionOptions
+{
+    DetectionOptions()
+        : maxDistance(std::numeric_limits<double>::max()),
+          maxDetections(0),
+          maxOverlap(0.3),
+          step(1)
+    {}
+
+    // Placements further than this from the haystack are not detections
+    double maxDistance;
+
+    // The most detections returned, best first; 0 for no limit
+    size_t maxDetections;
+
+    // Two placements whose needle rectangles overlap by more than this fraction
+    // (intersection over union) are the same instance; the worse one is suppressed
+    double maxOverlap;
+
+    // The distance between the offsets searched
+    int step;
+};
+
+/**
+ * Finds the fraction by which the needle rectangles at two translations overlap
+ * (their intersection over their union).
+ */
+inline double overlapOf(const CvPoint& a, const CvPoint& b, int width, int height)
+{
+    const double overlapWidth = std::max(0, width - abs(a.x - b.x));
+    const double overlapHeight = std::max(0, height - abs(a.y - b.y));
+    const double intersection = overlapWidth * overlapHeight;
+    const double area = static_cast<double>(width) * height;
+    return area > 0 ? intersection / (2 * area - intersection) : 0;
+}
+
+/**
+* The detections kept so far by a search for every instance of the needle.
+*
+* Each translation offered goes through non-maximum suppression as it is found:
+* it is dropped if a better kept detection overlaps it by more than
+* options.maxOverlap, and otherwise it replaces every worse detection it overlaps.
+* The kept detections never overlap each other, and at most options.maxDetections
+* of them are kept in a heap whose worst member is evicted by anything better.
+*
+* Unlike greedy suppression over a sorted list of every translation, a detection
+* that is later replaced does not restore the worse detections it suppressed
+* earlier. That only matters for chains of instances closer together than the
+* overlap allows, where it reports fewer of them. Detections offered best first
+* get exactly the greedy result.
+*/
+class DetectionSet
+{
+public:
+    /**
+     * @param options the threshold, limit and overlap of the detections
+     * @param needleWidth, needleHeight the size of the rectangle of a detection
+     */
+    DetectionSet(const DetectionOptions& options, int needleWidth, int needleHeight)
+        : options(options), width(needleWidth), height(needleHeight),
+          capacity(options.maxDetections > 0 ? options.maxDetections : std::numeric_limits<size_t>::max())
+    {}
+
+    /**
+     * The largest distance a translation can have and still be kept. Once the
+     * set is full, that is the distance of its worst member.
+     */
+    double threshold() const
+    {
+        return full() ? std::min(options.maxDistance, kept.front().distance) : options.maxDistance;
+    }
+
+    /**
+     * Offers a translation to the set.
+     *
+     * @return whether it was kept
+     */
+    bool offer(const Detection& candidate)
+    {
+        // Rejected translations return some value above threshold, not their distance
+        if (candidate.distance > threshold() || (full() && !order(candidate, kept.front())))
+            return false;
+
+        // Suppress the candidate if a better detection overlaps it...
+        for (size_t i = 0; i < kept.size(); ++i)
+        {
+            if (order(kept[i], candidate) &&
+                    overlapOf(kept[i].translation, candidate.translation, width, height) > options.maxOverlap)
+                return false;
+        }
+
+        // ...or else the detections it overlaps
+        std::vector<Detection>::iterator end = kept.end();
+        for (std::vector<Detection>::iterator i = kept.begin(); i != end;)
+        {
+            if (overlapOf(i->translation, candidate.translation, width, height) > options.maxOverlap)
+                *i = *--end;
+            else
+                ++i;
+        }
+
+        if (end != kept.end())
+        {
+            kept.erase(end, kept.end());
+            std::make_heap(kept.begin(), kept.end(), order);
+        }
+        else if (full())
+        {
+            std::pop_heap(kept.begin(), kept.end(), order);
+            kept.pop_back();
+        }
+        kept.push_back(candidate);
+        std::push_heap(kept.begin(), kept.end(), order);
+        return true;
+    }
+
+    /**
+     * @return the kept detections, best first
+     */
+    std::vector<Detection> detections() const
+    {
+        std::vector<Detection> sorted(kept);
+        std::sort_heap(sorted.begin(), sorted.end(), order);
+        return sorted;
+    }
+
+private:
+    bool full() const
+    {
+        return kept.size() >= capacity;
+    }
+
+    const DetectionOptions options;
+    const int width;
+    const int height;
+    const size_t capacity;
+    DetectionOrder order;
+
+    // Heap of the kept detections with the worst on top
+    std::vector<Detection> kept;
+};
+
+/*
+ * Finds every instance of the needle in the haystack: the translations within
+ * options.maxDistance of the haystack, or the options.maxDetections best of them,
+ * with each instance reported once.
+ *
+ * The offsets are visited once, in raster order, and each translation is offered
+ * to a DetectionSet as it is found. Once the set is full, the distance of its
+ * worst member is the admission threshold, so the Hausdorff kernels reject most
+ * translations early.
+ *
+ * @return the detections, best first
+ */
+template <typename DistanceT>
+std::vector<Detection> findDetections(const BasicSearchContext<DistanceT>& context,
+                                      const DetectionOptions& options = DetectionOptions())
+{
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+    const int step = std::max(1, options.step);
+    DetectionSet detections(options, context.needleWidth(), context.needleHeight());
+
+    for (int y = 0; y < context.maxOffsetY(); y += step)
+    {
+        for (int x = 0; x < context.maxOffsetX(); x += step)
+        {
+            const double threshold = detections.threshold();
+            detections.offer(Detection(cvPoint(x, y), context.distanceAt(cvPoint(x, y), threshold)));
+        }
+    }
+
+    return detections.detections();
+}
+
+#endif
@@ -0,0 +1,402 @@
+/**
+ * @file distancetransform.h Provides a parallel, exact distance transform and compact,
+ * quantized distance transforms.
+ */
+
+#ifndef DISTANCETRANSFORM_H
+#define DISTANCETRANSFORM_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <math.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+/**
+ * The ways of measuring the distance between two pixels.
+ */
+enum DistanceMetric
+{
+    // |dx| + |dy|
+    DISTANCE_L1,
+
+    // max(|dx|, |dy|)
+    DISTANCE_CHESSBOARD,
+
+    // sqrt(dx^2 + dy^2), computed exactly
+    DISTANCE_L2
+};
+
+/**
+ * Settings of computeSeparableDistanceTransform().
+ */
+struct DistanceTransformOptions
+{
+    DistanceTransformOptions()
+        : metric(DISTANCE_L1),
+          scale(1.0),
+          cap(std::numeric_limits<double>::max()),
+          roi(cvRect(0, 0, 0, 0)),
+          pool(0)
+    {}
+
+    DistanceMetric metric;
+
+    // Units of the output per pixel; integer outputs are truncated to whole units
+    double scale;
+
+    // The largest value stored, in units of the output. The type's largest value
+    // also caps the output.
+    double cap;
+
+    // The pixels to compute; an empty rectangle means the whole image. The rest of
+    // the output is left as it was.
+    CvRect roi;
+
+    // If not null, the threads to compute on
+    WorkStealingPool* pool;
+};
+
+/**
+ * The one-dimensional distance functions of the separable transform (see
+ * computeSeparableDistanceTransform()): f() is the distance from column x to the
+ * nearest edge pixel in column i, which is g pixels above or below, and sep() is
+ * the last column that is at least as close to column i's edge as to column u's
+ * (i < u). Distances are squared for DISTANCE_L2.
+ */
+struct L1DistanceFunctions
+{
+    static long long f(long long x, long long i, long long g)
+    {
+        return (x > i ? x - i : i - x) + g;
+    }
+    static long long sep(long long i, long long u, long long gi, long long gu)
+    {
+        if (gu >= gi + u - i)
+            return std::numeric_limits<int>::max();
+        if (gi > gu + u - i)
+            return std::numeric_limits<int>::min();
+        return floorDivide(gu - gi + u + i, 2);
+    }
+    static double toPixels(long long distance)
+    {
+        return static_cast<double>(distance);
+    }
+    static long long floorDivide(long long a, long long b)
+    {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    }
+};
+
+struct ChessboardDistanceFunctions : L1DistanceFunctions
+{
+    static long long f(long long x, long long i, long long g)
+    {
+        return std::max(x > i ? x - i : i - x, g);
+    }
+    static long long sep(long long i, long long u, long long gi, long long gu)
+    {
+        if (gi <= gu)
+            return std::max(i + gu, floorDivide(i + u, 2));
+        return std::min(u - gi, floorDivide(i + u, 2));
+    }
+};
+
+struct L2DistanceFunctions : L1DistanceFunctions
+{
+    static long long f(long long x, long long i, long long g)
+    {
+        return (x - i) * (x - i) + g * g;
+    }
+    static long long sep(long long i, long long u, long long gi, long long gu)
+    {
+        return floorDivide(u * u - i * i + gu * gu - gi * gi, 2 * (u - i));
+    }
+    static double toPixels(long long distance)
+    {
+        return sqrt(static_cast<double>(distance));
+    }
+};
+
+/**
+ * Computes the row pass of the separable transform for one row: finds the lower
+ * envelope of the distance functions of the columns and reads the output off it.
+ */
+template <typename Functions, typename OutputT>
+void transformDistanceRow(
+    const int* columnDistances, int width,
+    int firstOutput, int outputCount, OutputT* output,
+    double scale, double limit,
+    std::vector<int>& sites, std::vector<int>& starts)
+{
+    // sites[0..q] are the columns on the lower envelope, and starts[k] the first
+    // column where sites[k] is nearest
+    int q = 0;
+    sites[0] = 0;
+    starts[0] = 0;
+    for (int u = 1; u < width; ++u)
+    {
+        while (q >= 0 &&
+                Functions::f(starts[q], sites[q], columnDistances[sites[q]]) >
+                Functions::f(starts[q], u, columnDistances[u]))
+            --q;
+
+        if (q < 0)
+        {
+            q = 0;
+            sites[0] = u;
+        }
+        else
+        {
+            const long long w = 1 + Functions::sep(sites[q], u, columnDistances[sites[q]], columnDistances[u]);
+            if (w < width)
+            {
+                ++q;
+                sites[q] = u;
+                starts[q] = static_cast<int>(w);
+            }
+        }
+    }
+
+    for (int u = width - 1; u >= 0; --u)
+    {
+        if (u >= firstOutput && u < firstOutput + outputCount)
+        {
+            const double units = Functions::toPixels(Functions::f(u, sites[q], columnDistances[sites[q]])) * scale;
+            const double value = std::numeric_limits<OutputT>::is_integer ? floor(units) : units;
+            output[u - firstOutput] = static_cast<OutputT>(std::min(value, limit));
+        }
+        if (u == starts[q])
+            --q;
+    }
+}
+
+/**
+ * Computes the distance from every pixel of an edge image to the nearest edge (0)
+ * pixel with the linear-time separable algorithm of Meijster et al. (the same idea
+ * as Felzenszwalb and Huttenlocher's): a column pass finds the distance to the
+ * nearest edge pixel in the same column, and a row pass then takes the lower
+ * envelope of those distances along each row. Both passes split the image into
+ * blocks that are computed on options.pool, if given.
+ *
+ * All three metrics are exact, and the output can be any pixel type. Written to
+ * an Intensity16 or Intensity image, it gives the quantized transform of
+ * quantizeDistanceTransform() without going through a float one. Only the pixels
+ * of options.roi are computed. When the output is capped, an edge further than
+ * the cap from the ROI can't change it, so only the ROI and a margin of the cap
+ * are read. Without edges within reach, a pixel's distance is larger than the
+ * image (or the cap).
+ *
+ * Example:
+ * @code
+ *   DistanceTransformOptions options;
+ *   options.metric = DISTANCE_L2;
+ *   options.scale = 4;
+ *   options.pool = &pool;
+ *   Image<Intensity16> distanceTransform(edges.width(), edges.height());
+ *   computeSeparableDistanceTransform(edges, distanceTransform, options);
+ * @endcode
+ *
+ * @param edges the edge image, with edges black (0)
+ * @param distanceTransform receives the distances; must be the same size as edges
+ * @param options the metric, scale, cap and region of the transform
+ */
+template <typename OutputT>
+void computeSeparableDistanceTransform(
+    const Image<Intensity>& edges,
+    Image<OutputT>& distanceTransform,
+    const DistanceTransformOptions& options = DistanceTransformOptions())
+{
+    ProfileScope profile(PROFILE_DISTANCE_TRANSFORM);
+    const int width = edges.width();
+    const int height = edges.height();
+
+    // The region to output, and the region whose edges can affect it
+    CvRect roi = cvRect(0, 0, width, height);
+    if (options.roi.width > 0 && options.roi.height > 0)
+    {
+        const int left = std::max(0, options.roi.x);
+        const int top = std::max(0, options.roi.y);
+        const int right = std::min(width, options.roi.x + options.roi.width);
+        const int bottom = std::min(height, options.roi.y + options.roi.height);
+        if (right <= left || bottom <= top)
+            return;
+        roi = cvRect(left, top, right - left, bottom - top);
+    }
+    const double limit = std::min<double>(options.cap, std::numeric_limits<OutputT>::max());
+    int margin = std::max(width, height);
+    if (limit / options.scale < margin)
+        margin = static_cast<int>(ceil(limit / options.scale)) + 1;
+    const int sourceLeft = std::max(0, roi.x - margin);
+    const int sourceTop = std::max(0, roi.y - margin);
+    const int sourceWidth = std::min(width, roi.x + roi.width + margin) - sourceLeft;
+    const int sourceHeight = std::min(height, roi.y + roi.height + margin) - sourceTop;
+
+    // Further than any distance within the source region
+    const int infinity = sourceWidth + sourceHeight;
+
+    // Splits count items into blocks and runs body(first, end) on each
+    const auto forEachBlock = [&](int count, int blockSize, const std::function<void(int, int)>& body) {
+        const int blocks = (count + blockSize - 1) / blockSize;
+        const auto runBlock = [&](size_t block, unsigned) {
+            const int first = static_cast<int>(block) * blockSize;
+            body(first, std::min(count, first + blockSize));
+        };
+        if (options.pool)
+            options.pool->run(blocks, runBlock);
+        else
+            for (int block = 0; block < blocks; ++block)
+                runBlock(block, 0);
+    };
+
+    // Column pass: the distance to the nearest edge pixel above or below, walking
+    // blocks of columns a row at a time so that each pass reads memory in order
+    std::vector<int> columnDistances(static_cast<size_t>(sourceWidth) * sourceHeight);
+    forEachBlock(sourceWidth, 256, [&](int firstColumn, int endColumn) {
+        for (int y = 0; y < sourceHeight; ++y)
+        {
+            const Intensity* const edgeRow = edges[sourceTop + y] + sourceLeft;
+            int* const row = &columnDistances[static_cast<size_t>(y) * sourceWidth];
+            const int* const above = y > 0 ? row - sourceWidth : 0;
+            for (int x = firstColumn; x < endColumn; ++x)
+            {
+                if (edgeRow[x] == 0)
+                    row[x] = 0;
+                else
+                    row[x] = above ? std::min(above[x] + 1, infinity) : infinity;
+            }
+        }
+        for (int y = sourceHeight - 2; y >= 0; --y)
+        {
+            int* const row = &columnDistances[static_cast<size_t>(y) * sourceWidth];
+            const int* const below = row + sourceWidth;
+            for (int x = firstColumn; x < endColumn; ++x)
+                row[x] = std::min(row[x], below[x] + 1);
+        }
+    });
+
+    // Row pass over the rows of the ROI
+    forEachBlock(roi.height, 16, [&](int firstRow, int endRow) {
+        std::vector<int> sites(sourceWidth);
+        std::vector<int> starts(sourceWidth);
+        for (int row = firstRow; row < endRow; ++row)
+        {
+            const int y = roi.y + row;
+            const int* const distances = &columnDistances[static_cast<size_t>(y - sourceTop) * sourceWidth];
+            OutputT* const output = distanceTransform[y] + roi.x;
+            const int firstOutput = roi.x - sourceLeft;
+            switch (options.metric)
+            {
+            case DISTANCE_CHESSBOARD:
+                transformDistanceRow<ChessboardDistanceFunctions>(distances, sourceWidth, firstOutput, roi.width,
+                        output, options.scale, limit, sites, starts);
+                break;
+            case DISTANCE_L2:
+                transformDistanceRow<L2DistanceFunctions>(distances, sourceWidth, firstOutput, roi.width,
+                        output, options.scale, limit, sites, starts);
+                break;
+            default:
+                transformDistanceRow<L1DistanceFunctions>(distances, sourceWidth, firstOutput, roi.width,
+                        output, options.scale, limit, sites, starts);
+                break;
+            }
+        }
+    });
+}
+
+/**
+ * Maps an OpenCV distance type (CV_DIST_L1, CV_DIST_L2 or CV_DIST_C) to a DistanceMetric.
+ */
+inline DistanceMetric distanceMetricOf(int distanceType)
+{
+    if (distanceType == CV_DIST_L2)
+        return DISTANCE_L2;
+    if (distanceType == CV_DIST_C)
+        return DISTANCE_CHESSBOARD;
+    return DISTANCE_L1;
+}
+
+/**
+ * Quantizes a float distance transform to whole units of 1 / scale pixels,
+ * saturating at cap units.
+ *
+ * An Intensity16 transform is half the size of a float one, and an Intensity
+ * transform a quarter, so far more of a large haystack's transform stays in cache
+ * during the scattered lookups of the Hausdorff kernels. Distances are truncated
+ * rather than rounded, which keeps a quantized transform from growing faster than
+ * the L1 distance between pixels (times scale), so the lower bounds of the
+ * branch-and-bound search still hold. L1 and chessboard transforms are whole
+ * numbers already and lose nothing with a scale of 1; give L2 transforms a larger
+ * scale (a power of two keeps conversions exact) for sub-pixel resolution.
+ *
+ * Every distance of cap / scale pixels or more reads as exactly cap / scale, so
+ * the cap should be above any distance a search cares about; translations beyond
+ * it all tie.
+ *
+ * Example:
+ * @code
+ *   Image<Intensity16> quantized(haystackDistanceTransform.width(), haystackDistanceTransform.height());
+ *   quantizeDistanceTransform(haystackDistanceTransform, quantized, 4, 1024);
+ * @endcode
+ *
+ * @param distanceTransform the transform to quantize
+ * @param quantized receives the quantized transform; must be the same size
+ * @param scale the number of units per pixel
+ * @param cap the largest value stored; defaults to the largest value of QuantizedT
+ */
+template <typename QuantizedT>
+void quantizeDistanceTransform(
+    const Image<Intensity32F>& distanceTransform,
+    Image<QuantizedT>& quantized,
+    unsigned scale = 1,
+    unsigned cap = std::numeric_limits<QuantizedT>::max())
+{
+    const double limit = std::min<double>(cap, std::numeric_limits<QuantizedT>::max());
+    for (int y = 0; y < distanceTransform.height(); ++y)
+    {
+        const Intensity32F* const source = distanceTransform[y];
+        QuantizedT* const destination = quantized[y];
+        for (int x = 0; x < distanceTransform.width(); ++x)
+        {
+            const double units = floor(static_cast<double>(source[x]) * scale);
+            destination[x] = static_cast<QuantizedT>(std::min(units, limit));
+        }
+    }
+}
+
+/**
+ * Computes the distance transform of an edge image directly in quantized form.
+ * See quantizeDistanceTransform() for the meaning of scale and cap.
+ *
+ * @param edges the edge image, with edges black (0)
+ * @param quantized receives the quantized transform; must be the same size
+ * @param distanceType CV_DIST_L1, CV_DIST_L2 or CV_DIST_C
+ * @param pool if not null, the threads to compute on
+ */
+template <typename QuantizedT>
+void computeQuantizedDistanceTransform(
+    const Image<Intensity>& edges,
+    Image<QuantizedT>& quantized,
+    int distanceType = CV_DIST_L1,
+    unsigned scale = 1,
+    unsigned cap = std::numeric_limits<QuantizedT>::max(),
+    WorkStealingPool* pool = 0)
+{
+    DistanceTransformOptions options;
+    options.metric = distanceMetricOf(distanceType);
+    options.scale = scale;
+    options.cap = cap;
+    options.pool = pool;
+    computeSeparableDistanceTransform(edges, quantized, options);
+}
+
+#endif
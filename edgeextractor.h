@@ -0,0 +1,479 @@
+/**
+ * @file edgeextractor.h Provides the edge detector that turns a photo into its edge
+ * image, edge points and bitplane in one banded pass, fusing the grayscale
+ * conversion, smoothing and Canny edge detection.
+ */
+
+#ifndef EDGEEXTRACTOR_H
+#define EDGEEXTRACTOR_H
+
+// Standard library
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "bitplane.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+// Hysteresis thresholds of the Canny edge detector
+static const double CANNY_LOW_THRESHOLD = 30;
+static const double CANNY_HIGH_THRESHOLD = 90;
+
+/**
+* Finds the edges of an image the way cvCvtColor(CV_BGR2GRAY), cvSmooth() (a 3x3
+* Gaussian), cvCanny() (3x3 Sobel, L1 gradient) and cvNot() would in turn, but in
+* one pass that keeps its working rows in cache, instead of four passes over
+* whole images.
+*
+* The image is cut into bands of rows, processed in parallel on a pool if one is
+* given. Each band streams its rows through three-row rings: grayscale, smoothed,
+* and gradient rows, from which non-maximum suppression classifies the band's
+* pixels as strong edges, weak candidates or neither. Hysteresis then follows the
+* candidates from the strong edges within each band, and a short serial pass
+* carries edges across the seams between bands. Last, each band writes its rows
+* of the edge image, and of the bitplane and edge point list if asked for.
+*
+* The result is the same as OpenCV's. OpenCV's Canny skips pushing pixels that
+* adjoin one already pushed, but hysteresis reaches them anyway, so the edges are
+* exactly the candidates connected (8-connected) to a strong edge, as here.
+*
+* An extractor keeps its buffers from one image to the next, so extracting images
+* of a steady size allocates nothing. It must not be used by two threads at once.
+*
+* Example:
+* @code
+*   EdgeExtractor extractor;
+*   Image<Intensity> edges(image.width(), image.height());
+*   EdgePointList points;
+*   Bitplane plane;
+*   extractor.extract(image, edges, &points, &plane, &pool);
+* @endcode
+*/
+class EdgeExtractor
+{
+public:
+    /**
+     * @param lowThreshold candidates need a gradient magnitude above this
+     * @param highThreshold strong edges need a gradient magnitude above this
+     * @param bandHeight the rows in each band
+     */
+    explicit EdgeExtractor(double lowThreshold = CANNY_LOW_THRESHOLD, double highThreshold = CANNY_HIGH_THRESHOLD,
+                           int bandHeight = 32)
+        : low(static_cast<int>(floor(std::min(lowThreshold, highThreshold)))),
+          high(static_cast<int>(floor(std::max(lowThreshold, highThreshold)))),
+          bandHeight(std::max(1, bandHeight))
+    {}
+
+    /**
+     * Finds the edges of an image. Edges come out black (0) on a white (255)
+     * background, the way the Hausdorff kernels expect them.
+     *
+     * @param image the colour (BGR) or grayscale image to find the edges of
+     * @param edges receives the edges; must be the same size as image
+     * @param points if not null, receives the edge points in raster order
+     * @param plane if not null, receives the edge pixels packed into a bitplane
+     * @param pool if not null, the threads to compute on
+     */
+    void extract(const Image<Rgb>& image, Image<Intensity>& edges,
+                 EdgePointList* points = 0, Bitplane* plane = 0, WorkStealingPool* pool = 0)
+    {
+        run(image, edges, points, plane, pool);
+    }
+    void extract(const Image<Intensity>& image, Image<Intensity>& edges,
+                 EdgePointList* points = 0, Bitplane* plane = 0, WorkStealingPool* pool = 0)
+    {
+        run(image, edges, points, plane, pool);
+    }
+
+private:
+    EdgeExtractor(const EdgeExtractor&);
+    EdgeExtractor& operator= (const EdgeExtractor&);
+
+    // What non-maximum suppression and hysteresis make of each pixel. Candidates
+    // left when hysteresis ends are not edges.
+    enum
+    {
+        MAP_CANDIDATE = 0,
+        MAP_NOT_EDGE = 1,
+        MAP_EDGE = 2
+    };
+
+    // The rows a thread keeps while processing a band. Each ring holds three
+    // consecutive rows, row y in slot y % 3, and remembers which row is in each slot.
+    struct BandRows
+    {
+        std::vector<Intensity> gray[3];
+
+        // Smoothed rows and the column sums they are made from, with the pixel at
+        // either end repeated beyond it
+        std::vector<Intensity> smoothed[3];
+        std::vector<int> columnSums;
+        std::vector<short> dx[3];
+        std::vector<short> dy[3];
+
+        // Gradient magnitudes, with a zero on either side of the row
+        std::vector<int> magnitude[3];
+
+        int grayRows[3];
+        int smoothedRows[3];
+
+        std::vector<uint8_t*> stack;
+
+        void reset(int width)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                gray[i].resize(width);
+                smoothed[i].resize(width + 2);
+                dx[i].resize(width);
+                dy[i].resize(width);
+                magnitude[i].resize(width + 2);
+                grayRows[i] = -1;
+                smoothedRows[i] = -1;
+            }
+            columnSums.resize(width + 2);
+            stack.clear();
+        }
+    };
+
+    template <typename Pixel>
+    void run(const Image<Pixel>& image, Image<Intensity>& edges, EdgePointList* points, Bitplane* plane,
+             WorkStealingPool* pool);
+
+    // Row y of the grayscale image, converted as by cvCvtColor(CV_BGR2GRAY)
+    static const Intensity* grayRow(const Image<Intensity>& image, int y, BandRows& /*rows*/)
+    {
+        return image[y];
+    }
+    static const Intensity* grayRow(const Image<Rgb>& image, int y, BandRows& rows)
+    {
+        Intensity* const gray = &rows.gray[y % 3][0];
+        if (rows.grayRows[y % 3] != y)
+        {
+            const Rgb* const pixels = image[y];
+            for (int x = 0; x < image.width(); ++x)
+                gray[x] = static_cast<Intensity>((pixels[x].b * 1868 + pixels[x].g * 9617 + pixels[x].r * 4899 + 8192) >> 14);
+            rows.grayRows[y % 3] = y;
+        }
+        return gray;
+    }
+
+    // Row y of the smoothed image: the 3x3 Gaussian (1 2 1 by 1 2 1, over 16) of
+    // the grayscale image, replicating its border pixels, as by cvSmooth()
+    template <typename Pixel>
+    static const Intensity* smoothedRow(const Image<Pixel>& image, int y, BandRows& rows)
+    {
+        Intensity* const smoothed = &rows.smoothed[y % 3][1];
+        if (rows.smoothedRows[y % 3] != y)
+        {
+            const int width = image.width();
+            const Intensity* const above = grayRow(image, std::max(y - 1, 0), rows);
+            const Intensity* const row = grayRow(image, y, rows);
+            const Intensity* const below = grayRow(image, std::min(y + 1, image.height() - 1), rows);
+            int* const sums = &rows.columnSums[1];
+            for (int x = 0; x < width; ++x)
+                sums[x] = above[x] + 2 * row[x] + below[x];
+            sums[-1] = sums[0];
+            sums[width] = sums[width - 1];
+            for (int x = 0; x < width; ++x)
+                smoothed[x] = static_cast<Intensity>((sums[x - 1] + 2 * sums[x] + sums[x + 1] + 8) >> 4);
+            smoothed[-1] = smoothed[0];
+            smoothed[width] = smoothed[width - 1];
+            rows.smoothedRows[y % 3] = y;
+        }
+        return smoothed;
+    }
+
+    // Computes the Sobel gradient of row y of the smoothed image, replicating its
+    // border pixels, and the gradient's L1 magnitude. Rows outside of the image
+    // have no gradient.
+    template <typename Pixel>
+    static void computeGradientRow(const Image<Pixel>& image, int y, BandRows& rows)
+    {
+        const int width = image.width();
+        const int slot = (y + 3) % 3;
+        int* const magnitude = &rows.magnitude[slot][1];
+        magnitude[-1] = magnitude[width] = 0;
+        if (y < 0 || y >= image.height())
+        {
+            std::fill(magnitude, magnitude + width, 0);
+            return;
+        }
+
+        const Intensity* const above = smoothedRow(image, std::max(y - 1, 0), rows);
+        const Intensity* const row = smoothedRow(image, y, rows);
+        const Intensity* const below = smoothedRow(image, std::min(y + 1, image.height() - 1), rows);
+        short* const dx = &rows.dx[slot][0];
+        short* const dy = &rows.dy[slot][0];
+        for (int x = 0; x < width; ++x)
+        {
+            const int gradientX = (above[x + 1] - above[x - 1]) + 2 * (row[x + 1] - row[x - 1]) + (below[x + 1] - below[x - 1]);
+            const int gradientY = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);
+            dx[x] = static_cast<short>(gradientX);
+            dy[x] = static_cast<short>(gradientY);
+            magnitude[x] = abs(gradientX) + abs(gradientY);
+        }
+    }
+
+    // Classifies the pixels of rows [top, bottom) by non-maximum suppression, and
+    // follows the candidates from the strong edges as far as the band reaches
+    template <typename Pixel>
+    void detectBand(const Image<Pixel>& image, int top, int bottom, BandRows& rows);
+
+    // Follows candidates from the edges on the stack, within the map rows [first, last)
+    void followEdges(std::vector<uint8_t*>& stack, const uint8_t* first, const uint8_t* last)
+    {
+        while (!stack.empty())
+        {
+            uint8_t* const pixel = stack.back();
+            stack.pop_back();
+            uint8_t* const neighbours[8] =
+            {
+                pixel - mapStep - 1, pixel - mapStep, pixel - mapStep + 1, pixel - 1,
+                pixel + 1, pixel + mapStep - 1, pixel + mapStep, pixel + mapStep + 1
+            };
+            for (int i = 0; i < 8; ++i)
+            {
+                uint8_t* const neighbour = neighbours[i];
+                if (neighbour >= first && neighbour < last && *neighbour == MAP_CANDIDATE)
+                {
+                    *neighbour = MAP_EDGE;
+                    stack.push_back(neighbour);
+                }
+            }
+        }
+    }
+
+    // Writes rows [top, bottom) of the outputs
+    size_t writeBand(int top, int bottom, Image<Intensity>& edges, Bitplane* plane);
+    void writeBandPoints(int top, int bottom, size_t first);
+
+    int low;
+    int high;
+    int bandHeight;
+
+    // The classification of every pixel, with a border of MAP_NOT_EDGE around the image
+    std::vector<uint8_t> map;
+    ptrdiff_t mapStep;
+
+    std::vector<BandRows> threadRows;
+    std::vector<size_t> bandPoints;
+    std::vector<int> xs;
+    std::vector<int> ys;
+};
+
+template <typename Pixel>
+void EdgeExtractor::run(const Image<Pixel>& image, Image<Intensity>& edges, EdgePointList* points, Bitplane* plane,
+                        WorkStealingPool* pool)
+{
+    ProfileScope profile(PROFILE_EDGE_DETECTION);
+    const int width = image.width();
+    const int height = image.height();
+    const int bands = (height + bandHeight - 1) / bandHeight;
+
+    mapStep = width + 2;
+    map.resize(static_cast<size_t>(mapStep) * (height + 2));
+    std::fill(map.begin(), map.begin() + mapStep, static_cast<uint8_t>(MAP_NOT_EDGE));
+    std::fill(map.end() - mapStep, map.end(), static_cast<uint8_t>(MAP_NOT_EDGE));
+    for (int y = 1; y <= height; ++y)
+        map[y * mapStep] = map[y * mapStep + width + 1] = MAP_NOT_EDGE;
+
+    threadRows.resize(pool ? pool->threadCount() : 1);
+    bandPoints.resize(bands);
+
+    WorkStealingPool::Task detect = [&](size_t band, unsigned worker) {
+        const int top = static_cast<int>(band) * bandHeight;
+        detectBand(image, top, std::min(top + bandHeight, height), threadRows[worker]);
+    };
+    if (pool)
+        pool->run(bands, detect);
+    else
+        for (int band = 0; band < bands; ++band)
+            detect(band, 0);
+
+    // Carry the edges across the seams between bands
+    std::vector<uint8_t*>& stack = threadRows[0].stack;
+    for (int seam = bandHeight; seam < height; seam += bandHeight)
+    {
+        for (int y = seam - 1; y <= seam; ++y)
+        {
+            uint8_t* const row = &map[(y + 1) * mapStep + 1];
+            for (int x = 0; x < width; ++x)
+            {
+                if (row[x] == MAP_EDGE)
+                    stack.push_back(row + x);
+            }
+        }
+    }
+    followEdges(stack, &map[0], &map[0] + map.size());
+
+    if (plane)
+        plane->assign(width, height);
+    WorkStealingPool::Task write = [&](size_t band, unsigned /*worker*/) {
+        const int top = static_cast<int>(band) * bandHeight;
+        bandPoints[band] = writeBand(top, std::min(top + bandHeight, height), edges, plane);
+    };
+    if (pool)
+        pool->run(bands, write);
+    else
+        for (int band = 0; band < bands; ++band)
+            write(band, 0);
+
+    if (points)
+    {
+        size_t count = 0;
+        for (int band = 0; band < bands; ++band)
+        {
+            const size_t bandCount = bandPoints[band];
+            bandPoints[band] = count;
+            count += bandCount;
+        }
+        xs.resize(count);
+        ys.resize(count);
+
+        WorkStealingPool::Task writePoints = [&](size_t band, unsigned /*worker*/) {
+            const int top = static_cast<int>(band) * bandHeight;
+            writeBandPoints(top, std::min(top + bandHeight, height), bandPoints[band]);
+        };
+        if (pool)
+            pool->run(bands, writePoints);
+        else
+            for (int band = 0; band < bands; ++band)
+                writePoints(band, 0);
+
+        // The list's old storage comes back to be reused for the next image
+        points->swap(xs, ys, width, height);
+    }
+}
+
+template <typename Pixel>
+void EdgeExtractor::detectBand(const Image<Pixel>& image, int top, int bottom, BandRows& rows)
+{
+    const int width = image.width();
+
+    // tan(22.5 degrees), in fixed point as in OpenCV
+    const int CANNY_SHIFT = 15;
+    const int TG22 = static_cast<int>(0.4142135623730950488016887242097 * (1 << CANNY_SHIFT) + 0.5);
+
+    rows.reset(width);
+    computeGradientRow(image, top - 1, rows);
+    computeGradientRow(image, top, rows);
+    for (int y = top; y < bottom; ++y)
+    {
+        computeGradientRow(image, y + 1, rows);
+        const int* const above = &rows.magnitude[(y + 2) % 3][1];
+        const int* const magnitude = &rows.magnitude[y % 3][1];
+        const int* const below = &rows.magnitude[(y + 1) % 3][1];
+        const short* const dx = &rows.dx[y % 3][0];
+        const short* const dy = &rows.dy[y % 3][0];
+        uint8_t* const mapRow = &map[(y + 1) * mapStep + 1];
+
+        for (int x = 0; x < width; ++x)
+        {
+            // A pixel is a candidate if its magnitude is a maximum across the
+            // gradient, whose direction is quantized to 0, 45, 90 or 135 degrees
+            const int m = magnitude[x];
+            bool maximum = false;
+            if (m > low)
+            {
+                const int gradientX = dx[x];
+                const int gradientY = dy[x];
+                const int absX = abs(gradientX);
+                const int absY = abs(gradientY) << CANNY_SHIFT;
+                const int tg22x = absX * TG22;
+                if (absY < tg22x)
+                {
+                    maximum = m > magnitude[x - 1] && m >= magnitude[x + 1];
+                }
+                else
+                {
+                    const int tg67x = tg22x + (absX << (CANNY_SHIFT + 1));
+                    if (absY > tg67x)
+                    {
+                        maximum = m > above[x] && m >= below[x];
+                    }
+                    else
+                    {
+                        const int s = (gradientX ^ gradientY) < 0 ? -1 : 1;
+                        maximum = m > above[x - s] && m > below[x + s];
+                    }
+                }
+            }
+
+            if (!maximum)
+            {
+                mapRow[x] = MAP_NOT_EDGE;
+            }
+            else if (m > high)
+            {
+                mapRow[x] = MAP_EDGE;
+                rows.stack.push_back(mapRow + x);
+            }
+            else
+            {
+                mapRow[x] = MAP_CANDIDATE;
+            }
+        }
+    }
+
+    // Every row of the band has been classified, so follow the candidates within it
+    followEdges(rows.stack, &map[(top + 1) * mapStep], &map[(bottom + 1) * mapStep]);
+}
+
+inline size_t EdgeExtractor::writeBand(int top, int bottom, Image<Intensity>& edges, Bitplane* plane)
+{
+    const int width = edges.width();
+    size_t count = 0;
+    for (int y = top; y < bottom; ++y)
+    {
+        const uint8_t* const mapRow = &map[(y + 1) * mapStep + 1];
+        Intensity* const pixels = edges[y];
+        for (int x = 0; x < width; ++x)
+        {
+            const bool edge = mapRow[x] == MAP_EDGE;
+            pixels[x] = edge ? 0 : 255;
+            count += edge;
+        }
+
+        if (plane)
+        {
+            uint64_t* const bits = plane->row(y);
+            for (int x = 0; x < width; ++x)
+            {
+                if (mapRow[x] == MAP_EDGE)
+                    bits[x >> 6] |= uint64_t(1) << (x & 63);
+            }
+        }
+    }
+    return count;
+}
+
+inline void EdgeExtractor::writeBandPoints(int top, int bottom, size_t first)
+{
+    const int width = static_cast<int>(mapStep) - 2;
+    size_t i = first;
+    for (int y = top; y < bottom; ++y)
+    {
+        const uint8_t* const mapRow = &map[(y + 1) * mapStep + 1];
+        for (int x = 0; x < width; ++x)
+        {
+            if (mapRow[x] == MAP_EDGE)
+            {
+                xs[i] = x;
+                ys[i] = y;
+                ++i;
+            }
+        }
+    }
+}
+
+#endif
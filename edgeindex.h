@@ -0,0 +1,162 @@
+/**
+ * @file edgeindex.h Provides an index of edge points by position, for visiting only
+ * the edges inside a rectangle.
+ */
+
+#ifndef EDGEINDEX_H
+#define EDGEINDEX_H
+
+// Standard library
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "edgepoints.h"
+
+/**
+* The edge points of an image bucketed by row, with the x coordinates of each row
+* sorted, and an integral image of edge counts.
+*
+* Finding the points inside a rectangle takes two binary searches per row of the
+* rectangle plus the points found, however many edges lie outside it, and counting
+* them takes four lookups. An EdgePointList, by contrast, has to be walked whole.
+*
+* Example:
+* @code
+*   EdgeIndex index(haystackPoints);
+*   const CvRect window = cvRect(x, y, needleWidth, needleHeight);
+*   for (int row = window.y; row < window.y + window.height; ++row) {
+*       const int* end;
+*       for (const int* x = index.rowRange(row, window.x, window.x + window.width, end); x != end; ++x) {
+*           // Do something with the edge pixel at (*x, row)
+*       }
+*   }
+* @endcode
+*/
+class EdgeIndex
+{
+public:
+    EdgeIndex()
+        : sourceWidth(0), sourceHeight(0)
+    {}
+
+    explicit EdgeIndex(const EdgePointList& points)
+        : sourceWidth(0), sourceHeight(0)
+    {
+        assign(points);
+    }
+
+    // Replaces the contents of the index with the points of a list, in any order
+    void assign(const EdgePointList& points);
+
+    // Number of edge points
+    size_t size() const
+    {
+        return xCoords.size();
+    }
+
+    // Dimensions of the image that the points were taken from
+    int width() const
+    {
+        return sourceWidth;
+    }
+    int height() const
+    {
+        return sourceHeight;
+    }
+
+    /**
+     * Finds the points of row y with minX <= x < maxX.
+     *
+     * @param end receives the end of the x coordinates found
+     * @return the first of the x coordinates found, in increasing order
+     */
+    const int* rowRange(int y, int minX, int maxX, const int*& end) const
+    {
+        const int* const first = xCoords.empty() ? 0 : &xCoords[0];
+        const int* const rowBegin = first + rowStarts[y];
+        const int* const rowEnd = first + rowStarts[y + 1];
+        const int* const begin = std::lower_bound(rowBegin, rowEnd, minX);
+        end = std::lower_bound(begin, rowEnd, maxX);
+        return begin;
+    }
+
+    /**
+     * Counts the points inside a rectangle, which may extend beyond the image.
+     */
+    size_t count(const CvRect& rect) const
+    {
+        const int left = std::max(0, std::min(sourceWidth, rect.x));
+        const int top = std::max(0, std::min(sourceHeight, rect.y));
+        const int right = std::max(left, std::min(sourceWidth, rect.x + rect.width));
+        const int bottom = std::max(top, std::min(sourceHeight, rect.y + rect.height));
+        return integral(right, bottom) - integral(left, bottom) - integral(right, top) + integral(left, top);
+    }
+
+private:
+    // The number of points above and to the left of (x, y)
+    size_t integral(int x, int y) const
+    {
+        return counts[static_cast<size_t>(y) * (sourceWidth + 1) + x];
+    }
+
+    // The x coordinates of the points of row y are xCoords[rowStarts[y]] up to
+    // xCoords[rowStarts[y + 1]], sorted
+    std::vector<int> xCoords;
+    std::vector<size_t> rowStarts;
+
+    // Integral image of edge counts, (sourceWidth + 1) x (sourceHeight + 1)
+    std::vector<uint32_t> counts;
+
+    int sourceWidth;
+    int sourceHeight;
+};
+
+inline void EdgeIndex::assign(const EdgePointList& points)
+{
+    const int* const xs = points.xs();
+    const int* const ys = points.ys();
+    const size_t count = points.size();
+    sourceWidth = points.width();
+    sourceHeight = points.height();
+
+    // Bucket the points by row with a counting sort, then sort each row
+    rowStarts.assign(sourceHeight + 1, 0);
+    for (size_t i = 0; i < count; ++i)
+        ++ rowStarts[ys[i] + 1];
+    for (int y = 0; y < sourceHeight; ++y)
+        rowStarts[y + 1] += rowStarts[y];
+
+    xCoords.resize(count);
+    std::vector<size_t> next(rowStarts.begin(), rowStarts.end() - 1);
+    for (size_t i = 0; i < count; ++i)
+        xCoords[next[ys[i]]++] = xs[i];
+    for (int y = 0; y < sourceHeight; ++y)
+        std::sort(xCoords.begin() + rowStarts[y], xCoords.begin() + rowStarts[y + 1]);
+
+    // Each row of the integral image adds the row's running count to the row above
+    const size_t stride = static_cast<size_t>(sourceWidth) + 1;
+    counts.assign(stride * (sourceHeight + 1), 0);
+    std::vector<uint32_t> rowCounts(sourceWidth, 0);
+    for (int y = 0; y < sourceHeight; ++y)
+    {
+        std::fill(rowCounts.begin(), rowCounts.end(), 0);
+        for (size_t i = rowStarts[y]; i < rowStarts[y + 1]; ++i)
+            ++ rowCounts[xCoords[i]];
+
+        const uint32_t* const above = &counts[static_cast<size_t>(y) * stride];
+        uint32_t* const row = &counts[static_cast<size_t>(y + 1) * stride];
+        uint32_t sum = 0;
+        for (int x = 0; x < sourceWidth; ++x)
+        {
+            sum += rowCounts[x];
+            row[x + 1] = above[x + 1] + sum;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,374 @@
+/**
+ * @file edgepoints.h Provides a compact list of the edge pixels found in an edge image.
+ */
+
+#ifndef EDGEPOINTS_H
+#define EDGEPOINTS_H
+
+// Standard library
+#include <vector>
+#include <algorithm>
+
+// Image wrapper
+#include "image.h"
+
+/**
+* A compact list of the edge pixels in an edge image.
+*
+* Edge images in this application mark edges with black (0) pixels on a white
+* background, so most of their area carries no information for matching. An
+* EdgePointList stores only the coordinates of the edge pixels, in raster
+* order, as two separate arrays of x and y coordinates. Algorithms that only
+* need to visit edge pixels can walk these arrays instead of scanning (and
+* branching on) every pixel of the image.
+*
+* The list normally owns its arrays, but attach() can point it at arrays owned
+* by someone else (e.g. a memory-mapped file) so that they are used in place.
+* Such a list is read-only until it is modified, at which point it takes a
+* private copy of the points.
+*
+* Example:
+* @code
+*   EdgePointList points(edges);
+*   const int* xs = points.xs();
+*   const int* ys = points.ys();
+*   for (size_t i = 0; i < points.size(); ++i) {
+*       // Do something with the edge pixel at (xs[i], ys[i])
+*   }
+* @endcode
+*/
+class EdgePointList
+{
+public:
+    EdgePointList()
+        : xData(0), yData(0), count(0), sourceWidth(0), sourceHeight(0)
+    {}
+
+    explicit EdgePointList(const Image<Intensity>& edges)
+        : xData(0), yData(0), count(0), sourceWidth(0), sourceHeight(0)
+    {
+        assign(edges);
+    }
+
+    EdgePointList(const EdgePointList& other)
+        : xCoords(other.xCoords), yCoords(other.yCoords),
+          xData(other.xData), yData(other.yData), count(other.count),
+          sourceWidth(other.sourceWidth), sourceHeight(other.sourceHeight)
+    {
+        if (other.ownsPoints())
+            useStorage();
+    }
+
+    EdgePointList& operator= (const EdgePointList& rhs)
+    {
+        if (this != &rhs)
+        {
+            xCoords = rhs.xCoords;
+            yCoords = rhs.yCoords;
+            xData = rhs.xData;
+            yData = rhs.yData;
+            count = rhs.count;
+            sourceWidth = rhs.sourceWidth;
+            sourceHeight = rhs.sourceHeight;
+            if (rhs.ownsPoints())
+                useStorage();
+        }
+        return *this;
+    }
+
+    // Replaces the contents of the list with the edge pixels of an edge image
+    void assign(const Image<Intensity>& edges);
+
+    /**
+     * Makes the list use count points stored in external arrays, without copying
+     * them. The arrays must outlive the list (and any copies of it).
+     */
+    void attach(const int* xs, const int* ys, size_t count, int width, int height)
+    {
+        xCoords.clear();
+        yCoords.clear();
+        xData = xs;
+        yData = ys;
+        this->count = count;
+        sourceWidth = width;
+        sourceHeight = height;
+    }
+
+    /**
+     * Replaces the contents of the list with the points in two arrays by swapping
+     * the arrays with the list's storage, so that neither is copied. The arrays
+     * receive the list's old storage.
+     */
+    void swap(std::vector<int>& xs, std::vector<int>& ys, int width, int height)
+    {
+        xCoords.swap(xs);
+        yCoords.swap(ys);
+        sourceWidth = width;
+        sourceHeight = height;
+        useStorage();
+    }
+
+    // Removes all points from the list
+    void clear()
+    {
+        xCoords.clear();
+        yCoords.clear();
+        useStorage();
+    }
+
+    // Rearranges the points so that point order[i] moves to index i
+    void reorder(const std::vector<size_t>& order);
+
+    // Appends a point to the list
+    void push_back(int x, int y)
+    {
+        if (!ownsPoints())
+            copyPoints();
+        xCoords.push_back(x);
+        yCoords.push_back(y);
+        useStorage();
+    }
+
+    // Number of edge points
+    size_t size() const
+    {
+        return count;
+    }
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // The x and y coordinates of the points, as parallel arrays
+    const int* xs() const
+    {
+        return xData;
+    }
+    const int* ys() const
+    {
+        return yData;
+    }
+
+    // Dimensions of the image that the points were taken from
+    int width() const
+    {
+        return sourceWidth;
+    }
+    int height() const
+    {
+        return sourceHeight;
+    }
+
+private:
+
+    // Whether the points are in our own arrays rather than attached ones
+    bool ownsPoints() const
+    {
+        return count == 0 || (!xCoords.empty() && xData == &xCoords[0]);
+    }
+
+    // Points the arrays at our own storage
+    void useStorage()
+    {
+        count = xCoords.size();
+        xData = xCoords.empty() ? 0 : &xCoords[0];
+        yData = yCoords.empty() ? 0 : &yCoords[0];
+    }
+
+    // Copies attached points into our own storage
+    void copyPoints()
+    {
+        xCoords.assign(xData, xData + count);
+        yCoords.assign(yData, yData + count);
+        useStorage();
+    }
+
+    // Storage for points owned by the list
+    std::vector<int> xCoords;
+    std::vector<int> yCoords;
+
+    // The points in use, either in the storage above or attached
+    const int* xData;
+    const int* yData;
+    size_t count;
+
+    int sourceWidth;
+    int sourceHeight;
+};
+
+/**
+* Replaces the contents of the list with the coordinates of every edge (black)
+* pixel in the specified edge image, in raster order.
+*
+* @param edges the edge image to take the edge pixels from
+*/
+inline void EdgePointList::assign(const Image<Intensity>& edges)
+{
+    const int width = edges.width();
+    const int height = edges.height();
+
+    // Count first so the arrays are allocated exactly once
+    size_t count = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        const Intensity* const row = edges[y];
+        for (int x = 0; x < width; ++x)
+        {
+            if (row[x] == 0)
+                ++count;
+        }
+    }
+
+    xCoords.resize(count);
+    yCoords.resize(count);
+    sourceWidth = width;
+    sourceHeight = height;
+
+    size_t i = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        const Intensity* const row = edges[y];
+        for (int x = 0; x < width; ++x)
+        {
+            if (row[x] == 0)
+            {
+                xCoords[i] = x;
+                yCoords[i] = y;
+                ++i;
+            }
+        }
+    }
+
+    useStorage();
+}
+
+/**
+* Rearranges the points so that the point previously at index order[i] ends
+* up at index i.
+*
+* @param order a permutation of [0, size())
+*/
+inline void EdgePointList::reorder(const std::vector<size_t>& order)
+{
+    std::vector<int> newX(order.size());
+    std::vector<int> newY(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        newX[i] = xData[order[i]];
+        newY[i] = yData[order[i]];
+    }
+    xCoords.swap(newX);
+    yCoords.swap(newY);
+    useStorage();
+}
+
+/**
+* Orders in which the points of an EdgePointList can be visited.
+*
+* Bounded Hausdorff evaluations stop at the first point whose distance exceeds
+* the rejection threshold, so putting the points most likely to exceed it first
+* makes hopeless translations cheaper to reject.
+*/
+enum EdgePointOrder
+{
+    // Raster order, as produced by EdgePointList::assign()
+    EDGE_ORDER_RASTER,
+
+    // A reproducible pseudo-random shuffle. Neighbouring edge pixels have
+    // almost the same distance values, so spreading consecutive points out
+    // over the shape finds a mismatch sooner than walking along one edge.
+    EDGE_ORDER_RANDOM,
+
+    // Most discriminative first: points with the fewest edge neighbours
+    // (line ends, corners and isolated details) come before points in the
+    // middle of long, dense edges, which fit almost any nearby translation.
+    // Points with equally many neighbours are shuffled as for EDGE_ORDER_RANDOM.
+    EDGE_ORDER_DISCRIMINATIVE
+};
+
+// Orders (neighbour count, point index) pairs by neighbour count only
+inline bool compareNeighbourCounts(const std::pair<int, size_t>& a, const std::pair<int, size_t>& b)
+{
+    return a.first < b.first;
+}
+
+/**
+* Reorders an edge point list for bounded evaluation.
+*
+* @param points the list to reorder
+* @param order the order to put the points in
+* @param seed seed for the pseudo-random shuffle; the same seed always gives the
+*     same order
+*/
+inline void reorderEdgePoints(EdgePointList& points, EdgePointOrder order, unsigned seed = 1)
+{
+    const size_t count = points.size();
+    std::vector<size_t> permutation(count);
+    for (size_t i = 0; i < count; ++i)
+        permutation[i] = i;
+
+    if (order == EDGE_ORDER_RASTER)
+    {
+        // Raster order is the order the points were extracted in, but the
+        // list may have been shuffled since
+        const int* const xs = points.xs();
+        const int* const ys = points.ys();
+        std::vector<std::pair<std::pair<int, int>, size_t> > keys(count);
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = std::make_pair(std::make_pair(ys[i], xs[i]), i);
+        std::sort(keys.begin(), keys.end());
+        for (size_t i = 0; i < count; ++i)
+            permutation[i] = keys[i].second;
+        points.reorder(permutation);
+        return;
+    }
+
+    // Fisher-Yates shuffle driven by a xorshift generator, so the order does not
+    // depend on the C library's rand()
+    unsigned state = seed != 0 ? seed : 1;
+    for (size_t i = count; i > 1; --i)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        std::swap(permutation[i - 1], permutation[state % i]);
+    }
+
+    if (order == EDGE_ORDER_DISCRIMINATIVE && count > 0)
+    {
+        // Count the edge neighbours of every point within a 5x5 window
+        static const int RADIUS = 2;
+        const int width = points.width();
+        const int height = points.height();
+        const int* const xs = points.xs();
+        const int* const ys = points.ys();
+
+        std::vector<unsigned char> isEdge(static_cast<size_t>(width) * height, 0);
+        for (size_t i = 0; i < count; ++i)
+            isEdge[static_cast<size_t>(ys[i]) * width + xs[i]] = 1;
+
+        std::vector<std::pair<int, size_t> > keys(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t p = permutation[i];
+            const int minY = std::max(0, ys[p] - RADIUS);
+            const int maxY = std::min(height - 1, ys[p] + RADIUS);
+            const int minX = std::max(0, xs[p] - RADIUS);
+            const int maxX = std::min(width - 1, xs[p] + RADIUS);
+            int neighbours = 0;
+            for (int y = minY; y <= maxY; ++y)
+                for (int x = minX; x <= maxX; ++x)
+                    neighbours += isEdge[static_cast<size_t>(y) * width + x];
+            keys[i] = std::make_pair(neighbours, p);
+        }
+
+        // A stable sort keeps the shuffled order among equal neighbour counts
+        std::stable_sort(keys.begin(), keys.end(), compareNeighbourCounts);
+        for (size_t i = 0; i < count; ++i)
+            permutation[i] = keys[i].second;
+    }
+
+    points.reorder(permutation);
+}
+
+#endif
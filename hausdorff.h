@@ -7,6 +7,8 @@
 
 // Standard library
 #include <limits>
+#include <vector>
+#include <algorithm>
 #include <math.h>
 #include <iostream>
 
@@ -15,12 +17,28 @@
 
 // Image wrapper
 #include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "hausdorff_simd.h"
 
 static const double MAX_HAUSDORFF_DISTANCE = 9999;
 
+// The kernels below accept distance transforms of any pixel type: Intensity32F, or
+// the quantized Intensity16 and Intensity transforms of distancetransform.h. Their
+// results are in the units of the distance transform.
+
+/**
+ * Finds the directed Hausdorff distance from the edge (black) pixels of imageA,
+ * translated by imageAOffset, to the edges whose distance transform is imageB.
+ * Edge pixels that fall outside of imageB are ignored.
+ *
+ * This scans every pixel of imageA; when the same edge image is compared at many
+ * offsets, prefer the EdgePointList overload below.
+ */
+template <typename DistanceT>
 double findHausdorffDistance(
     const Image<Intensity>& imageA,
-    const Image<Intensity32F>& imageB,
+    const Image<DistanceT>& imageB,
     const CvPoint& imageAOffset)
 {
     const int width = imageA.width();
@@ -31,11 +49,11 @@ double findHausdorffDistance(
     for (int iy = 0; iy < height; ++iy)
     {
         const int y = iy + imageAOffset.y;
-        if (y < 0 || y > imageB.height())
+        if (y < 0 || y >= imageB.height())
             continue;
 
         const Intensity* const imageARow = imageA[iy];
-        const Intensity32F* const imageBRow = imageB[y];
+        const DistanceT* const imageBRow = imageB[y];
         for (int ix = 0; ix < width; ++ix)
         {
             // Only consider edge (black) pixels in the shape prior
@@ -43,7 +61,7 @@ double findHausdorffDistance(
                 continue;
 
             const int x = ix + imageAOffset.x;
-            if (x < 0 || x > imageB.width())
+            if (x < 0 || x >= imageB.width())
                 continue;
             ++ pointsConsidered;
             double minDistance = imageBRow[x];
@@ -57,5 +75,473 @@ double findHausdorffDistance(
     return (pointsConsidered == 0) ? MAX_HAUSDORFF_DISTANCE : maxDistance;
 }
 
+/**
+ * Finds the directed Hausdorff distance from a list of edge points, translated by
+ * pointsAOffset, to the edges whose distance transform is imageB.
+ *
+ * Gives the same result as the image overload for an EdgePointList built from the
+ * same edge image, but each call costs O(edge points) rather than O(image area).
+ *
+ * @param pointsA the edge points to translate
+ * @param imageB the distance transform of the edges to measure against
+ * @param pointsAOffset the translation applied to pointsA
+ * @return the largest distance transform value under a translated point, or
+ *     MAX_HAUSDORFF_DISTANCE if none of the translated points falls inside imageB
+ */
+template <typename DistanceT>
+double findHausdorffDistance(
+    const EdgePointList& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset)
+{
+    const int* const xs = pointsA.xs();
+    const int* const ys = pointsA.ys();
+    const size_t count = pointsA.size();
+    const int widthB = imageB.width();
+    const int heightB = imageB.height();
+    double maxDistance = std::numeric_limits<double>::min();
+    unsigned long pointsConsidered = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int x = xs[i] + pointsAOffset.x;
+        const int y = ys[i] + pointsAOffset.y;
+        if (x < 0 || x >= widthB || y < 0 || y >= heightB)
+            continue;
+
+        ++ pointsConsidered;
+        double minDistance = imageB[y][x];
+        if (minDistance > maxDistance)
+        {
+            maxDistance = minDistance;
+        }
+    }
+
+    return (pointsConsidered == 0) ? MAX_HAUSDORFF_DISTANCE : maxDistance;
+}
+
+/**
+ * Finds the directed Hausdorff distance from a list of edge points, translated by
+ * pointsAOffset, to the edges whose distance transform is imageB, giving up as
+ * soon as the distance is known to exceed a rejection threshold.
+ *
+ * If the distance is at most threshold, the exact distance is returned, exactly as
+ * findHausdorffDistance() would. Otherwise the evaluation stops at the first point
+ * whose distance transform value exceeds threshold and that value is returned, so
+ * the result only tells the caller that the translation loses. Visit the points
+ * in an order from reorderEdgePoints() to make such rejections happen early.
+ *
+ * @param pointsA the edge points to translate
+ * @param imageB the distance transform of the edges to measure against
+ * @param pointsAOffset the translation applied to pointsA
+ * @param threshold the rejection threshold, usually the best distance found so far
+ * @param pointsEvaluated if not null, receives the number of points that were looked
+ *     up in imageB before the evaluation finished or was rejected
+ * @return the distance, or a value greater than threshold if the distance exceeds it
+ */
+template <typename DistanceT>
+double findHausdorffDistanceBounded(
+    const EdgePointList& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset,
+    double threshold,
+    unsigned long* pointsEvaluated = 0)
+{
+    const int* const xs = pointsA.xs();
+    const int* const ys = pointsA.ys();
+    const size_t count = pointsA.size();
+    const int widthB = imageB.width();
+    const int heightB = imageB.height();
+    double maxDistance = std::numeric_limits<double>::min();
+    unsigned long pointsConsidered = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int x = xs[i] + pointsAOffset.x;
+        const int y = ys[i] + pointsAOffset.y;
+        if (x < 0 || x >= widthB || y < 0 || y >= heightB)
+            continue;
+
+        ++ pointsConsidered;
+        double minDistance = imageB[y][x];
+        if (minDistance > maxDistance)
+        {
+            maxDistance = minDistance;
+            if (maxDistance > threshold)
+                break;
+        }
+    }
+
+    if (pointsEvaluated)
+        *pointsEvaluated = pointsConsidered;
+
+    return (pointsConsidered == 0) ? MAX_HAUSDORFF_DISTANCE : maxDistance;
+}
+
+/**
+ * Float distance transforms are looked up with the SIMD gather kernels of
+ * hausdorff_simd.h, eight or sixteen points at a time, where the processor allows.
+ * The result is bit for bit that of the scalar loop above whenever it is at most
+ * threshold; a rejected evaluation may look up a few more points before it stops.
+ */
+template <>
+inline double findHausdorffDistanceBounded<Intensity32F>(
+    const EdgePointList& pointsA,
+    const Image<Intensity32F>& imageB,
+    const CvPoint& pointsAOffset,
+    double threshold,
+    unsigned long* pointsEvaluated)
+{
+    unsigned long pointsConsidered = 0;
+    const float maxValue = gatherMax(GatherInput(pointsA, imageB, pointsAOffset), threshold, pointsConsidered);
+
+    if (pointsEvaluated)
+        *pointsEvaluated = pointsConsidered;
+
+    // The scalar loop starts from std::numeric_limits<double>::min(), not 0
+    return (pointsConsidered == 0) ? MAX_HAUSDORFF_DISTANCE :
+           std::max<double>(std::numeric_limits<double>::min(), maxValue);
+}
+
+template <>
+inline double findHausdorffDistance<Intensity32F>(
+    const EdgePointList& pointsA,
+    const Image<Intensity32F>& imageB,
+    const CvPoint& pointsAOffset)
+{
+    return findHausdorffDistanceBounded(pointsA, imageB, pointsAOffset, std::numeric_limits<double>::max());
+}
+
+/**
+ * Calls visit(value) with the distance transform value under each edge point of a
+ * list, translated by pointsAOffset, that lands inside imageB, in the list's order,
+ * until visit returns false.
+ */
+template <typename DistanceT, typename Visitor>
+void visitTranslatedPoints(
+    const EdgePointList& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset,
+    Visitor visit)
+{
+    const int* const xs = pointsA.xs();
+    const int* const ys = pointsA.ys();
+    const size_t count = pointsA.size();
+    const int widthB = imageB.width();
+    const int heightB = imageB.height();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int x = xs[i] + pointsAOffset.x;
+        const int y = ys[i] + pointsAOffset.y;
+        if (x < 0 || x >= widthB || y < 0 || y >= heightB)
+            continue;
+        if (!visit(static_cast<double>(imageB[y][x])))
+            return;
+    }
+}
+
+/**
+ * Calls visit(value) with the distance transform value under each indexed edge point,
+ * translated by pointsAOffset, that lands inside imageB, until visit returns false.
+ *
+ * Only the points inside imageB are looked at, so the cost depends on the size of
+ * imageB rather than on the number of points. The rows are visited ROW_INTERLEAVE
+ * apart and then filled in, so that, as with a shuffled EdgePointList, a mismatch
+ * anywhere in imageB is met early.
+ */
+template <typename DistanceT, typename Visitor>
+void visitTranslatedPoints(
+    const EdgeIndex& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset,
+    Visitor visit)
+{
+    static const int ROW_INTERLEAVE = 8;
+
+    // The rectangle of pointsA that lands inside imageB
+    const int minX = std::max(0, -pointsAOffset.x);
+    const int maxX = std::min(pointsA.width(), imageB.width() - pointsAOffset.x);
+    const int minY = std::max(0, -pointsAOffset.y);
+    const int maxY = std::min(pointsA.height(), imageB.height() - pointsAOffset.y);
+
+    for (int phase = 0; phase < ROW_INTERLEAVE; ++phase)
+    {
+        for (int y = minY + phase; y < maxY; y += ROW_INTERLEAVE)
+        {
+            const DistanceT* const imageBRow = imageB[y + pointsAOffset.y] + pointsAOffset.x;
+            const int* end;
+            for (const int* x = pointsA.rowRange(y, minX, maxX, end); x != end; ++x)
+            {
+                if (!visit(static_cast<double>(imageBRow[*x])))
+                    return;
+            }
+        }
+    }
+}
+
+/**
+ * The most points of a list, translated by pointsAOffset, that can land inside a
+ * width x height image: all of them.
+ */
+inline size_t countTranslatedPointsBound(const EdgePointList& pointsA, int /*width*/, int /*height*/,
+        const CvPoint& /*pointsAOffset*/)
+{
+    return pointsA.size();
+}
+
+/**
+ * The number of indexed points, translated by pointsAOffset, that land inside a
+ * width x height image.
+ */
+inline size_t countTranslatedPointsBound(const EdgeIndex& pointsA, int width, int height,
+        const CvPoint& pointsAOffset)
+{
+    return pointsA.count(cvRect(-pointsAOffset.x, -pointsAOffset.y, width, height));
+}
+
+/**
+ * Finds the directed Hausdorff distance from indexed edge points, translated by
+ * pointsAOffset, to the edges whose distance transform is imageB, giving up as
+ * soon as the distance is known to exceed a rejection threshold.
+ *
+ * Gives the same result as the EdgePointList overload for the same points, but only
+ * visits the points that land inside imageB (see visitTranslatedPoints()). This suits
+ * the reverse distance of a search, where imageB is the needle and the points are
+ * the whole haystack's.
+ */
+template <typename DistanceT>
+double findHausdorffDistanceBounded(
+    const EdgeIndex& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset,
+    double threshold,
+    unsigned long* pointsEvaluated = 0)
+{
+    double maxDistance = std::numeric_limits<double>::min();
+    unsigned long pointsConsidered = 0;
+
+    visitTranslatedPoints(pointsA, imageB, pointsAOffset, [&](double minDistance) {
+        ++ pointsConsidered;
+        if (minDistance > maxDistance)
+            maxDistance = minDistance;
+        return maxDistance <= threshold;
+    });
+
+    if (pointsEvaluated)
+        *pointsEvaluated = pointsConsidered;
+
+    return (pointsConsidered == 0) ? MAX_HAUSDORFF_DISTANCE : maxDistance;
+}
+
+/**
+ * The rank, counting from 1, of the distance that a partial Hausdorff distance with
+ * fraction takes out of count distances sorted in increasing order.
+ */
+inline size_t partialHausdorffRank(size_t count, double fraction)
+{
+    const double rank = ceil(fraction * count - 1e-9);
+    return rank < 1 ? 1 : rank > count ? count : static_cast<size_t>(rank);
+}
+
+static const int PARTIAL_HAUSDORFF_BINS = 256;
+
+/**
+ * Finds the directed partial Hausdorff distance from edge points, translated by
+ * pointsAOffset, to the edges whose distance transform is imageB: the k-th smallest
+ * of the points' distances rather than the largest, with k = ceil(fraction * N) of
+ * the N points that land inside imageB. Up to N - k points, such as stray edges or
+ * an occluded part of the needle, can then be arbitrarily far from the edges of
+ * imageB without changing the result. A fraction of 1 gives the ordinary (bounded)
+ * Hausdorff distance.
+ *
+ * The k-th distance is selected with a histogram of the values up to threshold
+ * rather than by sorting: one pass counts the values into PARTIAL_HAUSDORFF_BINS
+ * bins of whole distance transform units, which settles the result when the values
+ * are whole numbers and below the last bin (as for CV_DIST_L1 and CV_DIST_C, or
+ * quantized, transforms and any practical threshold). Otherwise a second pass picks
+ * the value out of the k-th value's bin. The first pass stops as soon as more than
+ * N - k points exceed threshold, which proves that the k-th distance does too; N is
+ * only known in advance for an EdgeIndex, so for an EdgePointList every point counts
+ * towards it.
+ *
+ * @param pointsA the edge points to translate, as an EdgePointList or an EdgeIndex
+ * @param imageB the distance transform of the edges to measure against
+ * @param pointsAOffset the translation applied to pointsA
+ * @param fraction the fraction of the points that must be close, in (0, 1]
+ * @param threshold the rejection threshold, usually the best distance found so far
+ * @param pointsEvaluated if not null, receives the number of points that were looked
+ *     up in imageB in the first pass
+ * @return the distance, or a value greater than threshold if the distance exceeds it
+ */
+template <typename PointsT, typename DistanceT>
+double findPartialHausdorffDistanceBounded(
+    const PointsT& pointsA,
+    const Image<DistanceT>& imageB,
+    const CvPoint& pointsAOffset,
+    double fraction,
+    double threshold,
+    unsigned long* pointsEvaluated = 0)
+{
+    if (fraction >= 1.0)
+        return findHausdorffDistanceBounded(pointsA, imageB, pointsAOffset, threshold, pointsEvaluated);
+
+    // More points than this above threshold put the k-th distance above it, however
+    // many of the points turn out to land inside imageB
+    const size_t maxPoints = countTranslatedPointsBound(pointsA, imageB.width(), imageB.height(), pointsAOffset);
+    const size_t maxExceeding = maxPoints > 0 ? maxPoints - partialHausdorffRank(maxPoints, fraction) : 0;
+
+    // Whole-unit bins up to threshold; the last bin also holds everything above it
+    const int lastBin = PARTIAL_HAUSDORFF_BINS - 1;
+    const double binWidth = (threshold < lastBin || threshold == std::numeric_limits<double>::max()) ?
+                            1.0 : ceil((threshold + 1) / lastBin);
+    const auto binOf = [&](double value) {
+        return value >= lastBin * binWidth ? lastBin : static_cast<int>(value / binWidth);
+    };
+
+    unsigned long histogram[PARTIAL_HAUSDORFF_BINS] = { 0 };
+    unsigned long pointsConsidered = 0;
+    unsigned long pointsExceeding = 0;
+    double smallestExceeding = std::numeric_limits<double>::max();
+    bool wholeValues = true;
+
+    visitTranslatedPoints(pointsA, imageB, pointsAOffset, [&](double value) {
+        ++ pointsConsidered;
+        if (value > threshold)
+        {
+            ++ pointsExceeding;
+            smallestExceeding = std::min(smallestExceeding, value);
+            return pointsExceeding <= maxExceeding;
+        }
+        ++ histogram[binOf(value)];
+        wholeValues = wholeValues && value == floor(value);
+        return true;
+    });
+
+    if (pointsEvaluated)
+        *pointsEvaluated = pointsConsidered;
+
+    if (pointsConsidered == 0)
+        return MAX_HAUSDORFF_DISTANCE;
+
+    const size_t rank = partialHausdorffRank(pointsConsidered, fraction);
+    if (pointsExceeding > pointsConsidered - rank)
+        return smallestExceeding;
+
+    // Find the bin of the k-th value, and its rank within the bin
+    int bin = 0;
+    size_t rankInBin = rank;
+    while (rankInBin > histogram[bin])
+        rankInBin -= histogram[bin++];
+
+    double distance;
+    if (binWidth == 1.0 && wholeValues && bin < lastBin)
+    {
+        distance = bin;
+    }
+    else
+    {
+        std::vector<double> values;
+        values.reserve(histogram[bin]);
+        visitTranslatedPoints(pointsA, imageB, pointsAOffset, [&](double value) {
+            if (value <= threshold && binOf(value) == bin)
+                values.push_back(value);
+            return true;
+        });
+        std::nth_element(values.begin(), values.begin() + (rankInBin - 1), values.end());
+        distance = values[rankInBin - 1];
+    }
+
+    // As in findHausdorffDistance(), a perfect match is std::numeric_limits<double>::min(), not 0
+    return std::max(std::numeric_limits<double>::min(), distance);
+}
+
+/**
+ * Finds the undirected Hausdorff distance between needle edges translated by offset
+ * and haystack edges: the larger of the forward distance (needle to haystack) and
+ * the reverse distance (haystack to needle), with haystack edges outside of the
+ * translated needle ignored.
+ *
+ * Both directions are evaluated with findHausdorffDistanceBounded(), and the reverse
+ * direction is skipped entirely if the forward direction already exceeds threshold.
+ * The result is exact if it is at most threshold, and otherwise only guaranteed to
+ * be greater than threshold.
+ *
+ * @param needlePoints the needle's edge points
+ * @param needleDistanceTransform the distance transform of the needle's edges
+ * @param haystackPoints the haystack's edge points, as an EdgePointList or, to only
+ *     visit those under the needle, an EdgeIndex
+ * @param haystackDistanceTransform the distance transform of the haystack's edges
+ * @param offset the position of the needle's top-left corner in the haystack
+ * @param threshold the rejection threshold, usually the best distance found so far
+ * @param pointsEvaluated if not null, receives the number of points looked up in
+ *     both directions
+ * @return the distance, or a value greater than threshold if the distance exceeds it
+ */
+template <typename DistanceT, typename HaystackPointsT>
+double findBidirectionalHausdorffDistance(
+    const EdgePointList& needlePoints,
+    const Image<DistanceT>& needleDistanceTransform,
+    const HaystackPointsT& haystackPoints,
+    const Image<DistanceT>& haystackDistanceTransform,
+    const CvPoint& offset,
+    double threshold = std::numeric_limits<double>::max(),
+    unsigned long* pointsEvaluated = 0)
+{
+    unsigned long forwardPoints = 0;
+    unsigned long reversePoints = 0;
+    double dist = findHausdorffDistanceBounded(
+                      needlePoints, haystackDistanceTransform, offset, threshold, &forwardPoints);
+    if (dist <= threshold)
+    {
+        const double reverseDist = findHausdorffDistanceBounded(
+                                       haystackPoints, needleDistanceTransform, cvPoint(-offset.x, -offset.y),
+                                       threshold, &reversePoints);
+        dist = std::max<double>(dist, reverseDist);
+    }
+
+    if (pointsEvaluated)
+        *pointsEvaluated = forwardPoints + reversePoints;
+
+    return dist;
+}
+
+/**
+ * Finds the undirected partial Hausdorff distance between needle edges translated by
+ * offset and haystack edges: the larger of the forward distance ranked by
+ * forwardFraction and the reverse distance ranked by reverseFraction (see
+ * findPartialHausdorffDistanceBounded()). Otherwise like
+ * findBidirectionalHausdorffDistance(), which it equals for fractions of 1.
+ */
+template <typename DistanceT, typename HaystackPointsT>
+double findPartialBidirectionalHausdorffDistance(
+    const EdgePointList& needlePoints,
+    const Image<DistanceT>& needleDistanceTransform,
+    const HaystackPointsT& haystackPoints,
+    const Image<DistanceT>& haystackDistanceTransform,
+    const CvPoint& offset,
+    double forwardFraction,
+    double reverseFraction,
+    double threshold = std::numeric_limits<double>::max(),
+    unsigned long* pointsEvaluated = 0)
+{
+    unsigned long forwardPoints = 0;
+    unsigned long reversePoints = 0;
+    double dist = findPartialHausdorffDistanceBounded(
+                      needlePoints, haystackDistanceTransform, offset, forwardFraction, threshold, &forwardPoints);
+    if (dist <= threshold)
+    {
+        const double reverseDist = findPartialHausdorffDistanceBounded(
+                                       haystackPoints, needleDistanceTransform, cvPoint(-offset.x, -offset.y),
+                                       reverseFraction, threshold, &reversePoints);
+        dist = std::max<double>(dist, reverseDist);
+    }
+
+    if (pointsEvaluated)
+        *pointsEvaluated = forwardPoints + reversePoints;
+
+    return dist;
+}
+
 #endif
 
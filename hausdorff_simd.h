@@ -0,0 +1,277 @@
+/**
+ * @file hausdorff_simd.h Provides AVX2 and AVX-512 versions, chosen at run time, of the
+ * innermost loop of the Hausdorff kernels: the largest distance transform value under
+ * a list of translated points.
+ */
+
+#ifndef HAUSDORFF_SIMD_H
+#define HAUSDORFF_SIMD_H
+
+// Standard library
+#include <limits>
+#include <algorithm>
+#include <cfloat>
+#include <math.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAUSDORFF_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HAUSDORFF_TARGET(isa)
+#else
+#define HAUSDORFF_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+/**
+ * The instruction sets the SIMD kernels can use.
+ */
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/**
+ * Finds the best instruction set that both the processor and the operating system support.
+ */
+inline SimdLevel detectSimdLevel()
+{
+#if defined(HAUSDORFF_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return SIMD_SCALAR;
+
+    __cpuid(info, 1);
+    const bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x06) == 0x06;
+    if (!osSavesAvx)
+        return SIMD_SCALAR;
+    const bool osSavesAvx512 = (_xgetbv(0) & 0xe6) == 0xe6;
+
+    __cpuidex(info, 7, 0);
+    if (osSavesAvx512 && (info[1] & (1 << 16)) != 0)
+        return SIMD_AVX512;
+    if ((info[1] & (1 << 5)) != 0)
+        return SIMD_AVX2;
+    return SIMD_SCALAR;
+#elif defined(HAUSDORFF_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return SIMD_SCALAR;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+/**
+ * The instruction set the kernels use: the detected one, unless it has been
+ * lowered, e.g. to compare the kernels against each other.
+ */
+inline SimdLevel& activeSimdLevel()
+{
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+/**
+ * The data the gather kernels read: a float distance transform, the points to look
+ * up in it and their translation.
+ */
+struct GatherInput
+{
+    GatherInput(const EdgePointList& points, const Image<Intensity32F>& image, const CvPoint& offset)
+        : xs(points.xs()), ys(points.ys()), count(points.size()),
+          data(image.height() > 0 ? image[0] : 0),
+          stride(image.height() > 1 ? static_cast<int>(image[1] - image[0]) : image.width()),
+          width(image.width()), height(image.height()),
+          offsetX(offset.x), offsetY(offset.y)
+    {}
+
+    const int* xs;
+    const int* ys;
+    size_t count;
+    const Intensity32F* data;
+    int stride;
+    int width;
+    int height;
+    int offsetX;
+    int offsetY;
+};
+
+/**
+ * The largest float that is at most threshold, so that a float value v exceeds
+ * threshold exactly when it exceeds the result.
+ */
+inline float floatThresholdBelow(double threshold)
+{
+    float result = static_cast<float>(threshold);
+    if (static_cast<double>(result) > threshold)
+        result = nextafterf(result, -std::numeric_limits<float>::infinity());
+    return result;
+}
+
+/**
+ * Finds the largest value under the points that fall inside the image, giving up
+ * once it exceeds threshold. This is the scalar loop of findHausdorffDistanceBounded().
+ *
+ * @param input the points and the image
+ * @param threshold the rejection threshold
+ * @param considered receives the number of points inside the image that were looked up
+ * @return the largest value, or -FLT_MAX if no point was inside the image
+ */
+inline float gatherMaxScalar(const GatherInput& input, double threshold, unsigned long& considered)
+{
+    float maxValue = -FLT_MAX;
+    considered = 0;
+    for (size_t i = 0; i < input.count; ++i)
+    {
+        const int x = input.xs[i] + input.offsetX;
+        const int y = input.ys[i] + input.offsetY;
+        if (x < 0 || x >= input.width || y < 0 || y >= input.height)
+            continue;
+
+        ++ considered;
+        const float value = input.data[static_cast<size_t>(y) * input.stride + x];
+        if (value > maxValue)
+        {
+            maxValue = value;
+            if (maxValue > threshold)
+                break;
+        }
+    }
+    return maxValue;
+}
+
+#ifdef HAUSDORFF_SIMD_X86
+
+inline unsigned countLanes(unsigned mask)
+{
+    unsigned count = 0;
+    for (; mask; mask &= mask - 1)
+        ++ count;
+    return count;
+}
+
+/**
+ * AVX2 version of gatherMaxScalar(): eight points per gather, with the bounds
+ * checks done as a lane mask. The threshold is only checked once per eight points,
+ * so a rejected evaluation may look up a few more points than the scalar loop.
+ */
+HAUSDORFF_TARGET("avx2")
+inline float gatherMaxAvx2(const GatherInput& input, double threshold, unsigned long& considered)
+{
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    const __m256i width = _mm256_set1_epi32(input.width);
+    const __m256i height = _mm256_set1_epi32(input.height);
+    const __m256i offsetX = _mm256_set1_epi32(input.offsetX);
+    const __m256i offsetY = _mm256_set1_epi32(input.offsetY);
+    const __m256i stride = _mm256_set1_epi32(input.stride);
+    const __m256 empty = _mm256_set1_ps(-FLT_MAX);
+    const __m256 limit = _mm256_set1_ps(floatThresholdBelow(threshold));
+
+    __m256 maxValues = empty;
+    considered = 0;
+    for (size_t i = 0; i < input.count; i += 8)
+    {
+        // Load up to eight points, masking off the lanes past the end
+        const __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(std::min<size_t>(8, input.count - i))), lane);
+        const __m256i x = _mm256_add_epi32(_mm256_maskload_epi32(input.xs + i, valid), offsetX);
+        const __m256i y = _mm256_add_epi32(_mm256_maskload_epi32(input.ys + i, valid), offsetY);
+
+        // Only look up the points inside the image
+        const __m256i inside = _mm256_and_si256(
+                                   _mm256_and_si256(valid,
+                                           _mm256_and_si256(_mm256_cmpgt_epi32(x, minusOne), _mm256_cmpgt_epi32(width, x))),
+                                   _mm256_and_si256(_mm256_cmpgt_epi32(y, minusOne), _mm256_cmpgt_epi32(height, y)));
+        const __m256 insideMask = _mm256_castsi256_ps(inside);
+        const __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y, stride), x);
+        const __m256 values = _mm256_mask_i32gather_ps(empty, input.data, index, insideMask, 4);
+
+        maxValues = _mm256_max_ps(maxValues, values);
+        considered += countLanes(static_cast<unsigned>(_mm256_movemask_ps(insideMask)));
+        if (_mm256_movemask_ps(_mm256_cmp_ps(maxValues, limit, _CMP_GT_OQ)) != 0)
+            break;
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, maxValues);
+    return *std::max_element(lanes, lanes + 8);
+}
+
+/**
+ * AVX-512 version of gatherMaxScalar(): sixteen points per gather.
+ */
+HAUSDORFF_TARGET("avx512f")
+inline float gatherMaxAvx512(const GatherInput& input, double threshold, unsigned long& considered)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i width = _mm512_set1_epi32(input.width);
+    const __m512i height = _mm512_set1_epi32(input.height);
+    const __m512i offsetX = _mm512_set1_epi32(input.offsetX);
+    const __m512i offsetY = _mm512_set1_epi32(input.offsetY);
+    const __m512i stride = _mm512_set1_epi32(input.stride);
+    const __m512 empty = _mm512_set1_ps(-FLT_MAX);
+    const __m512 limit = _mm512_set1_ps(floatThresholdBelow(threshold));
+
+    __m512 maxValues = empty;
+    considered = 0;
+    for (size_t i = 0; i < input.count; i += 16)
+    {
+        const size_t remaining = std::min<size_t>(16, input.count - i);
+        const __mmask16 valid = static_cast<__mmask16>((1u << remaining) - 1);
+        const __m512i x = _mm512_add_epi32(_mm512_maskz_loadu_epi32(valid, input.xs + i), offsetX);
+        const __m512i y = _mm512_add_epi32(_mm512_maskz_loadu_epi32(valid, input.ys + i), offsetY);
+
+        const __mmask16 inside = valid &
+                                 _mm512_cmpge_epi32_mask(x, zero) & _mm512_cmplt_epi32_mask(x, width) &
+                                 _mm512_cmpge_epi32_mask(y, zero) & _mm512_cmplt_epi32_mask(y, height);
+        const __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(y, stride), x);
+        const __m512 values = _mm512_mask_i32gather_ps(empty, inside, index, input.data, 4);
+
+        maxValues = _mm512_max_ps(maxValues, values);
+        considered += countLanes(inside);
+        if (_mm512_cmp_ps_mask(maxValues, limit, _CMP_GT_OQ) != 0)
+            break;
+    }
+
+    return _mm512_reduce_max_ps(maxValues);
+}
+
+#endif
+
+/**
+ * Finds the largest value under the points that fall inside the image with the
+ * best available instruction set, giving up once it exceeds threshold. If it is at
+ * most threshold, the result is exactly that of gatherMaxScalar().
+ */
+inline float gatherMax(const GatherInput& input, double threshold, unsigned long& considered)
+{
+#ifdef HAUSDORFF_SIMD_X86
+    switch (activeSimdLevel())
+    {
+    case SIMD_AVX512:
+        return gatherMaxAvx512(input, threshold, considered);
+    case SIMD_AVX2:
+        return gatherMaxAvx2(input, threshold, considered);
+    default:
+        break;
+    }
+#endif
+    return gatherMaxScalar(input, threshold, considered);
+}
+
+#endif
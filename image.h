@@ -8,6 +8,8 @@
 // standard library
 #include <string>
 #include <exception>
+#include <stddef.h>
+#include <stdint.h>
 
 // opencv
 #include "cv.h"
@@ -15,9 +17,105 @@
 
 // Pixel types
 typedef unsigned char Intensity;
+typedef unsigned short Intensity16;
 typedef float Intensity32F;
 #include "rgb.h"
 
+// The rows of images allocated by size start on this boundary (a cache line, and
+// an AVX-512 vector) and are padded to a multiple of it, and the pixels are followed
+// by this many spare bytes, so a vector kernel may load a whole vector at the end of
+// any row without reading outside the image's memory
+static const int IMAGE_ALIGNMENT = 64;
+
+/**
+* The OpenCV depth and channel count of each pixel type.
+*/
+template <typename T>
+struct PixelFormat;
+
+template <>
+struct PixelFormat<Intensity>
+{
+    enum { depth = IPL_DEPTH_8U, channels = 1 };
+};
+
+template <>
+struct PixelFormat<Intensity16>
+{
+    enum { depth = IPL_DEPTH_16U, channels = 1 };
+};
+
+template <>
+struct PixelFormat<Intensity32F>
+{
+    enum { depth = IPL_DEPTH_32F, channels = 1 };
+};
+
+template <>
+struct PixelFormat<Rgb>
+{
+    enum { depth = IPL_DEPTH_8U, channels = 3 };
+};
+
+/**
+* A view of pixels stored elsewhere: in an Image, a memory-mapped file, shared
+* memory or any other buffer with rows step bytes apart. A view never owns or
+* copies its pixels, so they must outlive it.
+*
+* Example:
+* @code
+*   ImageView<Intensity> view(static_cast<Intensity*>(mapped), width, height, width);
+*   Image<Intensity> image(view);   // no copy; usable wherever an Image is
+*   detectEdges(image, edges);
+* @endcode
+*/
+template <typename T>
+class ImageView
+{
+public:
+    ImageView(T* pixels, int width, int height, size_t step)
+        : pixels(reinterpret_cast<char*>(pixels)), viewWidth(width), viewHeight(height), rowStep(step)
+    {}
+
+    int width() const
+    {
+        return viewWidth;
+    }
+    int height() const
+    {
+        return viewHeight;
+    }
+
+    // The distance between rows, in bytes
+    size_t step() const
+    {
+        return rowStep;
+    }
+
+    T* data() const
+    {
+        return reinterpret_cast<T*>(pixels);
+    }
+
+    // Unchecked access to a pixel row by coordinate
+    T* operator[](unsigned y) const
+    {
+        return reinterpret_cast<T*>(pixels + y * rowStep);
+    }
+
+    // The view of a rectangle within this view, which must contain it
+    ImageView<T> region(const CvRect& rect) const
+    {
+        return ImageView<T>((*this)[rect.y] + rect.x, rect.width, rect.height, rowStep);
+    }
+
+private:
+    char* pixels;
+    int viewWidth;
+    int viewHeight;
+    size_t rowStep;
+};
+
 /**
 * Represents an image.
 * The Image class provides a simple interface for reading in and
@@ -47,6 +145,9 @@ public:
     Image(const Image<Intensity32F> & im);
     Image(IplImage * iplImg);
 
+    // Wraps the pixels of a view without copying them; they must outlive the image
+    explicit Image(const ImageView<T>& view);
+
     Image<T>& operator= (const Image<T>& rhs);
 
     // Conversion to IplImage * used by OpenCV
@@ -65,6 +166,11 @@ public:
         return imageData.height();
     }
 
+    // A view of the pixels, valid while the image (or a copy sharing its pixels) lives
+    ImageView<T> view() {
+        return ImageView<T>((*this)[0], width(), height(), imageData.step());
+    }
+
     // Checked access to a pixel value by coordinate
     inline T & at(unsigned x, unsigned y);
 
@@ -77,25 +183,56 @@ public:
 
 private:
 
+    static IplImage* createAlignedImage(unsigned width, unsigned height);
+    static IplImage* createHeader(const ImageView<T>& view);
+
     /// Underlying opencv image.
     CvImage imageData;
 };
 
-template <>
-Image<Rgb>::Image(unsigned width, unsigned height)
-    : imageData(cvSize(width, height), IPL_DEPTH_8U, 3)
+/**
+* Constructs an image of the given size, with its rows aligned and padded to
+* IMAGE_ALIGNMENT bytes. The pixels are not initialized.
+*/
+template <typename T>
+Image<T>::Image(unsigned width, unsigned height)
+    : imageData(createAlignedImage(width, height))
 {}
 
-template <>
-Image<Intensity>::Image(unsigned width, unsigned height)
-    : imageData(cvSize(width, height), IPL_DEPTH_8U, 1)
-{}
+template <typename T>
+IplImage* Image<T>::createAlignedImage(unsigned width, unsigned height)
+{
+    const size_t rowBytes = static_cast<size_t>(width) * sizeof(T);
+    const size_t step = (rowBytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+
+    // cvAlloc() aligns less than IMAGE_ALIGNMENT, so allocate a little more and align
+    // within it. Releasing the image frees imageDataOrigin, where the allocation starts.
+    char* const origin = static_cast<char*>(cvAlloc(step * height + 2 * IMAGE_ALIGNMENT));
+    char* const pixels = reinterpret_cast<char*>(
+                             (reinterpret_cast<uintptr_t>(origin) + IMAGE_ALIGNMENT - 1) & ~static_cast<uintptr_t>(IMAGE_ALIGNMENT - 1));
+    IplImage* const image = cvCreateImageHeader(cvSize(width, height), PixelFormat<T>::depth, PixelFormat<T>::channels);
+    cvSetData(image, pixels, static_cast<int>(step));
+    image->imageDataOrigin = origin;
+    return image;
+}
 
-template <>
-Image<Intensity32F>::Image(unsigned width, unsigned height)
-    : imageData(cvSize(width, height), IPL_DEPTH_32F, 1)
+template <typename T>
+Image<T>::Image(const ImageView<T>& view)
+    : imageData(createHeader(view))
 {}
 
+template <typename T>
+IplImage* Image<T>::createHeader(const ImageView<T>& view)
+{
+    // cvSetData() makes the image own the data, so disown it again: releasing the
+    // image must only release the header, never the viewed pixels
+    IplImage* const header = cvCreateImageHeader(cvSize(view.width(), view.height()),
+                             PixelFormat<T>::depth, PixelFormat<T>::channels);
+    cvSetData(header, view.data(), static_cast<int>(view.step()));
+    header->imageDataOrigin = 0;
+    return header;
+}
+
 /**
 * Constructs an Image<Intensity> image from the specified image file,
 * converting the image to 8-bit grayscale if it is colour to begin with.
@@ -149,7 +286,7 @@ Image<Rgb>::Image(const Image<Rgb> & im)
 
 template <>
 Image<Intensity>::Image(const Image<Rgb> & im)
-    : imageData(cvSize(im.width(), im.height()), IPL_DEPTH_8U, 1)
+    : imageData(createAlignedImage(im.width(), im.height()))
 {
     Image<Rgb> * src = const_cast<Image<Rgb> *>(&im);
     cvCvtColor(*src, *this, CV_BGR2GRAY);
@@ -157,7 +294,7 @@ Image<Intensity>::Image(const Image<Rgb> & im)
 
 template <>
 Image<Rgb>::Image(const Image<Intensity> & im)
-    : imageData(cvSize(im.width(), im.height()), IPL_DEPTH_8U, 3)
+    : imageData(createAlignedImage(im.width(), im.height()))
 {
     Image<Intensity> * src = const_cast<Image<Intensity> *>(&im);
     cvCvtColor(*src, *this, CV_GRAY2BGR);
@@ -0,0 +1,110 @@
+/**
+ * @file imagepool.h Provides scratch images borrowed from a per-thread pool, so that
+ * code run for every query doesn't allocate the images it only needs while it runs.
+ */
+
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+// Standard library
+#include <vector>
+#include <memory>
+
+// Image wrapper
+#include "image.h"
+
+// The most idle images of each pixel type a thread keeps for reuse
+static const size_t IMAGE_POOL_CAPACITY = 8;
+
+/**
+* The images of one pixel type that the calling thread has finished with, kept to
+* be handed out again. Each thread has its own pool, so borrowing and returning
+* take no locks, and a thread's pool is freed when the thread exits.
+*/
+template <typename T>
+class ImagePool
+{
+public:
+    /**
+     * Takes an image of the given size out of the calling thread's pool, or
+     * allocates one if the pool has none. Its pixels are left as they were.
+     */
+    static std::unique_ptr<Image<T> > take(int width, int height)
+    {
+        std::vector<std::unique_ptr<Image<T> > >& images = idleImages();
+        for (size_t i = images.size(); i-- > 0; )
+        {
+            if (images[i]->width() == width && images[i]->height() == height)
+            {
+                std::unique_ptr<Image<T> > image(std::move(images[i]));
+                images.erase(images.begin() + i);
+                return image;
+            }
+        }
+        return std::unique_ptr<Image<T> >(new Image<T>(width, height));
+    }
+
+    /**
+     * Puts an image back into the calling thread's pool. When the pool is full, the
+     * image idle the longest is freed to make room.
+     */
+    static void give(std::unique_ptr<Image<T> > image)
+    {
+        std::vector<std::unique_ptr<Image<T> > >& images = idleImages();
+        if (images.size() >= IMAGE_POOL_CAPACITY)
+            images.erase(images.begin());
+        images.push_back(std::move(image));
+    }
+
+private:
+    static std::vector<std::unique_ptr<Image<T> > >& idleImages()
+    {
+        static thread_local std::vector<std::unique_ptr<Image<T> > > images;
+        return images;
+    }
+};
+
+/**
+* A scratch image borrowed from the calling thread's ImagePool for as long as the
+* ScratchImage lives. Once a thread has run a query, running the same query again
+* finds its scratch images in the pool and allocates none.
+*
+* The image goes back to the pool on destruction, so no copy of it (which would
+* share its pixels) may be kept, and it must be destroyed on the thread that made it.
+*
+* Example:
+* @code
+*   ScratchImage<Intensity> smoothed(gray.width(), gray.height());
+*   cvSmooth(gray, *smoothed);
+* @endcode
+*/
+template <typename T>
+class ScratchImage
+{
+public:
+    ScratchImage(int width, int height)
+        : image(ImagePool<T>::take(width, height))
+    {}
+
+    ~ScratchImage()
+    {
+        ImagePool<T>::give(std::move(image));
+    }
+
+    Image<T>& operator*()
+    {
+        return *image;
+    }
+    Image<T>* operator->()
+    {
+        return image.get();
+    }
+
+private:
+    ScratchImage(const ScratchImage&);
+    ScratchImage& operator= (const ScratchImage&);
+
+    std::unique_ptr<Image<T> > image;
+};
+
+#endif
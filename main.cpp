@@ -7,22 +7,49 @@
 #pragma warning(disable : 4530) // Don't warn about not enabling exceptions
 
 #include <stdio.h>
-#include <time.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Image processing stuff
 #include "image.h"
+#include "imagepool.h"
+#include "edgeindex.h"
 #include "hausdorff.h"
+#include "search.h"
+#include "parallelsearch.h"
+#include "branchandbound.h"
+#include "posesearch.h"
+#include "chamfer.h"
+#include "detection.h"
+#include "distancetransform.h"
+#include "preprocess.h"
+#include "batch.h"
+#include "tracker.h"
+#include "tiledsearch.h"
+#include "pyramid.h"
+#include "profiler.h"
+#include "matchserver.h"
 
 const char MATCH_PREVIEW_WINDOW_TITLE[] = "Match Preview";
 
+// Placements of the needle within this distance of the haystack count as instances
+const double DETECTION_MAX_DISTANCE = 3.0;
+const size_t DETECTION_MAX_COUNT = 64;
+
+// Levels of the pyramid search, including full resolution
+const int PYRAMID_LEVELS = 4;
+
 // The image to search for in the haystack image
 Image<Rgb>* needleImage;
 Image<Intensity>* needleEdges;
+EdgePointList* needleEdgePoints;
 Image<Intensity32F>* needleDistanceTransform;
 
 // The image to search for the needle image in
 Image<Rgb>* haystackImage;
 Image<Intensity>* haystackEdges;
+EdgePointList* haystackEdgePoints;
+EdgeIndex* haystackEdgeIndex;
 Image<Intensity32F>* haystackDistanceTransform;
 
 // Used to display a preview of the needle edge image overlaid on the haystack
@@ -30,6 +57,20 @@ Image<Intensity32F>* haystackDistanceTransform;
 Image<Rgb>* matchPreviewImage;
 CvFont* font;
 
+// The threads used to search for the needle
+WorkStealingPool* searchPool;
+
+/*
+ * Describes the current needle and haystack to the search algorithms.
+ */
+SearchContext currentSearchContext()
+{
+    SearchContext context(*needleEdgePoints, *needleDistanceTransform,
+                          *haystackEdgePoints, *haystackDistanceTransform);
+    context.haystackIndex = haystackEdgeIndex;
+    return context;
+}
+
 /*
  * Finds the translation of needle in haystack that results in the minimal Hausdorff distance.
  */
@@ -37,34 +78,8 @@ CvPoint findBestTranslation(int step = 2, double* dist = 0,
                             int minX = 0, int minY = 0,
                             int maxX = -1, int maxY = -1)
 {
-    // Find the optimum translation
-    unsigned bestX = 0;
-    unsigned bestY = 0;
-    double bestDistance = std::numeric_limits<double>::max();
-
-    const int maxOffsetX = maxX != -1 ? maxX : haystackDistanceTransform->width() - needleEdges->width();
-    const int maxOffsetY = maxY != -1 ? maxY : haystackDistanceTransform->height() - needleEdges->height();
-    for (int y = minY; y < maxOffsetY; y += step)
-    {
-        for (int x = minX; x < maxOffsetX; x += step)
-        {
-            const double forwardDist = findHausdorffDistance(*needleEdges, *haystackDistanceTransform, cvPoint(x, y));
-            const double reverseDist = findHausdorffDistance(*haystackEdges, *needleDistanceTransform, cvPoint(-x, -y));
-            const double dist = std::max<double>(forwardDist, reverseDist);
-
-            if (dist < bestDistance)
-            {
-                bestDistance = dist;
-                bestX = x;
-                bestY = y;
-            }
-        }
-    }
-
-    if (dist)
-        *dist = bestDistance;
-
-    return cvPoint(bestX, bestY);
+    ParallelTranslationSearch search(*searchPool);
+    return search.findBestTranslation(currentSearchContext(), step, dist, minX, minY, maxX, maxY);
 }
 
 /*
@@ -74,44 +89,14 @@ CvPoint findBestTranslation(int step = 2, double* dist = 0,
  */
 CvPoint findBestTranslationRecursive(int initialStep = 32, double* dist = 0)
 {
-    double bestDistance = std::numeric_limits<double>::max();
-    CvPoint bestTranslation;
-
-    int minX = 0;
-    int minY = 0;
-    const int absoluteMaxX = haystackDistanceTransform->width() - needleEdges->width();
-    const int absoluteMaxY = haystackDistanceTransform->height() - needleEdges->height();
-    int maxX = absoluteMaxX;
-    int maxY = absoluteMaxY;
-
-    for (int step = initialStep; step > 0; step /= 2)
-    {
-        double distance;
-        CvPoint translation = findBestTranslation(
-                                  step, &distance,
-                                  minX, minY,
-                                  maxX, maxY);
-        if (distance < bestDistance)
-        {
-            bestDistance = distance;
-            bestTranslation = translation;
-
-            minX = std::max<int>(0, translation.x - step);
-            minY = std::max<int>(0, translation.y - step);
-            maxX = std::min<int>(absoluteMaxX, translation.x + step);
-            maxY = std::min<int>(absoluteMaxY, translation.y + step);
-        }
-    }
-
-    if (dist)
-        *dist = bestDistance;
-
-    return bestTranslation;
+    ParallelTranslationSearch search(*searchPool);
+    return search.findBestTranslationRecursive(currentSearchContext(), initialStep, dist);
 }
 
 /*
  * Finds the translation of needle in haystack that results in the minimal Hausdorff distance,
  * allowing for some variation in scale and rotation of the needle in the haystack image.
+ * Leaves the needle edges in the best pose.
  */
 double findBestTranslationScaleAndRotation(
     CvPoint* bestTranslation,
@@ -125,40 +110,36 @@ double findBestTranslationScaleAndRotation(
     double maxScale = 2.0,
     double scaleStep = 0.25)
 {
-    double bestDistance = std::numeric_limits<double>::max();
+    PoseSearchOptions options;
+    options.initialTranslationStep = initialTranslationStep;
+    options.minRotation = minRotation;
+    options.maxRotation = maxRotation;
+    options.rotationStep = rotationStep;
+    options.minScale = minScale;
+    options.maxScale = maxScale;
+    options.scaleStep = scaleStep;
+
+    PoseSearch search(*searchPool);
+    PoseMatch match;
+    const double bestDistance = search.findBestTranslationScaleAndRotation(
+                                    *needleEdges, *haystackEdgePoints, *haystackDistanceTransform,
+                                    options, &match, 0, haystackEdgeIndex);
+
+    if (bestTranslation)
+        *bestTranslation = match.translation;
+    if (bestRotation)
+        *bestRotation = match.rotation;
+    if (bestScale)
+        *bestScale = match.scale;
+
+    // Put the needle into the best pose so the preview shows what was matched
+    ScratchImage<Intensity> backupPrior(needleEdges->width(), needleEdges->height());
+    cvCopy(*needleEdges, *backupPrior);
+    warpNeedleEdges(*backupPrior, NeedlePose(match.rotation, match.scale), *needleEdges);
+    needleEdgePoints->assign(*needleEdges);
+    reorderEdgePoints(*needleEdgePoints, EDGE_ORDER_DISCRIMINATIVE);
+    computeDistanceTransform(*needleEdges, *needleDistanceTransform);
 
-    CvPoint2D32f center = cvPoint2D32f(needleEdges->width() / 2, needleEdges->height() / 2);
-    CvMat* rotMat = cvCreateMat(2, 3, CV_32FC1);
-    CvMat* bestRotMat = cvCreateMat(2, 3, CV_32FC1);
-    Image<Intensity> backupPrior(needleEdges->width(), needleEdges->height());
-    cvCopy(*needleEdges, backupPrior);
-
-    for (int rotation = minRotation; rotation <= maxRotation; rotation += rotationStep)
-    {
-        double angle = rotation * 3.14 / 180.0;
-        for (double scale = minScale; scale <= maxScale; scale += scaleStep)
-        {
-            cv2DRotationMatrix(center, angle, scale, rotMat);
-            cvWarpAffine(backupPrior, *needleEdges, rotMat, 1+8, cvScalarAll(255));
-
-            double dist;
-            CvPoint point = findBestTranslationRecursive(initialTranslationStep, &dist);
-
-            if (dist < bestDistance)
-            {
-                bestDistance = dist;
-                if (bestTranslation)
-                    *bestTranslation = point;
-                if (bestRotation)
-                    *bestRotation = rotation;
-                if (bestScale)
-                    *bestScale = scale;
-                cvCopy(rotMat, bestRotMat);
-            }
-        }
-    }
-
-    cvWarpAffine(backupPrior, *needleEdges, bestRotMat, 1+8, cvScalarAll(255));
     return bestDistance;
 }
 
@@ -185,6 +166,96 @@ void drawTranslatedPrior(const CvPoint& point, double dist)
     cvShowImage(MATCH_PREVIEW_WINDOW_TITLE, *matchPreviewImage);
 }
 
+/*
+ * Outlines every detected instance of the needle in the haystack image.
+ */
+void drawDetections(const std::vector<Detection>& detections)
+{
+    cvCopy(*haystackImage, *matchPreviewImage);
+    for (size_t i = 0; i < detections.size(); ++i)
+    {
+        const CvPoint& point = detections[i].translation;
+        cvRectangle(*matchPreviewImage, point,
+                    cvPoint(point.x + needleImage->width() - 1, point.y + needleImage->height() - 1),
+                    cvScalar(0, 0, 255), 2);
+    }
+
+    char buffer[64];
+    sprintf(buffer, "%u found", static_cast<unsigned>(detections.size()));
+    cvRectangle(*matchPreviewImage, cvPoint(0, 0), cvPoint(200, 30), cvScalar(255,255,255), CV_FILLED);
+    cvPutText(*matchPreviewImage, buffer, cvPoint(10,20), font, cvScalar(0,0,0));
+
+    cvShowImage(MATCH_PREVIEW_WINDOW_TITLE, *matchPreviewImage);
+}
+
+/*
+ * Profiles a search started from the keyboard: its wall-clock time and the work it did.
+ */
+class KeySearchProfile
+{
+public:
+    KeySearchProfile()
+        : start(std::chrono::steady_clock::now()), seconds(0)
+    {
+        profiler.start();
+    }
+
+    // Ends the search
+    void stop()
+    {
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        profiler.stop();
+    }
+
+    // Prints the work done and the time taken
+    void print() const
+    {
+        const ProfileTotals totals = profiler.totals();
+        printf("\t%llu offsets evaluated, %llu points considered, %llu rejected early, %llu cells pruned\n",
+               static_cast<unsigned long long>(totals.counters[PROFILE_OFFSETS_EVALUATED]),
+               static_cast<unsigned long long>(totals.counters[PROFILE_POINTS_CONSIDERED]),
+               static_cast<unsigned long long>(totals.counters[PROFILE_EARLY_REJECTIONS]),
+               static_cast<unsigned long long>(totals.counters[PROFILE_CELLS_PRUNED]));
+        printf("\tSearch took %.2f secs\n", seconds);
+    }
+
+private:
+    Profiler profiler;
+    const std::chrono::steady_clock::time_point start;
+    double seconds;
+};
+
+/*
+ * Writes a profile's totals as JSON, and its trace events in the Chrome trace event
+ * format, to the files named, if any.
+ *
+ * @return false if a file could not be created
+ */
+bool writeProfile(const Profiler& profiler, const std::string& profileFilename, const std::string& traceFilename)
+{
+    if (!profileFilename.empty())
+    {
+        std::ofstream file(profileFilename.c_str());
+        if (!file)
+        {
+            std::cerr << "Could not create " << profileFilename << "." << std::endl;
+            return false;
+        }
+        profiler.writeJson(file);
+    }
+    if (!traceFilename.empty())
+    {
+        std::ofstream file(traceFilename.c_str());
+        if (!file)
+        {
+            std::cerr << "Could not create " << traceFilename << "." << std::endl;
+            return false;
+        }
+        profiler.writeChromeTrace(file);
+    }
+    return true;
+}
+
 /*
  * Computes the Hausdorff distance if the needle were moved to the location of the mouse pointer
  * and displays the needle at that location along with the computed distance.
@@ -198,9 +269,7 @@ void onMouseEvent(int /*evt*/, int x, int y, int flags, void* /*param*/)
 
         if (x <= maxOffsetX && y <= maxOffsetY)
         {
-            const double forwardDist = findHausdorffDistance(*needleEdges, *haystackDistanceTransform, cvPoint(x, y));
-            const double reverseDist = findHausdorffDistance(*haystackEdges, *needleDistanceTransform, cvPoint(-x, -y));
-            const double dist = std::max<double>(forwardDist, reverseDist);
+            const double dist = currentSearchContext().distanceAt(cvPoint(x, y));
 
             // Superimpose the translated needle image on the haystack image
             drawTranslatedPrior(cvPoint(x, y), dist);
@@ -208,16 +277,308 @@ void onMouseEvent(int /*evt*/, int x, int y, int flags, void* /*param*/)
     }
 }
 
+/*
+ * Runs the headless batch mode:
+ *   --batch manifest.txt [--output results.json|results.csv] [--format json|csv] [--threads n] [--exact]
+ * See readBatchManifest() for the manifest format. Results go to standard output
+ * unless --output is given, as JSON unless --format or the output's extension says CSV.
+ * --density-ratio skips windows whose edge count is more than that ratio away from the
+ * needle's (see SearchContext::densityRatio).
+ * --profile and --trace write the time spent in each stage and the search counters,
+ * and the stages' trace events (see Profiler).
+ */
+int runBatch(int argc, char* argv[])
+{
+    std::string manifestFilename;
+    std::string outputFilename;
+    std::string format;
+    std::string profileFilename;
+    std::string traceFilename;
+    BatchOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--batch") == 0 && hasValue)
+            manifestFilename = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && hasValue)
+            outputFilename = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && hasValue)
+            format = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue)
+            options.searchThreads = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--exact") == 0)
+            options.exact = true;
+        else if (strcmp(argv[i], "--fraction") == 0 && hasValue)
+            options.forwardFraction = options.reverseFraction = std::min(1.0, std::max(0.0, atof(argv[++i])));
+        else if (strcmp(argv[i], "--density-ratio") == 0 && hasValue)
+            options.densityRatio = std::max(0.0, atof(argv[++i]));
+        else if (strcmp(argv[i], "--cache") == 0 && hasValue)
+            options.cacheDirectory = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && hasValue)
+            profileFilename = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && hasValue)
+            traceFilename = argv[++i];
+        else
+        {
+            std::cerr << "Usage " << argv[0] << " --batch manifest.txt [--output results.json|results.csv]"
+                      << " [--format json|csv] [--threads n] [--exact] [--fraction f] [--density-ratio r]"
+                      << " [--cache directory] [--profile profile.json] [--trace trace.json]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (format.empty())
+    {
+        const size_t dot = outputFilename.rfind('.');
+        format = (dot != std::string::npos && outputFilename.substr(dot) == ".csv") ? "csv" : "json";
+    }
+    if (format != "json" && format != "csv")
+    {
+        std::cerr << "Unknown format " << format << "; use json or csv." << std::endl;
+        return 1;
+    }
+
+    std::vector<BatchJob> jobs;
+    try
+    {
+        jobs = readBatchManifest(manifestFilename);
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    Profiler profiler(!traceFilename.empty());
+    if (!profileFilename.empty() || !traceFilename.empty())
+        profiler.start();
+    const std::vector<BatchResult> results = BatchPipeline(options).run(jobs);
+    profiler.stop();
+    if (!writeProfile(profiler, profileFilename, traceFilename))
+        return 1;
+
+    std::ofstream outputFile;
+    if (!outputFilename.empty())
+    {
+        outputFile.open(outputFilename.c_str());
+        if (!outputFile)
+        {
+            std::cerr << "Could not create " << outputFilename << "." << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& output = outputFilename.empty() ? std::cout : outputFile;
+    if (format == "csv")
+        writeBatchResultsCsv(output, results);
+    else
+        writeBatchResultsJson(output, results);
+
+    // Fail if any job did
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        if (!results[i].succeeded)
+            return 2;
+    }
+    return 0;
+}
+
+/*
+ * Runs the headless tracking mode:
+ *   --track needle.bmp video.avi|frames%04d.png [--threads n]
+ * Prints the needle's pose in every frame as CSV on standard output.
+ */
+int runTracking(int argc, char* argv[])
+{
+    if (argc != 4 && !(argc == 6 && strcmp(argv[4], "--threads") == 0))
+    {
+        std::cerr << "Usage " << argv[0] << " --track needle.bmp video.avi|frames%04d.png [--threads n]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        WorkStealingPool pool(argc == 6 ? std::max(0, atoi(argv[5])) : 0);
+
+        Image<Rgb> needle(argv[2]);
+        Image<Intensity> edges(needle.width(), needle.height());
+        detectEdges(needle, edges);
+
+        TrackerOptions options;
+        const PoseSearchOptions& poses = options.globalSearch;
+        TemplateBank bank;
+        bank.build(edges, enumerateNeedlePoses(poses.minRotation, poses.maxRotation, poses.rotationStep,
+                                               poses.minScale, poses.maxScale, poses.scaleStep), &pool);
+
+        Tracker tracker(pool, bank, options);
+        FramePreprocessor preprocessor;
+        FrameSource source(argv[3]);
+
+        std::cout << "frame,x,y,rotation,scale,distance,global,tiles_changed,seconds" << std::endl;
+        int frameNumber = 0;
+        while (std::unique_ptr<Image<Rgb> > frame = source.read())
+        {
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            preprocessor.update(*frame);
+            const PoseMatch match = tracker.track(preprocessor.edgePoints(), preprocessor.distanceTransform());
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::cout << frameNumber++ << "," << match.translation.x << "," << match.translation.y << ","
+                      << match.rotation << "," << match.scale << "," << match.distance << ","
+                      << (tracker.lastSearchWasGlobal() ? 1 : 0) << "," << preprocessor.tilesChanged() << ","
+                      << seconds << std::endl;
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Runs the headless tiled search of a haystack too large to load whole:
+ *   --tiled needle.bmp haystack.ppm|haystack.pgm [--threads n] [--exact] [--profile profile.json] [--trace trace.json]
+ */
+int runTiled(int argc, char* argv[])
+{
+    TiledSearchOptions options;
+    int threads = 0;
+    std::string profileFilename;
+    std::string traceFilename;
+    bool valid = argc >= 4;
+    for (int i = 4; i < argc && valid; ++i)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--exact") == 0)
+            options.exact = true;
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            profileFilename = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            traceFilename = argv[++i];
+        else
+            valid = false;
+    }
+    if (!valid)
+    {
+        std::cerr << "Usage " << argv[0] << " --tiled needle.bmp haystack.ppm|haystack.pgm [--threads n] [--exact]"
+                  << " [--profile profile.json] [--trace trace.json]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        WorkStealingPool pool(threads);
+        options.pool = &pool;
+
+        Image<Rgb> needle(argv[2]);
+        Image<Intensity> edges(needle.width(), needle.height());
+        detectEdges(needle, edges);
+        EdgePointList points(edges);
+        reorderEdgePoints(points, EDGE_ORDER_DISCRIMINATIVE);
+        Image<Intensity32F> distanceTransform(needle.width(), needle.height());
+        computeDistanceTransform(edges, distanceTransform);
+
+        PnmReader haystack(argv[3]);
+        Profiler profiler(!traceFilename.empty());
+        profiler.start();
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        double dist;
+        CvPoint bestTranslation = findBestTranslationTiled(haystack, points, distanceTransform, options, &dist);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        profiler.stop();
+
+        printf("Found at (%d, %d), dist = %.2f\n", bestTranslation.x, bestTranslation.y, dist);
+        printf("Search took %.2f secs\n", seconds);
+        if (!writeProfile(profiler, profileFilename, traceFilename))
+            return 1;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Runs the match server, which answers requests on a Unix domain socket until told to shut down:
+ *   --serve socket [--threads n] [--workers n] [--banks directory]
+ * See MatchServer for the protocol. --banks keeps the needles' pose banks in directory,
+ * so that a restarted server maps them instead of building them again.
+ */
+int runServer(int argc, char* argv[])
+{
+#ifdef _WIN32
+    std::cerr << "The match server needs Unix domain sockets, which this build doesn't support." << std::endl;
+    return 1;
+#else
+    MatchServerOptions options;
+    bool valid = argc >= 3;
+    if (valid)
+        options.socketPath = argv[2];
+    for (int i = 3; i < argc && valid; ++i)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.searchThreads = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            options.workerThreads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--banks") == 0 && i + 1 < argc)
+            options.bankDirectory = argv[++i];
+        else
+            valid = false;
+    }
+    if (!valid)
+    {
+        std::cerr << "Usage " << argv[0] << " --serve socket [--threads n] [--workers n] [--banks directory]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        MatchServer server(options);
+        std::cerr << "Listening on " << options.socketPath << "." << std::endl;
+        server.run();
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+#endif
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+        return runBatch(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--track") == 0)
+        return runTracking(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--tiled") == 0)
+        return runTiled(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+        return runServer(argc, argv);
+
+    if (argc != 3 && argc != 4)
     {
-        std::cerr << "Usage " << argv[0] << " needle.bmp haystack.bmp" << std::endl;
+        std::cerr << "Usage " << argv[0] << " needle.bmp haystack.bmp [threads]" << std::endl
+                  << "      " << argv[0] << " --batch manifest.txt [--output results.json|results.csv]"
+                  << " [--format json|csv] [--threads n] [--exact] [--fraction f] [--density-ratio r]"
+                  << " [--cache directory] [--profile profile.json] [--trace trace.json]" << std::endl
+                  << "      " << argv[0] << " --track needle.bmp video.avi|frames%04d.png [--threads n]" << std::endl
+                  << "      " << argv[0] << " --tiled needle.bmp haystack.ppm|haystack.pgm [--threads n] [--exact]"
+                  << " [--profile profile.json] [--trace trace.json]" << std::endl
+                  << "      " << argv[0] << " --serve socket [--threads n] [--workers n] [--banks directory]" << std::endl;
         return 1;
     }
     const char* needleFilename = argv[1];
     const char* haystackFilename = argv[2];
 
+    // Search with the requested number of threads, or one per hardware thread
+    searchPool = new WorkStealingPool(argc == 4 ? std::max(0, atoi(argv[3])) : 0);
+
     // Initialize a font for drawing text on the image
     font = new CvFont;
     cvInitFont(font, CV_FONT_HERSHEY_COMPLEX_SMALL, 1.0, 1.0, 0, 1);
@@ -227,11 +588,11 @@ int main(int argc, char* argv[])
     try
     {
         haystackImage = new Image<Rgb>(haystackFilename);
-        Image<Intensity>* tempHaystackImage = new Image<Intensity>(*haystackImage);
-        haystackEdges = new Image<Intensity>(tempHaystackImage->width(), tempHaystackImage->height());
-        cvSmooth(*tempHaystackImage, *tempHaystackImage);
-        cvCanny(*tempHaystackImage, *haystackEdges, 30, 90);
-        cvNot(*haystackEdges, *haystackEdges);
+        haystackEdges = new Image<Intensity>(haystackImage->width(), haystackImage->height());
+        haystackEdgePoints = new EdgePointList;
+        detectEdges(*haystackImage, *haystackEdges, haystackEdgePoints, searchPool);
+        reorderEdgePoints(*haystackEdgePoints, EDGE_ORDER_RANDOM);
+        haystackEdgeIndex = new EdgeIndex(*haystackEdgePoints);
     }
     catch (const std::runtime_error&)
     {
@@ -250,11 +611,10 @@ int main(int argc, char* argv[])
     try
     {
         needleImage = new Image<Rgb>(needleFilename);
-        Image<Intensity>* tempNeedleImage = new Image<Intensity>(*needleImage);
-        needleEdges = new Image<Intensity>(tempNeedleImage->width(), tempNeedleImage->height());
-        cvSmooth(*tempNeedleImage, *tempNeedleImage);
-        cvCanny(*tempNeedleImage, *needleEdges, 30, 90);
-        cvNot(*needleEdges, *needleEdges);
+        needleEdges = new Image<Intensity>(needleImage->width(), needleImage->height());
+        needleEdgePoints = new EdgePointList;
+        detectEdges(*needleImage, *needleEdges, needleEdgePoints);
+        reorderEdgePoints(*needleEdgePoints, EDGE_ORDER_DISCRIMINATIVE);
     }
     catch (const std::runtime_error&)
     {
@@ -264,18 +624,23 @@ int main(int argc, char* argv[])
 
     // Calculate the distance transform of the haystack image
     haystackDistanceTransform = new Image<Intensity32F>(haystackEdges->width(), haystackEdges->height());
-    cvDistTransform(*haystackEdges, *haystackDistanceTransform, CV_DIST_L1, CV_DIST_MASK_PRECISE, 0);
+    computeDistanceTransform(*haystackEdges, *haystackDistanceTransform, searchPool);
 
     // Calculate the distance transform of the needle image
     needleDistanceTransform = new Image<Intensity32F>(needleEdges->width(), needleEdges->height());
-    cvDistTransform(*needleEdges, *needleDistanceTransform, CV_DIST_L1, CV_DIST_MASK_PRECISE, 0);
+    computeDistanceTransform(*needleEdges, *needleDistanceTransform);
 
     // Allow the user to drag the needle image around using their mouse
     onMouseEvent(0, 0, 0, CV_EVENT_FLAG_LBUTTON, 0);
     cvSetMouseCallback(MATCH_PREVIEW_WINDOW_TITLE, onMouseEvent);
 
     std::cout << "Press ESC to exit." << std::endl
-              << "Press 'f' to find the best translation." << std::endl;
+              << "Press 'f' to find the best translation." << std::endl
+              << "Press 'b' to find the exact best translation by branch-and-bound." << std::endl
+              << "Press 'c' to find the exact best translation with a chamfer pre-screen." << std::endl
+              << "Press 'p' to find the exact best translation with an image pyramid." << std::endl
+              << "Press 'q' to find the best translation using 16-bit distance transforms." << std::endl
+              << "Press 'm' to find every instance of the needle." << std::endl;
 
     for (;;)
     {
@@ -286,7 +651,7 @@ int main(int argc, char* argv[])
         {
             printf("\tFinding best translation...");
 
-            clock_t start = clock();
+            KeySearchProfile profile;
             CvPoint bestTranslation;
             int bestRotation = 0;
             double bestScale = 1.0;
@@ -303,20 +668,118 @@ int main(int argc, char* argv[])
                               1.0	// Scale step
                           );
 
-            clock_t finish = clock();
+            profile.stop();
+
+            drawTranslatedPrior(bestTranslation, dist);
+            printf(" found at (%d, %d).\n", bestTranslation.x, bestTranslation.y);
+            profile.print();
+        }
+        else if (ch == 'b') // Find the exact best translation
+        {
+            printf("\tFinding exact best translation...");
+
+            KeySearchProfile profile;
+            double dist;
+            BranchAndBoundStats stats;
+            CvPoint bestTranslation = findBestTranslationBranchAndBound(currentSearchContext(), &dist, &stats);
+            profile.stop();
+
+            drawTranslatedPrior(bestTranslation, dist);
+            printf(" found at (%d, %d).\n", bestTranslation.x, bestTranslation.y);
+            printf("\t%lu cells expanded, %lu cells pruned, %lu translations evaluated\n",
+                   stats.cellsExpanded, stats.cellsPruned, stats.translationsEvaluated);
+            profile.print();
+        }
+        else if (ch == 'c') // Find the exact best translation, screening translations by chamfer distance
+        {
+            printf("\tFinding exact best translation with chamfer pre-screen...");
+
+            KeySearchProfile profile;
+            double dist;
+            ChamferPrescreenOptions options;
+            options.exact = true;
+            ChamferPrescreenStats stats;
+            CvPoint bestTranslation = findBestTranslationPrescreened(currentSearchContext(), options, &dist, &stats);
+            profile.stop();
+
+            drawTranslatedPrior(bestTranslation, dist);
+            printf(" found at (%d, %d).\n", bestTranslation.x, bestTranslation.y);
+            printf("\t%lu of %lu translations evaluated\n", stats.translationsEvaluated, stats.translationsScreened);
+            profile.print();
+        }
+        else if (ch == 'p') // Find the exact best translation, starting from downsampled images
+        {
+            printf("\tFinding exact best translation with an image pyramid...");
+
+            KeySearchProfile profile;
+            const EdgePyramid needlePyramid(*needleEdges, PYRAMID_LEVELS);
+            const DistancePyramid haystackPyramid(*haystackDistanceTransform, PYRAMID_LEVELS);
+            double dist;
+            PyramidSearchStats stats;
+            CvPoint bestTranslation = findBestTranslationPyramid(currentSearchContext(), needlePyramid, haystackPyramid,
+                                      &dist, &stats);
+            profile.stop();
 
             drawTranslatedPrior(bestTranslation, dist);
             printf(" found at (%d, %d).\n", bestTranslation.x, bestTranslation.y);
-            printf("\tSearch took %.2f secs\n", static_cast<double>(finish - start)/CLOCKS_PER_SEC);
+            printf("\t%lu blocks bounded, %lu blocks pruned, %lu translations evaluated\n",
+                   stats.blocksEvaluated, stats.blocksPruned, stats.translationsEvaluated);
+            profile.print();
+        }
+        else if (ch == 'q') // Find the best translation with quantized distance transforms
+        {
+            printf("\tFinding best translation with 16-bit distance transforms...");
+
+            KeySearchProfile profile;
+            Image<Intensity16> needleTransform(needleEdges->width(), needleEdges->height());
+            Image<Intensity16> haystackTransform(haystackEdges->width(), haystackEdges->height());
+            quantizeDistanceTransform(*needleDistanceTransform, needleTransform);
+            quantizeDistanceTransform(*haystackDistanceTransform, haystackTransform);
+            QuantizedSearchContext context(*needleEdgePoints, needleTransform,
+                                           *haystackEdgePoints, haystackTransform);
+            context.haystackIndex = haystackEdgeIndex;
+
+            double dist;
+            ParallelTranslationSearch search(*searchPool);
+            CvPoint bestTranslation = search.findBestTranslationRecursive(context, 32, &dist);
+            profile.stop();
+
+            drawTranslatedPrior(bestTranslation, dist);
+            printf(" found at (%d, %d).\n", bestTranslation.x, bestTranslation.y);
+            profile.print();
+        }
+        else if (ch == 'm') // Find every instance of the needle
+        {
+            printf("\tFinding every instance...");
+
+            KeySearchProfile profile;
+            DetectionOptions options;
+            options.maxDistance = DETECTION_MAX_DISTANCE;
+            options.maxDetections = DETECTION_MAX_COUNT;
+            std::vector<Detection> detections = findDetections(currentSearchContext(), options);
+            profile.stop();
+
+            drawDetections(detections);
+            printf(" found %u.\n", static_cast<unsigned>(detections.size()));
+            for (size_t i = 0; i < detections.size(); ++i)
+            {
+                printf("\t(%d, %d) dist = %.2f\n", detections[i].translation.x, detections[i].translation.y,
+                       detections[i].distance);
+            }
+            profile.print();
         }
     }
 
     delete needleEdges;
+    delete needleEdgePoints;
     delete haystackEdges;
+    delete haystackEdgePoints;
+    delete haystackEdgeIndex;
     delete needleDistanceTransform;
     delete haystackDistanceTransform;
     delete matchPreviewImage;
     delete font;
+    delete searchPool;
 
     return 0;
 }
\ No newline at end of file
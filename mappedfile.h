@@ -0,0 +1,178 @@
+/**
+ * @file mappedfile.h Provides read access to a whole file through a memory mapping.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+// Standard library
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <functional>
+#include <stdio.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+* Maps a file into memory so that its contents can be used in place, without
+* reading them into separately allocated buffers.
+*
+* The mapping is private (copy-on-write): the contents may be modified in memory,
+* e.g. by algorithms that insist on a non-const pointer, but changes are never
+* written back to the file. Pages are loaded lazily by the operating system, so
+* opening even a large file is nearly free.
+*
+* Example:
+* @code
+*   MappedFile file("needle.bank");
+*   const unsigned char* bytes = file.data();
+*   size_t length = file.size();
+* @endcode
+*/
+class MappedFile
+{
+public:
+    /**
+     * Maps the specified file.
+     *
+     * @param filename the file to map
+     * @throws std::runtime_error if the file can't be opened or mapped
+     */
+    explicit MappedFile(const std::string& filename)
+        : address(0), length(0)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to open " + filename + " for mapping.");
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize))
+        {
+            CloseHandle(file);
+            throw std::runtime_error("Failed to get the size of " + filename + ".");
+        }
+        length = static_cast<size_t>(fileSize.QuadPart);
+
+        if (length > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+            if (mapping)
+            {
+                address = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open " + filename + " for mapping.");
+
+        struct stat status;
+        if (fstat(fd, &status) != 0)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to get the size of " + filename + ".");
+        }
+        length = static_cast<size_t>(status.st_size);
+
+        if (length > 0)
+        {
+            address = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED)
+                address = 0;
+        }
+        close(fd);
+#endif
+
+        if (length > 0 && !address)
+            throw std::runtime_error("Failed to map " + filename + " into memory.");
+    }
+
+    ~MappedFile()
+    {
+        if (!address)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(address);
+#else
+        munmap(address, length);
+#endif
+    }
+
+    // The contents of the file
+    unsigned char* data()
+    {
+        return static_cast<unsigned char*>(address);
+    }
+    const unsigned char* data() const
+    {
+        return static_cast<const unsigned char*>(address);
+    }
+
+    // The size of the file in bytes
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator= (const MappedFile&);
+
+    void* address;
+    size_t length;
+};
+
+/**
+ * A name to write filename under that no other thread or process uses at once.
+ * Files that others may map are written under such a name and then put in place
+ * with replaceFile(), so nobody maps half a file.
+ */
+inline std::string temporaryFilename(const std::string& filename)
+{
+#ifdef _WIN32
+    const int process = _getpid();
+#else
+    const int process = getpid();
+#endif
+    std::ostringstream name;
+    name << filename << '.' << process << '.' << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    return name.str();
+}
+
+/**
+ * Renames temporary over filename. Replacing the file is atomic, so a reader maps
+ * either the old file or the new one.
+ *
+ * @throws std::runtime_error if the file can't be replaced; temporary is removed
+ */
+inline void replaceFile(const std::string& temporary, const std::string& filename)
+{
+#ifdef _WIN32
+    if (!MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if (rename(temporary.c_str(), filename.c_str()) != 0)
+#endif
+    {
+        remove(temporary.c_str());
+        throw std::runtime_error("Failed to write " + filename + ".");
+    }
+}
+
+#endif
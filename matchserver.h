@@ -0,0 +1,776 @@
+/**
+ * @file matchserver.h Provides a long-running match server that keeps preprocessed
+ * needles resident and answers match requests over a Unix domain socket.
+ */
+
+#ifndef MATCHSERVER_H
+#define MATCHSERVER_H
+
+#ifndef _WIN32
+
+// Standard library
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Sockets and shared memory
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "imagepool.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "preprocess.h"
+#include "templatebank.h"
+
+// Search algorithms
+#include "search.h"
+#include "parallelsearch.h"
+#include "branchandbound.h"
+#include "posesearch.h"
+#include "multisearch.h"
+#include "boundedqueue.h"
+#include "threadpool.h"
+#include "textescape.h"
+
+/**
+ * Settings of a MatchServer.
+ */
+struct MatchServerOptions
+{
+    MatchServerOptions()
+        : workerThreads(2), searchThreads(0), queueCapacity(64), initialStep(32)
+    {}
+
+    // The path of the Unix domain socket to listen on
+    std::string socketPath;
+
+    // Threads that decode and preprocess haystacks, so that several requests are
+    // prepared while one is searched
+    unsigned workerThreads;
+
+    // Threads of the pool shared by every search; 0 uses one per hardware thread
+    unsigned searchThreads;
+
+    // Requests that may wait for a worker before connections block
+    size_t queueCapacity;
+
+    // Initial step of the coarse-to-fine search
+    int initialStep;
+
+    // The poses tried by pose requests; a needle's pose bank is built from them
+    // the first time it is asked for
+    PoseSearchOptions poses;
+
+    // Directory that keeps pose banks between runs, so that a restarted server maps
+    // a needle's bank instead of building it again; empty keeps them in memory only
+    std::string bankDirectory;
+};
+
+/**
+* A needle preprocessed once and kept in memory: its edges, edge points and
+* distance transform, and the bank of its poses once a pose request needs it.
+*/
+class ResidentNeedle
+{
+public:
+    explicit ResidentNeedle(const Image<Rgb>& image)
+        : edgeImage(image.width(), image.height()),
+          distances(image.width(), image.height())
+    {
+        detectEdges(image, edgeImage, &points);
+        reorderEdgePoints(points, EDGE_ORDER_DISCRIMINATIVE);
+        computeDistanceTransform(edgeImage, distances);
+    }
+
+    const Image<Intensity>& edges() const
+    {
+        return edgeImage;
+    }
+    const EdgePointList& edgePoints() const
+    {
+        return points;
+    }
+    const Image<Intensity32F>& distanceTransform() const
+    {
+        return distances;
+    }
+
+    // The needle's poses, loaded from bankDirectory or built on first use by whichever
+    // request gets there first
+    const TemplateBank& poseBank(const PoseSearchOptions& options, WorkStealingPool& pool,
+                                 const std::string& bankDirectory) const
+    {
+        std::call_once(bankBuilt, [&]() {
+            const std::vector<NeedlePose> poses =
+                enumerateNeedlePoses(options.minRotation, options.maxRotation, options.rotationStep,
+                                     options.minScale, options.maxScale, options.scaleStep);
+            if (bankDirectory.empty())
+            {
+                bank.build(edgeImage, poses, &pool);
+                return;
+            }
+
+            const std::string filename = templateBankFilename(bankDirectory, edgeImage, poses);
+            if (bank.tryLoad(filename) && bank.matches(edgeImage) && bank.hasPoses(poses))
+                return;
+            bank.build(edgeImage, poses, &pool);
+            try
+            {
+                bank.save(filename);
+            }
+            catch (const std::runtime_error&)
+            {
+                // The bank is only built again by the next run
+            }
+        });
+        return bank;
+    }
+
+private:
+    ResidentNeedle(const ResidentNeedle&);
+    ResidentNeedle& operator= (const ResidentNeedle&);
+
+    Image<Intensity> edgeImage;
+    EdgePointList points;
+    Image<Intensity32F> distances;
+
+    mutable std::once_flag bankBuilt;
+    mutable TemplateBank bank;
+};
+
+/**
+* The needles a server holds, by name. Needles are shared, so a needle replaced
+* or unloaded while a request is searching for it stays alive until the search ends.
+*/
+class NeedleLibrary
+{
+public:
+    void add(const std::string& name, const std::shared_ptr<const ResidentNeedle>& needle)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        needles[name] = needle;
+    }
+
+    // Removes a needle, returning false if there was none of that name
+    bool remove(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return needles.erase(name) > 0;
+    }
+
+    // The needle of that name, or null
+    std::shared_ptr<const ResidentNeedle> find(const std::string& name) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = needles.find(name);
+        return found == needles.end() ? std::shared_ptr<const ResidentNeedle>() : found->second;
+    }
+
+    std::vector<std::string> names() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> result;
+        for (auto i = needles.begin(); i != needles.end(); ++i)
+            result.push_back(i->first);
+        return result;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const ResidentNeedle> > needles;
+};
+
+/**
+ * Maps an 8-bit grayscale image of width x height pixels, stored row after row
+ * without padding, from a POSIX shared memory object, for as long as the object lives.
+ */
+class SharedMemoryImage
+{
+public:
+    /**
+     * @throws std::runtime_error if the object can't be opened or is too small
+     */
+    SharedMemoryImage(const std::string& name, int width, int height)
+        : address(MAP_FAILED), size(static_cast<size_t>(width) * height), imageWidth(width), imageHeight(height)
+    {
+        if (width <= 0 || height <= 0)
+            throw std::runtime_error("Invalid size of shared memory image " + name + ".");
+
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open shared memory " + name + ".");
+        struct stat status;
+        if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < size)
+        {
+            close(fd);
+            throw std::runtime_error("Shared memory " + name + " is smaller than the image.");
+        }
+        address = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED)
+            throw std::runtime_error("Failed to map shared memory " + name + ".");
+    }
+
+    ~SharedMemoryImage()
+    {
+        if (address != MAP_FAILED)
+            munmap(address, size);
+    }
+
+    // The mapped pixels, which are read-only: writing to them faults
+    ImageView<Intensity> view() const
+    {
+        return ImageView<Intensity>(static_cast<Intensity*>(address), imageWidth, imageHeight, imageWidth);
+    }
+
+private:
+    SharedMemoryImage(const SharedMemoryImage&);
+    SharedMemoryImage& operator= (const SharedMemoryImage&);
+
+    void* address;
+    size_t size;
+    int imageWidth;
+    int imageHeight;
+};
+
+/**
+* Serves match requests over a Unix domain socket, keeping a library of
+* preprocessed needles in memory between requests.
+*
+* Clients send one request per line and get one JSON object per line back. The
+* fields of a request are separated by tabs, or by whitespace if the line has no
+* tab (in which case paths can't contain spaces):
+*
+*   LOAD name needle.png     preprocesses a needle and keeps it as name (which
+*                            can't contain commas)
+*   UNLOAD name              forgets a needle
+*   LIST                     names the needles held
+*   MATCH name[,name...] haystack [exact] [pose] [fraction=f]
+*                            finds the needles in a haystack, which is an image
+*                            file or shm:/object:WIDTHxHEIGHT, an 8-bit grayscale
+*                            image in POSIX shared memory
+*   PING                     checks that the server is up
+*   SHUTDOWN                 stops the server
+*
+* A match answers {"ok": true, "x": .., "y": .., "distance": .., "rotation": ..,
+* "scale": .., "seconds": ..}; a failure answers {"ok": false, "error": ".."}.
+* exact searches with branch-and-bound, pose tries the rotations and scales of
+* MatchServerOptions::poses, and fraction sets the partial distance fraction. A
+* needle's pose bank is built by its first pose match; with
+* MatchServerOptions::bankDirectory set, it is saved there and mapped back in by
+* later runs of the server.
+*
+* A match of several needles preprocesses the haystack once and searches for all
+* of them together with a MultiNeedleSearch, answering {"ok": true, "matches":
+* [{"name": .., "x": .., "y": .., "distance": ..}, ..], "seconds": ..} in the order
+* named. It can't be a pose match, and exact searches every translation.
+*
+* Each connection has a thread that reads its requests and ends with it. Match
+* requests go into a bounded queue, from which workerThreads workers decode and
+* preprocess haystacks in parallel; the searches themselves all run on one shared
+* WorkStealingPool, which takes them one batch at a time, so any number of clients
+* share the machine's cores without oversubscribing them.
+*
+* Example:
+* @code
+*   MatchServerOptions options;
+*   options.socketPath = "/tmp/hausdorff.sock";
+*   MatchServer server(options);
+*   server.run();   // until a client sends SHUTDOWN
+* @endcode
+* and from a shell:
+* @code
+*   printf 'LOAD\tlogo\tlogo.png\nMATCH\tlogo\tscreen.png\n' | socat - UNIX-CONNECT:/tmp/hausdorff.sock
+* @endcode
+*/
+class MatchServer
+{
+public:
+    explicit MatchServer(const MatchServerOptions& options)
+        : options(options), pool(options.searchThreads), requests(options.queueCapacity),
+          listenSocket(-1), stopping(false)
+    {}
+
+    ~MatchServer()
+    {
+        stop();
+    }
+
+    /**
+     * Listens on the socket and serves clients until stop() is called or a client
+     * sends SHUTDOWN. Replaces any stale socket file at the path.
+     *
+     * @throws std::runtime_error if the socket can't be created
+     */
+    void run();
+
+    // Makes run() return once the requests already received have been answered
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        if (stopping)
+            return;
+        stopping = true;
+        if (listenSocket >= 0)
+            shutdown(listenSocket, SHUT_RDWR);
+        for (auto i = connectionSockets.begin(); i != connectionSockets.end(); ++i)
+            shutdown(*i, SHUT_RD);
+    }
+
+    /**
+     * Answers one request line, as a connection does.
+     */
+    std::string handle(const std::string& line);
+
+    // The needles served, which can also be added to directly, before or while serving
+    NeedleLibrary& library()
+    {
+        return needles;
+    }
+
+private:
+    MatchServer(const MatchServer&);
+    MatchServer& operator= (const MatchServer&);
+
+    // A match request waiting for a worker
+    struct PendingMatch
+    {
+        std::vector<std::string> fields;
+        std::promise<std::string> response;
+    };
+    typedef std::shared_ptr<PendingMatch> PendingMatchPtr;
+
+    void serveConnection(int socket);
+    std::string load(const std::vector<std::string>& fields);
+    std::string match(const std::vector<std::string>& fields);
+
+    // Answers a match request, turning anything it throws (an image too large to
+    // allocate, an OpenCV error) into an error response rather than ending the server
+    std::string answerMatch(const std::vector<std::string>& fields)
+    {
+        try
+        {
+            return match(fields);
+        }
+        catch (const std::exception& e)
+        {
+            return errorResponse(e.what());
+        }
+        catch (...)
+        {
+            return errorResponse("The match failed.");
+        }
+    }
+
+    static std::vector<std::string> splitRequest(const std::string& line)
+    {
+        const bool tabs = line.find('\t') != std::string::npos;
+        std::vector<std::string> fields;
+        std::string field;
+        for (size_t i = 0; i <= line.size(); ++i)
+        {
+            const char c = i < line.size() ? line[i] : '\n';
+            const bool separator = tabs ? (c == '\t' || c == '\n' || c == '\r') : isspace(static_cast<unsigned char>(c)) != 0;
+            if (!separator)
+                field += c;
+            else if (!field.empty() || (tabs && c == '\t'))
+                fields.push_back(field), field.clear();
+        }
+        return fields;
+    }
+
+    static std::string errorResponse(const std::string& message)
+    {
+        return "{\"ok\": false, \"error\": \"" + escapeJson(message) + "\"}";
+    }
+
+    const MatchServerOptions options;
+    WorkStealingPool pool;
+    NeedleLibrary needles;
+    BoundedQueue<PendingMatchPtr> requests;
+
+    // The sockets of the connections open, each served by a detached thread that
+    // removes its socket and signals connectionClosed when it ends
+    std::mutex connectionMutex;
+    std::condition_variable connectionClosed;
+    int listenSocket;
+    std::set<int> connectionSockets;
+    bool stopping;
+};
+
+inline void MatchServer::run()
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (options.socketPath.empty() || options.socketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Invalid socket path " + options.socketPath + ".");
+    strncpy(address.sun_path, options.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    const int socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFd < 0)
+        throw std::runtime_error("Failed to create a socket.");
+    unlink(options.socketPath.c_str());
+    if (bind(socketFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(socketFd, 64) != 0)
+    {
+        close(socketFd);
+        throw std::runtime_error("Failed to listen on " + options.socketPath + ".");
+    }
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        listenSocket = socketFd;
+        if (stopping)
+            shutdown(listenSocket, SHUT_RDWR);
+    }
+
+    // The workers answer match requests until the queue is closed and empty
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::max(1u, options.workerThreads); ++i)
+    {
+        workers.push_back(std::thread([this]() {
+            PendingMatchPtr request;
+            while (requests.pop(request))
+                request->response.set_value(answerMatch(request->fields));
+        }));
+    }
+
+    for (;;)
+    {
+        const int connection = accept(socketFd, 0, 0);
+        if (connection < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        if (stopping)
+        {
+            close(connection);
+            break;
+        }
+        try
+        {
+            std::thread(&MatchServer::serveConnection, this, connection).detach();
+            connectionSockets.insert(connection);
+        }
+        catch (const std::system_error&)
+        {
+            // Out of threads for now; the client can try again
+            close(connection);
+        }
+    }
+
+    // Wait for the connections to answer what they have received and close
+    stop();
+    {
+        std::unique_lock<std::mutex> lock(connectionMutex);
+        while (!connectionSockets.empty())
+            connectionClosed.wait(lock);
+    }
+    requests.close();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        listenSocket = -1;
+    }
+    close(socketFd);
+    unlink(options.socketPath.c_str());
+}
+
+inline void MatchServer::serveConnection(int socket)
+{
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open)
+    {
+        const ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            break;
+        buffer.append(chunk, received);
+
+        // Answer every complete line, in order
+        size_t end;
+        while (open && (end = buffer.find('\n')) != std::string::npos)
+        {
+            const std::string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            std::string response;
+            try
+            {
+                response = handle(line) + "\n";
+            }
+            catch (const std::exception& e)
+            {
+                response = errorResponse(e.what()) + "\n";
+            }
+            for (size_t sent = 0; sent < response.size(); )
+            {
+                const ssize_t count = send(socket, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                {
+                    open = false;
+                    break;
+                }
+                sent += count;
+            }
+        }
+    }
+
+    // Signal under the lock, so that run() can't return, and the server be
+    // destroyed, before this thread is done with it
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    connectionSockets.erase(socket);
+    close(socket);
+    connectionClosed.notify_all();
+}
+
+inline std::string MatchServer::handle(const std::string& line)
+{
+    const std::vector<std::string> fields = splitRequest(line);
+    if (fields.empty())
+        return errorResponse("Empty request.");
+
+    std::string command = fields[0];
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+    if (command == "PING")
+        return "{\"ok\": true}";
+    if (command == "LOAD")
+        return load(fields);
+    if (command == "UNLOAD")
+    {
+        if (fields.size() != 2)
+            return errorResponse("Usage: UNLOAD name");
+        if (!needles.remove(fields[1]))
+            return errorResponse("No needle named " + fields[1] + ".");
+        return "{\"ok\": true}";
+    }
+    if (command == "LIST")
+    {
+        const std::vector<std::string> names = needles.names();
+        std::string response = "{\"ok\": true, \"needles\": [";
+        for (size_t i = 0; i < names.size(); ++i)
+            response += (i ? ", \"" : "\"") + escapeJson(names[i]) + "\"";
+        return response + "]}";
+    }
+    if (command == "MATCH")
+    {
+        PendingMatchPtr request(new PendingMatch);
+        request->fields = fields;
+        std::future<std::string> response = request->response.get_future();
+        if (!requests.push(request))
+            return errorResponse("The server is shutting down.");
+        return response.get();
+    }
+    if (command == "SHUTDOWN")
+    {
+        stop();
+        return "{\"ok\": true}";
+    }
+    return errorResponse("Unknown command " + fields[0] + ".");
+}
+
+inline std::string MatchServer::load(const std::vector<std::string>& fields)
+{
+    if (fields.size() != 3)
+        return errorResponse("Usage: LOAD name needle.png");
+    if (fields[1].find(',') != std::string::npos)
+        return errorResponse("Needle names can't contain commas.");
+
+    std::shared_ptr<const ResidentNeedle> needle;
+    try
+    {
+        const Image<Rgb> image(fields[2]);
+        needle.reset(new ResidentNeedle(image));
+    }
+    catch (const std::runtime_error&)
+    {
+        return errorResponse("Could not open " + fields[2] + ".");
+    }
+    needles.add(fields[1], needle);
+
+    std::ostringstream response;
+    response << "{\"ok\": true, \"points\": " << needle->edgePoints().size() << "}";
+    return response.str();
+}
+
+inline std::string MatchServer::match(const std::vector<std::string>& fields)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (fields.size() < 3)
+        return errorResponse("Usage: MATCH name[,name...] haystack [exact] [pose] [fraction=f]");
+
+    bool exact = false;
+    bool pose = false;
+    double fraction = 1.0;
+    for (size_t i = 3; i < fields.size(); ++i)
+    {
+        if (fields[i] == "exact")
+            exact = true;
+        else if (fields[i] == "pose")
+            pose = true;
+        else if (fields[i].compare(0, 9, "fraction=") == 0)
+            fraction = std::min(1.0, std::max(0.0, atof(fields[i].c_str() + 9)));
+        else
+            return errorResponse("Unknown option " + fields[i] + ".");
+    }
+
+    // The needles named, separated by commas
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<const ResidentNeedle> > found;
+    for (size_t first = 0; first <= fields[1].size(); )
+    {
+        const size_t comma = std::min(fields[1].find(',', first), fields[1].size());
+        names.push_back(fields[1].substr(first, comma - first));
+        found.push_back(needles.find(names.back()));
+        if (!found.back())
+            return errorResponse("No needle named " + names.back() + ".");
+        first = comma + 1;
+    }
+    if (pose && found.size() > 1)
+        return errorResponse("A pose match takes one needle.");
+    const std::shared_ptr<const ResidentNeedle>& needle = found[0];
+
+    // Preprocess the haystack on this worker. A haystack in shared memory is read
+    // where it is, and the edges and distances go into the worker's scratch images.
+    std::unique_ptr<SharedMemoryImage> shared;
+    std::unique_ptr<Image<Intensity> > gray;
+    try
+    {
+        const std::string& haystack = fields[2];
+        if (haystack.compare(0, 4, "shm:") == 0)
+        {
+            const size_t colon = haystack.rfind(':');
+            int width = 0;
+            int height = 0;
+            if (colon <= 4 || sscanf(haystack.c_str() + colon + 1, "%dx%d", &width, &height) != 2)
+                return errorResponse("Expected shm:/object:WIDTHxHEIGHT, not " + haystack + ".");
+            shared.reset(new SharedMemoryImage(haystack.substr(4, colon - 4), width, height));
+            gray.reset(new Image<Intensity>(shared->view()));
+        }
+        else
+        {
+            gray.reset(new Image<Intensity>(haystack));
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        return errorResponse(e.what());
+    }
+    for (size_t i = 0; i < found.size(); ++i)
+    {
+        if (gray->width() < found[i]->edges().width() || gray->height() < found[i]->edges().height())
+            return errorResponse("The haystack is smaller than the needle.");
+    }
+
+    ScratchImage<Intensity> edges(gray->width(), gray->height());
+    EdgePointList haystackPoints;
+    detectEdges(*gray, *edges, &haystackPoints);
+    reorderEdgePoints(haystackPoints, EDGE_ORDER_RANDOM);
+    const EdgeIndex haystackIndex(haystackPoints);
+    ScratchImage<Intensity32F> haystackDistanceTransform(edges->width(), edges->height());
+    computeDistanceTransform(*edges, *haystackDistanceTransform);
+
+    // Search on the shared pool
+    if (found.size() > 1)
+    {
+        std::vector<SearchContext> contexts;
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            SearchContext context(found[i]->edgePoints(), found[i]->distanceTransform(),
+                                  haystackPoints, *haystackDistanceTransform);
+            context.haystackIndex = &haystackIndex;
+            context.forwardFraction = context.reverseFraction = fraction;
+            contexts.push_back(context);
+        }
+
+        MultiNeedleSearch search(pool);
+        const std::vector<NeedleMatch> matches = exact ?
+                search.findBestTranslations(contexts, 1) :
+                search.findBestTranslationsRecursive(contexts, options.initialStep);
+
+        std::ostringstream response;
+        response << "{\"ok\": true, \"matches\": [";
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            response << (i ? ", " : "") << "{\"name\": \"" << escapeJson(names[i]) << "\", \"x\": "
+                     << matches[i].translation.x << ", \"y\": " << matches[i].translation.y
+                     << ", \"distance\": " << matches[i].distance << "}";
+        }
+        response << "], \"seconds\": "
+                 << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "}";
+        return response.str();
+    }
+
+    PoseMatch result;
+    if (pose)
+    {
+        PoseSearchOptions poseOptions = options.poses;
+        poseOptions.exactTranslation = exact;
+        poseOptions.forwardFraction = poseOptions.reverseFraction = fraction;
+        PoseSearch search(pool);
+        search.findBestTranslationScaleAndRotation(needle->poseBank(options.poses, pool, options.bankDirectory), haystackPoints,
+                *haystackDistanceTransform, poseOptions, &result, 0, &haystackIndex);
+    }
+    else
+    {
+        SearchContext context(needle->edgePoints(), needle->distanceTransform(),
+                              haystackPoints, *haystackDistanceTransform);
+        context.haystackIndex = &haystackIndex;
+        context.forwardFraction = context.reverseFraction = fraction;
+        if (exact)
+        {
+            result.translation = findBestTranslationBranchAndBound(context, &result.distance);
+        }
+        else
+        {
+            ParallelTranslationSearch search(pool);
+            result.translation = search.findBestTranslationRecursive(context, options.initialStep, &result.distance);
+        }
+    }
+
+    std::ostringstream response;
+    response << "{\"ok\": true, \"x\": " << result.translation.x << ", \"y\": " << result.translation.y
+             << ", \"distance\": " << result.distance << ", \"rotation\": " << result.rotation
+             << ", \"scale\": " << result.scale << ", \"seconds\": "
+             << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "}";
+    return response.str();
+}
+
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * @file multisearch.h Provides a search for many needles in one haystack that shares
+ * the haystack's data between the needles.
+ */
+
+#ifndef MULTISEARCH_H
+#define MULTISEARCH_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+// Opencv
+#include "cv.h"
+
+// Search algorithms
+#include "search.h"
+#include "threadpool.h"
+
+/**
+* The translations of one needle that a MultiNeedleSearch level looks at: every
+* step-th offset from (minX, minY) up to, but not including, (maxX, maxY).
+*/
+struct SearchWindow
+{
+    SearchWindow()
+        : minX(0), minY(0), maxX(0), maxY(0)
+    {}
+    SearchWindow(int minX, int minY, int maxX, int maxY)
+        : minX(minX), minY(minY), maxX(maxX), maxY(maxY)
+    {}
+
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+};
+
+/**
+* The best translation of one needle, and its Hausdorff distance.
+*/
+struct NeedleMatch
+{
+    NeedleMatch()
+        : translation(cvPoint(0, 0)), distance(std::numeric_limits<double>::max())
+    {}
+
+    CvPoint translation;
+    double distance;
+};
+
+/**
+* Searches for the best translations of many needles in the same haystack.
+*
+* The haystack's edges, edge points and distance transform are computed once and
+* shared by the search contexts of all the needles. The offsets are then visited
+* tile by tile, and every needle is evaluated on a tile before the search moves on
+* to the next one, so the part of the haystack's distance transform under a tile
+* is read from cache by all the needles rather than fetched again for each of
+* them. The tiles are the tasks of a WorkStealingPool.
+*
+* Each needle gets exactly the result the serial findBestTranslation() (or
+* findBestTranslationRecursive()) in search.h returns for its context on its own.
+*
+* Example:
+* @code
+*   // Preprocess the haystack once...
+*   EdgePointList haystackPoints(haystackEdges);
+*   Image<Intensity32F> haystackDistanceTransform(haystackEdges.width(), haystackEdges.height());
+*   computeDistanceTransform(haystackEdges, haystackDistanceTransform);
+*
+*   // ...and share it between the needles
+*   std::vector<SearchContext> contexts;
+*   for (size_t i = 0; i < needles.size(); ++i)
+*       contexts.push_back(SearchContext(needlePoints[i], needleDistanceTransforms[i],
+*                                        haystackPoints, haystackDistanceTransform));
+*
+*   WorkStealingPool pool;
+*   MultiNeedleSearch search(pool);
+*   std::vector<NeedleMatch> matches = search.findBestTranslationsRecursive(contexts);
+* @endcode
+*/
+class MultiNeedleSearch
+{
+public:
+    /**
+     * @param pool the threads to search with
+     * @param tileSize the width and height, in haystack pixels, of the block of
+     *     offsets that every needle is evaluated on before moving on
+     */
+    explicit MultiNeedleSearch(WorkStealingPool& pool, int tileSize = 32)
+        : pool(pool), tileSize(std::max(1, tileSize))
+    {}
+
+    /**
+     * Finds the best translation of every needle over every step-th offset of its
+     * default search range, like findBestTranslation() does for one needle.
+     *
+     * @param contexts the needles, which must all share one haystack
+     * @param step the distance between the offsets searched
+     * @return the best translation of each needle, in the order of contexts
+     */
+    template <typename DistanceT>
+    std::vector<NeedleMatch> findBestTranslations(
+        const std::vector<BasicSearchContext<DistanceT> >& contexts, int step = 2)
+    {
+        std::vector<SearchWindow> windows(contexts.size());
+        for (size_t i = 0; i < contexts.size(); ++i)
+            windows[i] = SearchWindow(0, 0, contexts[i].maxOffsetX(), contexts[i].maxOffsetY());
+        return findBestTranslations(contexts, windows, step);
+    }
+
+    /**
+     * Finds the best translation of every needle within its own window of offsets.
+     *
+     * @param contexts the needles, which must all share one haystack
+     * @param windows the offsets to search for each needle
+     * @param step the distance between the offsets searched
+     * @return the best translation of each needle, in the order of contexts
+     */
+    template <typename DistanceT>
+    std::vector<NeedleMatch> findBestTranslations(
+        const std::vector<BasicSearchContext<DistanceT> >& contexts,
+        const std::vector<SearchWindow>& windows,
+        int step)
+    {
+        checkSharedHaystack(contexts);
+        if (windows.size() != contexts.size())
+            throw std::invalid_argument("Every needle needs a search window.");
+
+        ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+        const size_t needles = contexts.size();
+        std::vector<NeedleMatch> matches(needles);
+        if (needles == 0)
+            return matches;
+
+        // The tiles cover the union of the windows
+        int minX = std::numeric_limits<int>::max();
+        int minY = std::numeric_limits<int>::max();
+        int maxX = std::numeric_limits<int>::min();
+        int maxY = std::numeric_limits<int>::min();
+        for (size_t i = 0; i < needles; ++i)
+        {
+            minX = std::min(minX, windows[i].minX);
+            minY = std::min(minY, windows[i].minY);
+            maxX = std::max(maxX, windows[i].maxX);
+            maxY = std::max(maxY, windows[i].maxY);
+        }
+        if (maxX <= minX || maxY <= minY)
+            return matches;
+
+        const int tileColumns = (maxX - minX + tileSize - 1) / tileSize;
+        const int tileRows = (maxY - minY + tileSize - 1) / tileSize;
+
+        std::vector<std::atomic<double> > sharedBests(needles);
+        for (size_t i = 0; i < needles; ++i)
+            sharedBests[i].store(std::numeric_limits<double>::max(), std::memory_order_relaxed);
+        std::vector<LocalBest> localBests(needles * pool.threadCount());
+
+        pool.run(static_cast<size_t>(tileColumns) * tileRows, [&](size_t tile, unsigned worker) {
+            const int tileMinX = minX + static_cast<int>(tile % tileColumns) * tileSize;
+            const int tileMinY = minY + static_cast<int>(tile / tileColumns) * tileSize;
+            const int tileMaxX = std::min(maxX, tileMinX + tileSize);
+            const int tileMaxY = std::min(maxY, tileMinY + tileSize);
+
+            for (size_t needle = 0; needle < needles; ++needle)
+            {
+                const SearchWindow& window = windows[needle];
+                const BasicSearchContext<DistanceT>& context = contexts[needle];
+                LocalBest& best = localBests[worker * needles + needle];
+                std::atomic<double>& sharedBest = sharedBests[needle];
+
+                // The offsets of the needle's grid that fall in this tile
+                const int firstX = firstOnGrid(window.minX, std::max(window.minX, tileMinX), step);
+                const int firstY = firstOnGrid(window.minY, std::max(window.minY, tileMinY), step);
+                const int lastX = std::min(window.maxX, tileMaxX);
+                const int lastY = std::min(window.maxY, tileMaxY);
+
+                for (int y = firstY; y < lastY; y += step)
+                {
+                    for (int x = firstX; x < lastX; x += step)
+                    {
+                        const double threshold = std::min(best.distance, sharedBest.load(std::memory_order_relaxed));
+                        const double dist = context.distanceAt(cvPoint(x, y), threshold);
+
+                        // Rejected translations return some value above threshold, not their distance
+                        if (dist <= threshold && isBetterTranslation(dist, cvPoint(x, y), best.distance, best.point))
+                        {
+                            best.distance = dist;
+                            best.point = cvPoint(x, y);
+                            lowerSharedDistance(sharedBest, dist);
+                        }
+                    }
+                }
+            }
+        });
+
+        // Merge the per-thread results
+        for (size_t needle = 0; needle < needles; ++needle)
+        {
+            LocalBest best;
+            for (unsigned worker = 0; worker < pool.threadCount(); ++worker)
+            {
+                const LocalBest& local = localBests[worker * needles + needle];
+                if (isBetterTranslation(local.distance, local.point, best.distance, best.point))
+                    best = local;
+            }
+
+            // The serial search reports (0, 0) when there is nothing to search
+            if (best.distance != std::numeric_limits<double>::max())
+                matches[needle].translation = best.point;
+            matches[needle].distance = best.distance;
+        }
+        return matches;
+    }
+
+    /**
+     * Finds the best translation of every needle for successively finer step sizes,
+     * like findBestTranslationRecursive() does for one needle. The needles are
+     * searched together at each step size, each in its own shrinking window.
+     *
+     * @param contexts the needles, which must all share one haystack
+     * @param initialStep the distance between the offsets of the coarsest search
+     * @return the best translation of each needle, in the order of contexts
+     */
+    template <typename DistanceT>
+    std::vector<NeedleMatch> findBestTranslationsRecursive(
+        const std::vector<BasicSearchContext<DistanceT> >& contexts, int initialStep = 32)
+    {
+        ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+        const size_t needles = contexts.size();
+        std::vector<NeedleMatch> bests(needles);
+        std::vector<SearchWindow> windows(needles);
+        for (size_t i = 0; i < needles; ++i)
+            windows[i] = SearchWindow(0, 0, contexts[i].maxOffsetX(), contexts[i].maxOffsetY());
+
+        // Mirrors searchCoarseToFine() for every needle at once
+        for (int step = initialStep; step > 0; step /= 2)
+        {
+            const std::vector<NeedleMatch> level = findBestTranslations(contexts, windows, step);
+            for (size_t i = 0; i < needles; ++i)
+            {
+                if (level[i].distance < bests[i].distance)
+                {
+                    bests[i] = level[i];
+
+                    const CvPoint& translation = level[i].translation;
+                    windows[i].minX = std::max<int>(0, translation.x - step);
+                    windows[i].minY = std::max<int>(0, translation.y - step);
+                    windows[i].maxX = std::min<int>(contexts[i].maxOffsetX(), translation.x + step);
+                    windows[i].maxY = std::min<int>(contexts[i].maxOffsetY(), translation.y + step);
+                }
+            }
+        }
+        return bests;
+    }
+
+private:
+
+    // The best translation of one needle found by one thread, padded to its own
+    // cache line so that threads updating their results don't slow each other down
+    struct LocalBest
+    {
+        LocalBest()
+            : distance(std::numeric_limits<double>::max()),
+              point(cvPoint(std::numeric_limits<int>::max(), std::numeric_limits<int>::max()))
+        {}
+
+        double distance;
+        CvPoint point;
+        char padding[64 - sizeof(double) - sizeof(CvPoint)];
+    };
+
+    // The first coordinate at or after from on the grid origin + k * step
+    static int firstOnGrid(int origin, int from, int step)
+    {
+        return origin + (from - origin + step - 1) / step * step;
+    }
+
+    // The tiles only keep the haystack in cache if every needle reads the same one
+    template <typename DistanceT>
+    static void checkSharedHaystack(const std::vector<BasicSearchContext<DistanceT> >& contexts)
+    {
+        for (size_t i = 1; i < contexts.size(); ++i)
+        {
+            if (contexts[i].haystackDistanceTransform != contexts[0].haystackDistanceTransform ||
+                    contexts[i].haystackPoints != contexts[0].haystackPoints)
+                throw std::invalid_argument("The needles of a multi-needle search must share one haystack.");
+        }
+    }
+
+    WorkStealingPool& pool;
+    int tileSize;
+};
+
+#endif
@@ -0,0 +1,174 @@
+/**
+ * @file parallelsearch.h Provides a multithreaded version of the translation search.
+ */
+
+#ifndef PARALLELSEARCH_H
+#define PARALLELSEARCH_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <atomic>
+
+// Opencv
+#include "cv.h"
+
+// Search algorithms
+#include "search.h"
+#include "threadpool.h"
+
+/**
+* Searches for the best translation of the needle on all of a WorkStealingPool's
+* threads.
+*
+* The grid of candidate offsets is cut into square tiles of tileSize x tileSize
+* offsets, and each tile is one task for the pool. Every thread keeps its own best
+* translation, and the best distance found by any thread is published through an
+* atomic so that all threads reject hopeless translations against it. Ties are
+* broken with isBetterTranslation(), so the result is exactly the one the serial
+* findBestTranslation() in search.h returns, whatever the number of threads.
+*
+* Example:
+* @code
+*   WorkStealingPool pool(8);
+*   ParallelTranslationSearch search(pool);
+*   double dist;
+*   CvPoint best = search.findBestTranslationRecursive(context, 32, &dist);
+* @endcode
+*/
+class ParallelTranslationSearch
+{
+public:
+    /**
+     * @param pool the threads to search with
+     * @param tileSize the width and height, in offsets, of one unit of work
+     */
+    explicit ParallelTranslationSearch(WorkStealingPool& pool, int tileSize = 16)
+        : pool(pool), tileSize(tileSize)
+    {}
+
+    /*
+     * Finds the translation of needle in haystack that results in the minimal Hausdorff distance.
+     * Takes the same arguments as the serial findBestTranslation().
+     */
+    template <typename DistanceT>
+    CvPoint findBestTranslation(const BasicSearchContext<DistanceT>& context,
+                                int step = 2, double* dist = 0,
+                                int minX = 0, int minY = 0,
+                                int maxX = -1, int maxY = -1,
+                                std::atomic<double>* sharedBound = 0,
+                                double boundSlack = 0)
+    {
+        ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+        const int maxOffsetX = maxX != -1 ? maxX : context.maxOffsetX();
+        const int maxOffsetY = maxY != -1 ? maxY : context.maxOffsetY();
+
+        // Number of offsets sampled along each axis, and of tiles covering them
+        const int columns = maxOffsetX > minX ? (maxOffsetX - minX + step - 1) / step : 0;
+        const int rows = maxOffsetY > minY ? (maxOffsetY - minY + step - 1) / step : 0;
+        const int tileColumns = (columns + tileSize - 1) / tileSize;
+        const int tileRows = (rows + tileSize - 1) / tileSize;
+
+        std::atomic<double> sharedBest(std::numeric_limits<double>::max());
+        std::vector<LocalBest> localBests(pool.threadCount());
+
+        pool.run(static_cast<size_t>(tileColumns) * tileRows, [&](size_t tile, unsigned worker) {
+            LocalBest& best = localBests[worker];
+            const int firstColumn = static_cast<int>(tile % tileColumns) * tileSize;
+            const int firstRow = static_cast<int>(tile / tileColumns) * tileSize;
+            const int lastColumn = std::min(columns, firstColumn + tileSize);
+            const int lastRow = std::min(rows, firstRow + tileSize);
+
+            for (int row = firstRow; row < lastRow; ++row)
+            {
+                const int y = minY + row * step;
+                for (int column = firstColumn; column < lastColumn; ++column)
+                {
+                    const int x = minX + column * step;
+                    double threshold = std::min(best.distance, sharedBest.load(std::memory_order_relaxed));
+                    if (sharedBound)
+                        threshold = std::min(threshold, sharedBound->load(std::memory_order_relaxed) + boundSlack);
+                    const double dist = context.distanceAt(cvPoint(x, y), threshold);
+
+                    // Rejected translations return some value above threshold, not their distance
+                    if (dist <= threshold && isBetterTranslation(dist, cvPoint(x, y), best.distance, best.point))
+                    {
+                        best.distance = dist;
+                        best.point = cvPoint(x, y);
+                        lowerSharedDistance(sharedBest, dist);
+                        if (sharedBound)
+                            lowerSharedDistance(*sharedBound, dist);
+                    }
+                }
+            }
+        });
+
+        // Merge the per-thread results
+        LocalBest best;
+        for (size_t i = 0; i < localBests.size(); ++i)
+        {
+            if (isBetterTranslation(localBests[i].distance, localBests[i].point, best.distance, best.point))
+                best = localBests[i];
+        }
+
+        if (dist)
+            *dist = best.distance;
+
+        // The serial search reports (0, 0) when there is nothing to search
+        return best.distance == std::numeric_limits<double>::max() ? cvPoint(0, 0) : best.point;
+    }
+
+    /*
+     * Finds the translation of needle in haystack that results in the minimal Hausdorff distance
+     * for successively finer step sizes, like the serial findBestTranslationRecursive().
+     */
+    template <typename DistanceT>
+    CvPoint findBestTranslationRecursive(const BasicSearchContext<DistanceT>& context, int initialStep = 32, double* dist = 0,
+                                         std::atomic<double>* sharedBound = 0)
+    {
+        LevelSearch<DistanceT> levelSearch(*this, context, sharedBound);
+        return searchCoarseToFine(levelSearch, context.maxOffsetX(), context.maxOffsetY(), initialStep, dist,
+                                  sharedBound);
+    }
+
+private:
+
+    // The best translation found by one thread, padded to its own cache line so
+    // that threads updating their results don't slow each other down
+    struct LocalBest
+    {
+        LocalBest()
+            : distance(std::numeric_limits<double>::max()),
+              point(cvPoint(std::numeric_limits<int>::max(), std::numeric_limits<int>::max()))
+        {}
+
+        double distance;
+        CvPoint point;
+        char padding[64 - sizeof(double) - sizeof(CvPoint)];
+    };
+
+    // Adapts findBestTranslation() to searchCoarseToFine()
+    template <typename DistanceT>
+    struct LevelSearch
+    {
+        LevelSearch(ParallelTranslationSearch& search, const BasicSearchContext<DistanceT>& context,
+                    std::atomic<double>* sharedBound)
+            : search(search), context(context), sharedBound(sharedBound)
+        {}
+
+        CvPoint operator()(int step, double* dist, int minX, int minY, int maxX, int maxY)
+        {
+            return search.findBestTranslation(context, step, dist, minX, minY, maxX, maxY, sharedBound,
+                                              coarseToFineSlack(step));
+        }
+
+        ParallelTranslationSearch& search;
+        const BasicSearchContext<DistanceT>& context;
+        std::atomic<double>* sharedBound;
+    };
+
+    WorkStealingPool& pool;
+    int tileSize;
+};
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * @file pnmfile.h Provides reading of arbitrary regions of binary PGM and PPM files
+ * without loading the whole image.
+ */
+
+#ifndef PNMFILE_H
+#define PNMFILE_H
+
+// Standard library
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdint.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+
+/**
+* Reads rectangular regions of a binary PGM (P5) or PPM (P6) file with 8-bit samples.
+*
+* Unlike Image, which decodes a whole file into memory, a PnmReader only reads
+* the rows of the region asked for, so images far larger than memory can be
+* processed a piece at a time. Both formats store their pixels uncompressed in
+* raster order after a short text header, which makes any pixel a single seek
+* away.
+*
+* Example:
+* @code
+*   PnmReader reader("mosaic.ppm");
+*   Image<Rgb> tile(1024, 1024);
+*   reader.read(cvRect(4096, 8192, 1024, 1024), tile);
+* @endcode
+*/
+class PnmReader
+{
+public:
+    /**
+     * Opens a file and reads its header.
+     *
+     * @throws std::runtime_error if the file can't be opened or isn't an 8-bit binary PGM or PPM
+     */
+    explicit PnmReader(const std::string& filename)
+        : file(fopen(filename.c_str(), "rb")), imageWidth(0), imageHeight(0), channels(0), dataOffset(0)
+    {
+        if (!file)
+            throw std::runtime_error("Failed to open " + filename + ".");
+
+        const int magic = fgetc(file) == 'P' ? fgetc(file) : 0;
+        channels = magic == '5' ? 1 : magic == '6' ? 3 : 0;
+        int maxValue = 0;
+        if (!channels || !readHeaderNumber(imageWidth) || !readHeaderNumber(imageHeight) ||
+                !readHeaderNumber(maxValue) || maxValue <= 0 || maxValue > 255)
+        {
+            fclose(file);
+            throw std::runtime_error(filename + " is not an 8-bit binary PGM or PPM file.");
+        }
+
+        // The single whitespace character that ends the header has been read
+        dataOffset = tell();
+    }
+
+    ~PnmReader()
+    {
+        fclose(file);
+    }
+
+    // Dimensions of the image
+    int width() const
+    {
+        return imageWidth;
+    }
+    int height() const
+    {
+        return imageHeight;
+    }
+
+    /**
+     * Reads a region of the image.
+     *
+     * @param region the region to read; must lie within the image
+     * @param pixels receives the pixels; must be the size of region
+     * @throws std::runtime_error if the file is shorter than its header says
+     */
+    void read(const CvRect& region, Image<Rgb>& pixels)
+    {
+        std::vector<unsigned char> row(static_cast<size_t>(region.width) * channels);
+        for (int y = 0; y < region.height; ++y)
+        {
+            const uint64_t offset = dataOffset +
+                                    (static_cast<uint64_t>(region.y + y) * imageWidth + region.x) * channels;
+            if (!seek(offset) || fread(&row[0], 1, row.size(), file) != row.size())
+                throw std::runtime_error("Unexpected end of image data.");
+
+            Rgb* const destination = pixels[y];
+            for (int x = 0; x < region.width; ++x)
+            {
+                const unsigned char* const sample = &row[static_cast<size_t>(x) * channels];
+                destination[x] = channels == 3 ? Rgb(sample[0], sample[1], sample[2])
+                                 : Rgb(sample[0], sample[0], sample[0]);
+            }
+        }
+    }
+
+private:
+    PnmReader(const PnmReader&);
+    PnmReader& operator= (const PnmReader&);
+
+    // Reads a number from the header, skipping whitespace and comments
+    bool readHeaderNumber(int& number)
+    {
+        int ch = fgetc(file);
+        while (ch == '#' || isspace(ch))
+        {
+            if (ch == '#')
+            {
+                while (ch != '\n' && ch != EOF)
+                    ch = fgetc(file);
+            }
+            ch = fgetc(file);
+        }
+        if (!isdigit(ch))
+            return false;
+
+        number = 0;
+        while (isdigit(ch))
+        {
+            number = number * 10 + (ch - '0');
+            ch = fgetc(file);
+        }
+        return ch != EOF;
+    }
+
+    // 64-bit file positioning, as images may be larger than 2 GB
+    bool seek(uint64_t offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+        return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+    uint64_t tell()
+    {
+#ifdef _WIN32
+        return static_cast<uint64_t>(_ftelli64(file));
+#else
+        return static_cast<uint64_t>(ftello(file));
+#endif
+    }
+
+    FILE* file;
+    int imageWidth;
+    int imageHeight;
+    int channels;
+    uint64_t dataOffset;
+};
+
+#endif
@@ -0,0 +1,347 @@
+/**
+ * @file posesearch.h Provides a multithreaded search for the rotation, scale and translation
+ * of a needle that minimize the Hausdorff distance.
+ */
+
+#ifndef POSESEARCH_H
+#define POSESEARCH_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <atomic>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "templatebank.h"
+
+// Search algorithms
+#include "search.h"
+#include "parallelsearch.h"
+#include "branchandbound.h"
+#include "threadpool.h"
+
+/**
+ * Parameters of a search over needle poses.
+ */
+struct PoseSearchOptions
+{
+    PoseSearchOptions()
+        : initialTranslationStep(32),
+          minRotation(-32), maxRotation(32), rotationStep(4),
+          minScale(0.5), maxScale(2.0), scaleStep(0.25),
+          exactTranslation(false),
+          forwardFraction(1.0), reverseFraction(1.0),
+          densityRatio(0)
+    {}
+
+    // Initial step of the coarse-to-fine translation search (in pixels)
+    int initialTranslationStep;
+
+    // Rotations to try (in degrees)
+    int minRotation;
+    int maxRotation;
+    int rotationStep;
+
+    // Scales to try
+    double minScale;
+    double maxScale;
+    double scaleStep;
+
+    // Search the translations of each pose exhaustively with the branch-and-bound
+    // search rather than the greedy coarse-to-fine search. The branch-and-bound
+    // search can prove that a pose won't beat the best pose found so far, so
+    // hopeless poses are cancelled early and the result is the exact optimum.
+    bool exactTranslation;
+
+    // The fractions of the points that must match, as in SearchContext. Partial
+    // distances are less upset by clutter and occlusion, which makes coarser
+    // translation steps and pose grids safer.
+    double forwardFraction;
+    double reverseFraction;
+
+    // How far the edge count under a pose may stray from the pose's own, as in
+    // SearchContext; 0 turns the check off
+    double densityRatio;
+};
+
+/**
+ * The best pose and translation of the needle found by a search.
+ */
+struct PoseMatch
+{
+    PoseMatch()
+        : translation(cvPoint(0, 0)), rotation(0), scale(1.0),
+          distance(std::numeric_limits<double>::max())
+    {}
+
+    CvPoint translation;
+    int rotation;
+    double scale;
+    double distance;
+};
+
+/**
+ * Counters describing the work done by a pose search.
+ */
+struct PoseSearchStats
+{
+    PoseSearchStats()
+        : posesSearched(0), posesCancelled(0)
+    {}
+
+    // Poses whose translations were searched
+    unsigned long posesSearched;
+
+    // Poses abandoned because they could not beat the best pose
+    unsigned long posesCancelled;
+
+    // Totals over all poses of the branch-and-bound counters (exact search only)
+    BranchAndBoundStats translation;
+};
+
+/**
+* Searches for the best rotation, scale and translation of the needle on all of a
+* WorkStealingPool's threads.
+*
+* The poses come from a TemplateBank, which holds the edge points and distance
+* transform of every pose, so poses share nothing but the (read-only) haystack
+* and the best distance found so far. Every pose searches its translations
+* within that distance, so a pose that can't beat the best pose is cancelled
+* early. When there are at least as many poses as threads, each pose is one
+* task whose translations are searched serially. With fewer poses (a single
+* pose, in the extreme) the translations are split instead: the exact search
+* runs one task per band of translation rows, and the greedy search runs each
+* pose with ParallelTranslationSearch. A bank that is reused across haystacks
+* (or saved with TemplateBank::save()) saves warping the needle again.
+*
+* Ties between poses go to the pose that comes first in the bank. The exact
+* search's result therefore does not depend on the number of threads; the
+* greedy search's may, since which coarse-to-fine paths are cut short depends
+* on the order the poses finish in.
+*
+* Example:
+* @code
+*   WorkStealingPool pool;
+*   PoseSearch search(pool);
+*   PoseSearchOptions options;
+*   options.exactTranslation = true;
+*   PoseMatch match;
+*   search.findBestTranslationScaleAndRotation(needleEdges, haystackPoints,
+*                                              haystackDistanceTransform, options, &match);
+* @endcode
+*/
+class PoseSearch
+{
+public:
+    explicit PoseSearch(WorkStealingPool& pool)
+        : pool(pool)
+    {}
+
+    /*
+     * Finds the translation of needle in haystack that results in the minimal Hausdorff distance,
+     * allowing for some variation in scale and rotation of the needle in the haystack image.
+     *
+     * @param needleEdges the needle's edges in their original pose
+     * @param haystackPoints the haystack's edge points
+     * @param haystackDistanceTransform the distance transform of the haystack's edges
+     * @param options the poses to try and how to search their translations
+     * @param match if not null, receives the best pose and translation
+     * @param stats if not null, receives counters describing the search
+     * @param haystackIndex if not null, an EdgeIndex of haystackPoints
+     * @return the distance of the best match
+     */
+    double findBestTranslationScaleAndRotation(
+        const Image<Intensity>& needleEdges,
+        const EdgePointList& haystackPoints,
+        const Image<Intensity32F>& haystackDistanceTransform,
+        const PoseSearchOptions& options = PoseSearchOptions(),
+        PoseMatch* match = 0,
+        PoseSearchStats* stats = 0,
+        const EdgeIndex* haystackIndex = 0)
+    {
+        TemplateBank bank;
+        bank.build(needleEdges,
+                   enumerateNeedlePoses(options.minRotation, options.maxRotation, options.rotationStep,
+                                        options.minScale, options.maxScale, options.scaleStep),
+                   &pool);
+        return findBestTranslationScaleAndRotation(bank, haystackPoints, haystackDistanceTransform,
+                options, match, stats, haystackIndex);
+    }
+
+    /*
+     * Finds the translation and pose of needle in haystack that results in the minimal Hausdorff
+     * distance, trying the poses of a prepared bank. The rotation and scale ranges of options are
+     * ignored; the bank's poses are searched instead.
+     *
+     * @param bank the needle's poses
+     * @param haystackPoints the haystack's edge points
+     * @param haystackDistanceTransform the distance transform of the haystack's edges
+     * @param options how to search the translations of each pose
+     * @param match if not null, receives the best pose and translation
+     * @param stats if not null, receives counters describing the search
+     * @param haystackIndex if not null, an EdgeIndex of haystackPoints; otherwise one is
+     *     built for the duration of the search, so callers that search the same haystack
+     *     more than once should build it themselves
+     * @return the distance of the best match
+     */
+    double findBestTranslationScaleAndRotation(
+        const TemplateBank& bank,
+        const EdgePointList& haystackPoints,
+        const Image<Intensity32F>& haystackDistanceTransform,
+        const PoseSearchOptions& options = PoseSearchOptions(),
+        PoseMatch* match = 0,
+        PoseSearchStats* stats = 0,
+        const EdgeIndex* haystackIndex = 0)
+    {
+        ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+        EdgeIndex ownIndex;
+        if (!haystackIndex)
+        {
+            ownIndex.assign(haystackPoints);
+            haystackIndex = &ownIndex;
+        }
+
+        std::vector<PoseMatch> results(bank.size());
+        std::vector<PoseSearchStats> workerStats(pool.threadCount());
+        std::atomic<double> sharedBest(std::numeric_limits<double>::max());
+        const bool fewerPosesThanThreads = bank.size() < pool.threadCount();
+
+        for (size_t poseIndex = 0; poseIndex < bank.size(); ++poseIndex)
+        {
+            results[poseIndex].rotation = bank[poseIndex].pose.rotation;
+            results[poseIndex].scale = bank[poseIndex].pose.scale;
+        }
+
+        if (options.exactTranslation)
+        {
+            // Enough bands to keep every thread busy while the poses are cancelled unevenly
+            const size_t bandsPerPose = fewerPosesThanThreads ?
+                                        (pool.threadCount() * BANDS_PER_THREAD + bank.size() - 1) / bank.size() : 1;
+            std::vector<PoseMatch> bandResults(bank.size() * bandsPerPose);
+
+            pool.run(bandResults.size(), [&](size_t task, unsigned worker) {
+                const size_t poseIndex = task / bandsPerPose;
+                const size_t band = task % bandsPerPose;
+                PoseSearchStats& counters = workerStats[worker];
+                SearchContext context = createContext(bank[poseIndex], haystackPoints, *haystackIndex, haystackDistanceTransform,
+                                                      options);
+
+                const int minY = static_cast<int>(context.maxOffsetY() * band / bandsPerPose);
+                const int maxY = static_cast<int>(context.maxOffsetY() * (band + 1) / bandsPerPose);
+                if (minY >= maxY)
+                    return;
+
+                BranchAndBoundStats translationStats;
+                PoseMatch& result = bandResults[task];
+                result.translation = findBestTranslationBranchAndBound(
+                                         context, &result.distance, &translationStats,
+                                         0, minY, -1, maxY, 32, std::numeric_limits<double>::max(), &sharedBest);
+                addBranchAndBoundStats(counters.translation, translationStats);
+            });
+
+            for (size_t poseIndex = 0; poseIndex < bank.size(); ++poseIndex)
+            {
+                PoseMatch& result = results[poseIndex];
+                for (size_t band = 0; band < bandsPerPose; ++band)
+                {
+                    const PoseMatch& bandResult = bandResults[poseIndex * bandsPerPose + band];
+                    if (bandResult.distance != std::numeric_limits<double>::max() &&
+                            isBetterTranslation(bandResult.distance, bandResult.translation,
+                                                result.distance, result.translation))
+                    {
+                        result.translation = bandResult.translation;
+                        result.distance = bandResult.distance;
+                    }
+                }
+            }
+        }
+        else if (fewerPosesThanThreads)
+        {
+            ParallelTranslationSearch search(pool);
+            for (size_t poseIndex = 0; poseIndex < bank.size(); ++poseIndex)
+            {
+                SearchContext context = createContext(bank[poseIndex], haystackPoints, *haystackIndex, haystackDistanceTransform,
+                                                      options);
+                PoseMatch& result = results[poseIndex];
+                result.translation = search.findBestTranslationRecursive(
+                                         context, options.initialTranslationStep, &result.distance, &sharedBest);
+            }
+        }
+        else
+        {
+            pool.run(bank.size(), [&](size_t poseIndex, unsigned) {
+                SearchContext context = createContext(bank[poseIndex], haystackPoints, *haystackIndex, haystackDistanceTransform,
+                                                      options);
+                PoseMatch& result = results[poseIndex];
+                result.translation = findBestTranslationRecursive(
+                                         context, options.initialTranslationStep, &result.distance, &sharedBest);
+            });
+        }
+
+        // The first pose with the smallest distance wins
+        PoseMatch best;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            if (results[i].distance < best.distance)
+                best = results[i];
+        }
+
+        if (match)
+            *match = best;
+
+        if (stats)
+        {
+            *stats = PoseSearchStats();
+            stats->posesSearched = results.size();
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                if (results[i].distance == std::numeric_limits<double>::max())
+                    ++ stats->posesCancelled;
+            }
+            for (size_t i = 0; i < workerStats.size(); ++i)
+                addBranchAndBoundStats(stats->translation, workerStats[i].translation);
+        }
+
+        return best.distance;
+    }
+
+private:
+
+    enum
+    {
+        // Bands of translation rows per thread when the exact search splits poses
+        BANDS_PER_THREAD = 4
+    };
+
+    static SearchContext createContext(const PoseTemplate& pose,
+                                       const EdgePointList& haystackPoints,
+                                       const EdgeIndex& haystackIndex,
+                                       const Image<Intensity32F>& haystackDistanceTransform,
+                                       const PoseSearchOptions& options)
+    {
+        SearchContext context(pose.points, pose.distanceTransform, haystackPoints, haystackDistanceTransform);
+        context.haystackIndex = &haystackIndex;
+        context.forwardFraction = options.forwardFraction;
+        context.reverseFraction = options.reverseFraction;
+        context.densityRatio = options.densityRatio;
+        return context;
+    }
+
+    static void addBranchAndBoundStats(BranchAndBoundStats& total, const BranchAndBoundStats& stats)
+    {
+        total.cellsExpanded += stats.cellsExpanded;
+        total.cellsPruned += stats.cellsPruned;
+        total.translationsEvaluated += stats.translationsEvaluated;
+        total.pointsEvaluated += stats.pointsEvaluated;
+    }
+
+    WorkStealingPool& pool;
+};
+
+#endif
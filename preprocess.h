@@ -0,0 +1,297 @@
+/**
+ * @file preprocess.h Provides the preprocessing that turns a photo into what the searches
+ * read: its edges, their edge point list and their distance transform.
+ */
+
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+// Standard library
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdlib.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "imagepool.h"
+#include "edgepoints.h"
+#include "edgeextractor.h"
+#include "distancetransform.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+// How far around a region Canny needs to see to find the region's edges as it
+// would in the whole image (but for weak edges followed by its hysteresis)
+static const int EDGE_CONTEXT_MARGIN = 16;
+
+// The calling thread's edge extractor, which keeps its buffers between images
+inline EdgeExtractor& threadEdgeExtractor()
+{
+    static thread_local EdgeExtractor extractor;
+    return extractor;
+}
+
+/**
+ * Finds the edges of a grayscale image: smooths it and runs the Canny edge
+ * detector, fused into one pass by EdgeExtractor. Edges come out black (0) on a
+ * white (255) background, the way the Hausdorff kernels expect them.
+ *
+ * @param gray the image to find the edges of
+ * @param edges receives the edges; must be the same size as gray
+ * @param points if not null, receives the edge points in raster order, saving
+ *     a pass over the edges
+ * @param pool if not null, the threads to compute on
+ */
+inline void detectEdges(const Image<Intensity>& gray, Image<Intensity>& edges,
+                        EdgePointList* points = 0, WorkStealingPool* pool = 0)
+{
+    threadEdgeExtractor().extract(gray, edges, points, 0, pool);
+}
+
+/**
+ * Finds the edges of a colour image, converting it to grayscale on the way.
+ */
+inline void detectEdges(const Image<Rgb>& image, Image<Intensity>& edges,
+                        EdgePointList* points = 0, WorkStealingPool* pool = 0)
+{
+    threadEdgeExtractor().extract(image, edges, points, 0, pool);
+}
+
+/**
+ * Computes the L1 distance transform of an edge image: the distance from every
+ * pixel to the nearest edge.
+ *
+ * @param edges the edge image, with edges black (0)
+ * @param distanceTransform receives the distance transform; must be the same size as edges
+ * @param pool if not null, the threads to compute on
+ */
+inline void computeDistanceTransform(const Image<Intensity>& edges, Image<Intensity32F>& distanceTransform,
+                                     WorkStealingPool* pool = 0)
+{
+    DistanceTransformOptions options;
+    options.pool = pool;
+    computeSeparableDistanceTransform(edges, distanceTransform, options);
+}
+
+/**
+* Preprocesses the frames of a video, redoing only the parts of each frame that
+* changed since they were last done.
+*
+* The frame is cut into square tiles, and a tile has changed when any of its
+* pixels differs by more than a threshold from the frame its edges were last found
+* in. Comparing with that frame rather than the one before means a fade or slow
+* pan that changes little from frame to frame still redoes a tile once the changes
+* add up, so the results never stray further than the threshold from the frame.
+* The edges of a changed tile are found again from the tile and a margin around
+* it. The distance transform is capped at distanceCap pixels, so a change to the
+* edges can only alter the transform within distanceCap pixels of it; that region
+* is recomputed from the edges within a further distanceCap pixels, which gives
+* exactly the transform of the whole edge image. The edge points are rebuilt from the edge
+* image every frame, which is a single cheap scan.
+*
+* Canny's hysteresis can follow a weak edge any distance, so the edges of a
+* changed tile may differ slightly from those found in the whole frame where a
+* weak edge crosses the margin. When most tiles change, the whole frame is
+* processed instead.
+*
+* Example:
+* @code
+*   FramePreprocessor preprocessor;
+*   while (source.read(frame)) {
+*       preprocessor.update(frame);
+*       search(preprocessor.edgePoints(), preprocessor.distanceTransform());
+*   }
+* @endcode
+*/
+class FramePreprocessor
+{
+public:
+    /**
+     * @param tileSize the width and height of the tiles that are redone as a unit
+     * @param distanceCap the largest distance kept in the distance transform; must
+     *     be above any distance the searches need to tell apart
+     * @param changeThreshold the largest difference in intensity that does not
+     *     count as a change
+     */
+    explicit FramePreprocessor(int tileSize = 64, unsigned distanceCap = 64, int changeThreshold = 8)
+        : tileSize(std::max(1, tileSize)), distanceCap(static_cast<int>(std::max(1u, distanceCap))),
+          changeThreshold(changeThreshold), changedTiles(0), totalTiles(0)
+    {}
+
+    /**
+     * Brings the edges, edge points and distance transform up to date with a new frame.
+     */
+    void update(const Image<Rgb>& frame)
+    {
+        const int width = frame.width();
+        const int height = frame.height();
+        if (!current || current->width() != width || current->height() != height)
+            current.reset(new Image<Intensity>(width, height));
+        Image<Rgb> * src = const_cast<Image<Rgb> *>(&frame);
+        cvCvtColor(*src, *current, CV_BGR2GRAY);
+        const Image<Intensity>& gray = *current;
+        const int tileColumns = (width + tileSize - 1) / tileSize;
+        const int tileRows = (height + tileSize - 1) / tileSize;
+        totalTiles = static_cast<size_t>(tileColumns) * tileRows;
+
+        std::vector<CvRect> changed;
+        if (reference && reference->width() == width && reference->height() == height)
+        {
+            for (int row = 0; row < tileRows; ++row)
+            {
+                for (int column = 0; column < tileColumns; ++column)
+                {
+                    const CvRect tile = cvRect(column * tileSize, row * tileSize,
+                                               std::min(tileSize, width - column * tileSize),
+                                               std::min(tileSize, height - row * tileSize));
+                    if (tileChanged(gray, tile))
+                        changed.push_back(tile);
+                }
+            }
+        }
+        else
+        {
+            edgeImage.reset(new Image<Intensity>(width, height));
+            distances.reset(new Image<Intensity32F>(width, height));
+            changed.assign(totalTiles, cvRect(0, 0, 0, 0));
+        }
+        changedTiles = changed.size();
+
+        if (changed.size() * 2 > totalTiles)
+        {
+            detectEdges(gray, *edgeImage);
+            DistanceTransformOptions options;
+            options.cap = distanceCap;
+            computeSeparableDistanceTransform(*edgeImage, *distances, options);
+
+            // The whole frame becomes the reference, and the old reference's image
+            // is reused for the next frame
+            current.swap(reference);
+        }
+        else if (!changed.empty())
+        {
+            // All the edges must be current before any distances are recomputed from them
+            for (size_t i = 0; i < changed.size(); ++i)
+                updateEdges(gray, inflate(changed[i], EDGE_REACH, width, height));
+            for (size_t i = 0; i < changed.size(); ++i)
+                updateDistances(inflate(changed[i], EDGE_REACH + distanceCap, width, height));
+
+            // Only the tiles redone take this frame as their reference
+            for (size_t i = 0; i < changed.size(); ++i)
+                copyRegion(gray, changed[i], *reference, cvPoint(changed[i].x, changed[i].y));
+        }
+
+        points.assign(*edgeImage);
+        reorderEdgePoints(points, EDGE_ORDER_RANDOM);
+    }
+
+    // The results for the latest frame
+    const Image<Intensity>& edges() const
+    {
+        return *edgeImage;
+    }
+    const EdgePointList& edgePoints() const
+    {
+        return points;
+    }
+    const Image<Intensity32F>& distanceTransform() const
+    {
+        return *distances;
+    }
+
+    // The number of tiles redone for the latest frame, and of tiles in it
+    size_t tilesChanged() const
+    {
+        return changedTiles;
+    }
+    size_t tileCount() const
+    {
+        return totalTiles;
+    }
+
+private:
+    enum
+    {
+        // How far a change of intensity can move an edge (smoothing, gradient and
+        // non-maximum suppression each reach a pixel)
+        EDGE_REACH = 4
+    };
+
+    // Grows rect by margin on every side, clipped to the frame
+    static CvRect inflate(const CvRect& rect, int margin, int width, int height)
+    {
+        const int left = std::max(0, rect.x - margin);
+        const int top = std::max(0, rect.y - margin);
+        const int right = std::min(width, rect.x + rect.width + margin);
+        const int bottom = std::min(height, rect.y + rect.height + margin);
+        return cvRect(left, top, right - left, bottom - top);
+    }
+
+    // Copies the region of source at from to the region of destination at to
+    template <typename T>
+    static void copyRegion(const Image<T>& source, const CvRect& from, Image<T>& destination, const CvPoint& to)
+    {
+        Image<T> * src = const_cast<Image<T> *>(&source);
+        cvSetImageROI(*src, from);
+        cvSetImageROI(destination, cvRect(to.x, to.y, from.width, from.height));
+        cvCopy(*src, destination);
+        cvResetImageROI(destination);
+        cvResetImageROI(*src);
+    }
+
+    bool tileChanged(const Image<Intensity>& gray, const CvRect& tile) const
+    {
+        for (int y = tile.y; y < tile.y + tile.height; ++y)
+        {
+            const Intensity* const current = gray[y];
+            const Intensity* const before = (*reference)[y];
+            for (int x = tile.x; x < tile.x + tile.width; ++x)
+            {
+                if (abs(current[x] - before[x]) > changeThreshold)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Finds the edges of region again, looking at a margin around it
+    void updateEdges(const Image<Intensity>& gray, const CvRect& region)
+    {
+        const CvRect source = inflate(region, EDGE_CONTEXT_MARGIN, gray.width(), gray.height());
+        const Image<Intensity> sourceGray(const_cast<Image<Intensity>&>(gray).view().region(source));
+        ScratchImage<Intensity> sourceEdges(source.width, source.height);
+        detectEdges(sourceGray, *sourceEdges);
+        copyRegion(*sourceEdges,
+                   cvRect(region.x - source.x, region.y - source.y, region.width, region.height),
+                   *edgeImage, cvPoint(region.x, region.y));
+    }
+
+    // Recomputes the distances of region, which only depend on the edges within distanceCap of it
+    void updateDistances(const CvRect& region)
+    {
+        DistanceTransformOptions options;
+        options.cap = distanceCap;
+        options.roi = region;
+        computeSeparableDistanceTransform(*edgeImage, *distances, options);
+    }
+
+    const int tileSize;
+    const int distanceCap;
+    const int changeThreshold;
+
+    // The grayscale latest frame, and the frame each tile's edges were found in
+    std::unique_ptr<Image<Intensity> > current;
+    std::unique_ptr<Image<Intensity> > reference;
+    std::unique_ptr<Image<Intensity> > edgeImage;
+    std::unique_ptr<Image<Intensity32F> > distances;
+    EdgePointList points;
+
+    size_t changedTiles;
+    size_t totalTiles;
+};
+
+#endif
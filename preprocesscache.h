@@ -0,0 +1,392 @@
+/**
+ * @file preprocesscache.h Provides an on-disk cache of preprocessed images that is
+ * memory-mapped back in, so images that are searched again and again are only
+ * decoded and preprocessed once.
+ */
+
+#ifndef PREPROCESSCACHE_H
+#define PREPROCESSCACHE_H
+
+// Standard library
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "mappedfile.h"
+#include "bitplane.h"
+#include "preprocess.h"
+#include "distancetransform.h"
+#include "templatebank.h"
+
+// The version of the cache format, which is part of every cache key
+static const int PREPROCESSING_CACHE_VERSION = 1;
+
+/**
+ * The settings that decide what preprocessing makes of an image. They are part of
+ * the cache key, so changing any of them misses the cache rather than returning
+ * data preprocessed differently.
+ */
+struct PreprocessingParameters
+{
+    explicit PreprocessingParameters(EdgePointOrder pointOrder = EDGE_ORDER_RANDOM)
+        : cannyLowThreshold(CANNY_LOW_THRESHOLD), cannyHighThreshold(CANNY_HIGH_THRESHOLD),
+          distanceMetric(DISTANCE_L1), pointOrder(pointOrder)
+    {}
+
+    // The thresholds detectEdges() used
+    double cannyLowThreshold;
+    double cannyHighThreshold;
+
+    // The metric of the distance transform
+    DistanceMetric distanceMetric;
+
+    // The order the edge points were put in: EDGE_ORDER_DISCRIMINATIVE for a
+    // needle, EDGE_ORDER_RANDOM for a haystack
+    EdgePointOrder pointOrder;
+};
+
+/**
+* The edge points, packed edges and distance transform of one image, as the searches
+* read them, with a binary file format to keep them in.
+*
+* A PreprocessedImage is filled in with assign() from freshly preprocessed data, or
+* with load() from a file written by save(). load() memory-maps the file and points
+* the edge point list, bitplane and distance transform at the mapped arrays. Apart
+* from the edge points, which it checks lie inside the image, it reads nothing, so
+* it stays cheap however large the image is; other pages are only read as the
+* search touches them. Everything returned refers to the file's mapping, which
+* lives as long as the PreprocessedImage or any copy of it.
+*
+* Files are keyed by preprocessingCacheKey(): a hash of the image file's bytes and of
+* the PreprocessingParameters. As with TemplateBank files, the format is
+* native-endian and versioned, and load() rejects files from a machine of the
+* other byte order or another version of the format.
+*
+* Example:
+* @code
+*   const PreprocessingParameters parameters(EDGE_ORDER_RANDOM);
+*   const uint64_t key = preprocessingCacheKey("haystack.png", parameters);
+*   const std::string cacheFile = preprocessingCacheFilename("cache", key);
+*   PreprocessedImage haystack;
+*   if (!haystack.tryLoad(cacheFile) || !haystack.matches(key, parameters)) {
+*       // ... detect the edges, find the edge points and distance transform ...
+*       haystack.assign(key, parameters, edges, points, distanceTransform);
+*       haystack.save(cacheFile);
+*   }
+*   SearchContext context(needlePoints, needleDistanceTransform,
+*                         haystack.points(), haystack.distanceTransform());
+* @endcode
+*/
+class PreprocessedImage
+{
+public:
+    PreprocessedImage()
+        : cacheKey(0), imageWidth(0), imageHeight(0),
+          transform(static_cast<IplImage*>(0))
+    {}
+
+    /**
+     * Takes preprocessed data, sharing the distance transform and copying the rest.
+     *
+     * @param key the cache key of the image
+     * @param parameters how the data was preprocessed
+     * @param edges the image's edges
+     * @param points the edge points of edges, in parameters.pointOrder
+     * @param distanceTransform the distance transform of edges
+     */
+    void assign(uint64_t key, const PreprocessingParameters& parameters,
+                const Image<Intensity>& edges, const EdgePointList& points,
+                const Image<Intensity32F>& distanceTransform)
+    {
+        cacheKey = key;
+        preprocessing = parameters;
+        imageWidth = edges.width();
+        imageHeight = edges.height();
+        edgePoints = points;
+        edgePlane = Bitplane(edges);
+        transform = distanceTransform;
+        mapping.reset();
+    }
+
+    /**
+     * Writes the data to a file that load() can read. The file is written under a
+     * temporary name of its own and then renamed over filename, so other threads
+     * and processes never map half a file, even while they save the same file.
+     *
+     * @throws std::runtime_error if the file can't be written
+     */
+    void save(const std::string& filename) const;
+
+    /**
+     * Replaces the data with a file written by save(), mapping the file into
+     * memory rather than reading it.
+     *
+     * @throws std::runtime_error if the file can't be mapped or is not valid
+     */
+    void load(const std::string& filename);
+
+    /**
+     * Like load(), but returns false instead of throwing if the file is missing or
+     * invalid, leaving the data unchanged.
+     */
+    bool tryLoad(const std::string& filename)
+    {
+        try
+        {
+            load(filename);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
+    // Checks whether the data is for this key and was preprocessed this way
+    bool matches(uint64_t key, const PreprocessingParameters& parameters) const
+    {
+        return key == cacheKey && parameters.cannyLowThreshold == preprocessing.cannyLowThreshold &&
+               parameters.cannyHighThreshold == preprocessing.cannyHighThreshold &&
+               parameters.distanceMetric == preprocessing.distanceMetric &&
+               parameters.pointOrder == preprocessing.pointOrder;
+    }
+
+    // Dimensions of the image
+    int width() const
+    {
+        return imageWidth;
+    }
+    int height() const
+    {
+        return imageHeight;
+    }
+
+    // The preprocessed data
+    const EdgePointList& points() const
+    {
+        return edgePoints;
+    }
+    const Bitplane& edges() const
+    {
+        return edgePlane;
+    }
+    const Image<Intensity32F>& distanceTransform() const
+    {
+        return transform;
+    }
+
+private:
+
+    // Layout of a file: a header, then the x and y coordinates of the edge points,
+    // the bitplane's words and the distance transform's rows, each array starting
+    // on a 64-byte boundary.
+    enum
+    {
+        FILE_VERSION = PREPROCESSING_CACHE_VERSION,
+        BYTE_ORDER_MARK = 0x01020304,
+        ARRAY_ALIGNMENT = 64
+    };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t key;
+        double cannyLowThreshold;
+        double cannyHighThreshold;
+        int32_t distanceMetric;
+        int32_t pointOrder;
+        int32_t width;
+        int32_t height;
+        uint64_t pointCount;
+        uint64_t pointsOffset;
+        uint64_t bitplaneOffset;
+        uint32_t bitplaneRowWords;
+        uint32_t distanceStep;
+        uint64_t distanceOffset;
+    };
+
+    static const char* fileMagic()
+    {
+        return "HIFPREP";
+    }
+
+    static uint64_t alignOffset(uint64_t offset)
+    {
+        return (offset + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+    }
+
+    uint64_t cacheKey;
+    PreprocessingParameters preprocessing;
+    int imageWidth;
+    int imageHeight;
+    EdgePointList edgePoints;
+    Bitplane edgePlane;
+    Image<Intensity32F> transform;
+
+    // The file the data lives in, if it was loaded
+    std::shared_ptr<MappedFile> mapping;
+};
+
+inline void PreprocessedImage::save(const std::string& filename) const
+{
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, fileMagic(), sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.key = cacheKey;
+    header.cannyLowThreshold = preprocessing.cannyLowThreshold;
+    header.cannyHighThreshold = preprocessing.cannyHighThreshold;
+    header.distanceMetric = preprocessing.distanceMetric;
+    header.pointOrder = preprocessing.pointOrder;
+    header.width = imageWidth;
+    header.height = imageHeight;
+    header.pointCount = edgePoints.size();
+    header.bitplaneRowWords = static_cast<uint32_t>(edgePlane.rowWords());
+    header.distanceStep = static_cast<uint32_t>(alignOffset(imageWidth * sizeof(Intensity32F)));
+
+    const uint64_t pointsSize = 2 * header.pointCount * sizeof(int32_t);
+    const uint64_t bitplaneSize = static_cast<uint64_t>(header.bitplaneRowWords) * imageHeight * sizeof(uint64_t);
+    header.pointsOffset = alignOffset(sizeof(FileHeader));
+    header.bitplaneOffset = alignOffset(header.pointsOffset + pointsSize);
+    header.distanceOffset = alignOffset(header.bitplaneOffset + bitplaneSize);
+
+    const std::string temporary = temporaryFilename(filename);
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file)
+            throw std::runtime_error("Failed to create " + temporary + ".");
+
+        const std::vector<char> padding(std::max<size_t>(ARRAY_ALIGNMENT, imageWidth * sizeof(Intensity32F)), 0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        file.write(&padding[0], static_cast<std::streamsize>(header.pointsOffset - sizeof(header)));
+        if (header.pointCount > 0)
+        {
+            file.write(reinterpret_cast<const char*>(edgePoints.xs()), header.pointCount * sizeof(int32_t));
+            file.write(reinterpret_cast<const char*>(edgePoints.ys()), header.pointCount * sizeof(int32_t));
+        }
+
+        file.write(&padding[0], static_cast<std::streamsize>(header.bitplaneOffset - header.pointsOffset - pointsSize));
+        for (int y = 0; y < imageHeight; ++y)
+            file.write(reinterpret_cast<const char*>(edgePlane.row(y)), header.bitplaneRowWords * sizeof(uint64_t));
+
+        file.write(&padding[0], static_cast<std::streamsize>(header.distanceOffset - header.bitplaneOffset - bitplaneSize));
+        for (int y = 0; y < imageHeight; ++y)
+        {
+            file.write(reinterpret_cast<const char*>(transform[y]), imageWidth * sizeof(Intensity32F));
+            file.write(&padding[0], static_cast<std::streamsize>(header.distanceStep - imageWidth * sizeof(Intensity32F)));
+        }
+
+        if (!file)
+            throw std::runtime_error("Failed to write " + temporary + ".");
+    }
+
+    // A writer that saved the same file meanwhile wrote the same data
+    replaceFile(temporary, filename);
+}
+
+inline void PreprocessedImage::load(const std::string& filename)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile(filename));
+    unsigned char* const bytes = file->data();
+    const uint64_t fileSize = file->size();
+
+    FileHeader header;
+    if (fileSize < sizeof(header))
+        throw std::runtime_error(filename + " is not a preprocessed image.");
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::strncmp(header.magic, fileMagic(), sizeof(header.magic)) != 0)
+        throw std::runtime_error(filename + " is not a preprocessed image.");
+    if (header.version != FILE_VERSION || header.byteOrder != BYTE_ORDER_MARK)
+        throw std::runtime_error(filename + " was written by an incompatible version or machine.");
+
+    // Arrays must lie inside the file and be aligned for in-place use
+    if (header.pointCount > fileSize / (2 * sizeof(int32_t)))
+        throw std::runtime_error(filename + " is truncated or corrupt.");
+    const uint64_t pointsSize = 2 * header.pointCount * sizeof(int32_t);
+    const uint64_t bitplaneSize = static_cast<uint64_t>(header.bitplaneRowWords) * header.height * sizeof(uint64_t);
+    const uint64_t distanceSize = static_cast<uint64_t>(header.distanceStep) * header.height;
+    if (header.width <= 0 || header.height <= 0 ||
+            header.pointsOffset % ARRAY_ALIGNMENT != 0 || header.bitplaneOffset % ARRAY_ALIGNMENT != 0 ||
+            header.distanceOffset % ARRAY_ALIGNMENT != 0 ||
+            header.pointsOffset + pointsSize > fileSize || header.bitplaneOffset + bitplaneSize > fileSize ||
+            header.distanceOffset + distanceSize > fileSize ||
+            header.bitplaneRowWords < static_cast<uint32_t>((header.width + 63) / 64 + 1) ||
+            header.distanceStep < header.width * sizeof(Intensity32F) ||
+            header.distanceStep % sizeof(Intensity32F) != 0)
+        throw std::runtime_error(filename + " is truncated or corrupt.");
+
+    // The searches index by the edge points, so a point outside the image, from a
+    // corrupt or stale file, would have them read and write out of bounds
+    const int* const xs = reinterpret_cast<const int*>(bytes + header.pointsOffset);
+    const int* const ys = xs + header.pointCount;
+    for (uint64_t i = 0; i < header.pointCount; ++i)
+    {
+        if (xs[i] < 0 || xs[i] >= header.width || ys[i] < 0 || ys[i] >= header.height)
+            throw std::runtime_error(filename + " is truncated or corrupt.");
+    }
+
+    cacheKey = header.key;
+    preprocessing.cannyLowThreshold = header.cannyLowThreshold;
+    preprocessing.cannyHighThreshold = header.cannyHighThreshold;
+    preprocessing.distanceMetric = static_cast<DistanceMetric>(header.distanceMetric);
+    preprocessing.pointOrder = static_cast<EdgePointOrder>(header.pointOrder);
+    imageWidth = header.width;
+    imageHeight = header.height;
+
+    edgePoints.attach(xs, ys, static_cast<size_t>(header.pointCount), imageWidth, imageHeight);
+    edgePlane.attach(reinterpret_cast<uint64_t*>(bytes + header.bitplaneOffset), imageWidth, imageHeight,
+                     static_cast<int>(header.bitplaneRowWords));
+
+    // View the mapped distance transform in place, as TemplateBank::load() does
+    transform = Image<Intensity32F>(ImageView<Intensity32F>(
+                                        reinterpret_cast<Intensity32F*>(bytes + header.distanceOffset),
+                                        imageWidth, imageHeight, header.distanceStep));
+
+    mapping = file;
+}
+
+/**
+ * Finds the cache key of an image file preprocessed in a particular way: a hash of
+ * the file's bytes, the parameters and the cache format. Only the file is read,
+ * not decoded, so the key is cheap compared to preprocessing.
+ *
+ * @throws std::runtime_error if the file can't be read
+ */
+inline uint64_t preprocessingCacheKey(const std::string& imageFilename, const PreprocessingParameters& parameters)
+{
+    const MappedFile file(imageFilename);
+    uint64_t key = hashBytes(file.data(), file.size());
+
+    const int32_t settings[3] = { PREPROCESSING_CACHE_VERSION, parameters.distanceMetric, parameters.pointOrder };
+    const double thresholds[2] = { parameters.cannyLowThreshold, parameters.cannyHighThreshold };
+    key = hashBytes(settings, sizeof(settings), key);
+    return hashBytes(thresholds, sizeof(thresholds), key);
+}
+
+/**
+ * The name of the file in a cache directory that holds the image with a key.
+ */
+inline std::string preprocessingCacheFilename(const std::string& directory, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.hifprep", static_cast<unsigned long long>(key));
+    return directory.empty() ? std::string(name) : directory + "/" + name;
+}
+
+#endif
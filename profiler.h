@@ -0,0 +1,398 @@
+/**
+ * @file profiler.h Provides built-in instrumentation of the preprocessing stages and
+ * searches: wall-clock time per stage and counters of the search's work, collected
+ * per thread and exported as JSON or Chrome trace events.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Standard library
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdint.h>
+
+/**
+ * The stages whose time is measured.
+ */
+enum ProfileStage
+{
+    PROFILE_DECODE,                 // Loading and decoding image files
+    PROFILE_EDGE_DETECTION,         // Grayscale conversion, smoothing and Canny edge detection
+    PROFILE_DISTANCE_TRANSFORM,     // Distance transforms
+    PROFILE_POSE_WARP,              // Warping the needle to a rotation and scale
+    PROFILE_TRANSLATION_SEARCH,     // Searches over translations
+    PROFILE_STAGE_COUNT
+};
+
+/**
+ * The counters of a search's work.
+ */
+enum ProfileCounter
+{
+    PROFILE_OFFSETS_EVALUATED,      // Translations whose distance was computed
+    PROFILE_POINTS_CONSIDERED,      // Edge points looked up by those computations
+    PROFILE_EARLY_REJECTIONS,       // Computations that stopped once the distance exceeded the threshold
+    PROFILE_CELLS_PRUNED,           // Cells or blocks of translations discarded by a bound
+    PROFILE_COUNTER_COUNT
+};
+
+// The names of stages and counters in exported profiles
+inline const char* profileStageName(ProfileStage stage)
+{
+    static const char* const names[PROFILE_STAGE_COUNT] =
+    {
+        "decode", "edge_detection", "distance_transform", "pose_warp", "translation_search"
+    };
+    return names[stage];
+}
+inline const char* profileCounterName(ProfileCounter counter)
+{
+    static const char* const names[PROFILE_COUNTER_COUNT] =
+    {
+        "offsets_evaluated", "points_considered", "early_rejections", "cells_pruned"
+    };
+    return names[counter];
+}
+
+/**
+ * Time per stage and counters, of one thread or merged over all of them.
+ */
+struct ProfileTotals
+{
+    ProfileTotals()
+    {
+        for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+        {
+            seconds[i] = 0;
+            calls[i] = 0;
+        }
+        for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+            counters[i] = 0;
+    }
+
+    // Adds another set of totals to these
+    void merge(const ProfileTotals& other)
+    {
+        for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+        {
+            seconds[i] += other.seconds[i];
+            calls[i] += other.calls[i];
+        }
+        for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+            counters[i] += other.counters[i];
+    }
+
+    // Wall-clock seconds spent in each stage, summed over threads, and the number of times it ran
+    double seconds[PROFILE_STAGE_COUNT];
+    uint64_t calls[PROFILE_STAGE_COUNT];
+
+    uint64_t counters[PROFILE_COUNTER_COUNT];
+};
+
+/**
+* Collects the time spent in each stage and the search counters of every thread
+* while it is the active profiler.
+*
+* Each thread that reports to the profiler gets an accumulator of its own, so
+* instrumentation only takes a lock the first time a thread reports; the
+* accumulators are merged when the profile is read.
+* Stage times come from a monotonic clock. A stage entered again while it is
+* already running on the same thread (e.g. a translation search run by a pose
+* search) is counted once, by the outermost scope, so stage times are never
+* counted twice on one thread. Times on different threads add up, so a parallel
+* stage can report more seconds than elapsed.
+*
+* With tracing on, every outermost stage scope is also recorded as an event, up to
+* a limit per thread, for viewing in chrome://tracing or Perfetto.
+*
+* When no profiler is active, instrumentation costs a load of one atomic pointer.
+* A profiler must stay active, and alive, until the work it profiles has finished,
+* and is read once that work is done.
+*
+* Example:
+* @code
+*   Profiler profiler(true);
+*   profiler.start();
+*   runSearch();
+*   profiler.stop();
+*   profiler.writeJson(std::cout);
+*   std::ofstream trace("trace.json");
+*   profiler.writeChromeTrace(trace);
+* @endcode
+*/
+class Profiler
+{
+public:
+    /**
+     * @param recordTrace whether to record trace events as well as totals
+     * @param maxTraceEvents the most trace events kept per thread; later ones are dropped
+     */
+    explicit Profiler(bool recordTrace = false, size_t maxTraceEvents = 1 << 20)
+        : recordTrace(recordTrace), maxTraceEvents(maxTraceEvents),
+          profilerId(++ profilerCount()), origin(std::chrono::steady_clock::now())
+    {}
+
+    ~Profiler()
+    {
+        stop();
+    }
+
+    // Makes this the profiler that instrumentation reports to, replacing any other
+    void start()
+    {
+        activeProfiler().store(this, std::memory_order_release);
+    }
+
+    // Stops instrumentation reporting to this profiler, if it is the active one
+    void stop()
+    {
+        Profiler* self = this;
+        activeProfiler().compare_exchange_strong(self, 0, std::memory_order_acq_rel);
+    }
+
+    // The profiler that instrumentation reports to, or null
+    static Profiler* active()
+    {
+        return activeProfiler().load(std::memory_order_acquire);
+    }
+
+    // The totals of all threads
+    ProfileTotals totals() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ProfileTotals merged;
+        for (size_t i = 0; i < threads.size(); ++i)
+            merged.merge(threads[i]->totals);
+        return merged;
+    }
+
+    // The number of threads that reported to the profiler
+    size_t threadCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return threads.size();
+    }
+
+    /**
+     * Writes the merged totals as a JSON object:
+     * {"threads": n, "stages": {"decode": {"seconds": s, "calls": c}, ...},
+     *  "counters": {"offsets_evaluated": n, ...}}
+     */
+    void writeJson(std::ostream& out) const;
+
+    /**
+     * Writes the trace events in the Chrome trace event format, with one track per
+     * thread and the final counters as counter events.
+     */
+    void writeChromeTrace(std::ostream& out) const;
+
+    /**
+     * One thread's accumulator. Only the thread that owns it writes to it.
+     */
+    struct ThreadProfile
+    {
+        explicit ThreadProfile(unsigned threadNumber)
+            : threadNumber(threadNumber)
+        {
+            for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+                depth[i] = 0;
+        }
+
+        struct TraceEvent
+        {
+            ProfileStage stage;
+            int64_t startMicroseconds;
+            int64_t durationMicroseconds;
+        };
+
+        ProfileTotals totals;
+        std::vector<TraceEvent> events;
+
+        // How many scopes of each stage are open on the thread
+        int depth[PROFILE_STAGE_COUNT];
+
+        unsigned threadNumber;
+    };
+
+    // The current thread's accumulator, registering the thread on first use
+    ThreadProfile& threadProfile()
+    {
+        ThreadCache& cache = threadCache();
+        if (cache.profilerId != profilerId)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::unique_ptr<ThreadProfile>(
+                                  new ThreadProfile(static_cast<unsigned>(threads.size()))));
+            cache.profilerId = profilerId;
+            cache.profile = threads.back().get();
+        }
+        return *cache.profile;
+    }
+
+    // Counts one distance computation that looked up points edge points and was
+    // rejected early or not
+    void countDistance(uint64_t points, bool rejected)
+    {
+        ProfileTotals& totals = threadProfile().totals;
+        ++ totals.counters[PROFILE_OFFSETS_EVALUATED];
+        totals.counters[PROFILE_POINTS_CONSIDERED] += points;
+        if (rejected)
+            ++ totals.counters[PROFILE_EARLY_REJECTIONS];
+    }
+
+    // Records the end of an outermost stage scope that started at start
+    void recordStage(ThreadProfile& profile, ProfileStage stage, const std::chrono::steady_clock::time_point& start)
+    {
+        const std::chrono::steady_clock::time_point finish = std::chrono::steady_clock::now();
+        profile.totals.seconds[stage] += std::chrono::duration<double>(finish - start).count();
+        ++ profile.totals.calls[stage];
+        if (recordTrace && profile.events.size() < maxTraceEvents)
+        {
+            ThreadProfile::TraceEvent event;
+            event.stage = stage;
+            event.startMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(start - origin).count();
+            event.durationMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count();
+            profile.events.push_back(event);
+        }
+    }
+
+private:
+    Profiler(const Profiler&);
+    Profiler& operator= (const Profiler&);
+
+    // The profiler the current thread last reported to, by id rather than address,
+    // since a new profiler may reuse the address of a destroyed one
+    struct ThreadCache
+    {
+        uint64_t profilerId;
+        ThreadProfile* profile;
+    };
+    static ThreadCache& threadCache()
+    {
+        static thread_local ThreadCache cache = { 0, 0 };
+        return cache;
+    }
+    static std::atomic<Profiler*>& activeProfiler()
+    {
+        static std::atomic<Profiler*> profiler(0);
+        return profiler;
+    }
+    static std::atomic<uint64_t>& profilerCount()
+    {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    const bool recordTrace;
+    const size_t maxTraceEvents;
+    const uint64_t profilerId;
+    const std::chrono::steady_clock::time_point origin;
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadProfile> > threads;
+};
+
+inline void Profiler::writeJson(std::ostream& out) const
+{
+    const ProfileTotals merged = totals();
+    out << "{\"threads\": " << threadCount() << ", \"stages\": {";
+    for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+    {
+        out << (i ? ", " : "") << "\"" << profileStageName(static_cast<ProfileStage>(i))
+            << "\": {\"seconds\": " << merged.seconds[i] << ", \"calls\": " << merged.calls[i] << "}";
+    }
+    out << "}, \"counters\": {";
+    for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+        out << (i ? ", " : "") << "\"" << profileCounterName(static_cast<ProfileCounter>(i)) << "\": " << merged.counters[i];
+    out << "}}\n";
+}
+
+inline void Profiler::writeChromeTrace(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "{\"traceEvents\": [\n";
+    int64_t end = 0;
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        const ThreadProfile& profile = *threads[i];
+        for (size_t j = 0; j < profile.events.size(); ++j)
+        {
+            const ThreadProfile::TraceEvent& event = profile.events[j];
+            out << "  {\"name\": \"" << profileStageName(event.stage) << "\", \"cat\": \"stage\", \"ph\": \"X\""
+                << ", \"ts\": " << event.startMicroseconds << ", \"dur\": " << event.durationMicroseconds
+                << ", \"pid\": 1, \"tid\": " << profile.threadNumber << "},\n";
+            end = std::max(end, event.startMicroseconds + event.durationMicroseconds);
+        }
+    }
+
+    ProfileTotals merged;
+    for (size_t i = 0; i < threads.size(); ++i)
+        merged.merge(threads[i]->totals);
+    for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+    {
+        const char* const name = profileCounterName(static_cast<ProfileCounter>(i));
+        out << "  {\"name\": \"" << name << "\", \"ph\": \"C\", \"ts\": " << end << ", \"pid\": 1"
+            << ", \"args\": {\"" << name << "\": " << merged.counters[i] << "}}"
+            << (i + 1 < PROFILE_COUNTER_COUNT ? "," : "") << "\n";
+    }
+    out << "]}\n";
+}
+
+/**
+ * Adds to a counter of the active profiler, if there is one.
+ */
+inline void profileCount(ProfileCounter counter, uint64_t amount = 1)
+{
+    if (Profiler* profiler = Profiler::active())
+        profiler->threadProfile().totals.counters[counter] += amount;
+}
+
+/**
+* Times a stage for the active profiler, if there is one, from construction to
+* destruction.
+*
+* Example:
+* @code
+*   {
+*       ProfileScope scope(PROFILE_DISTANCE_TRANSFORM);
+*       computeSeparableDistanceTransform(edges, distanceTransform);
+*   }
+* @endcode
+*/
+class ProfileScope
+{
+public:
+    explicit ProfileScope(ProfileStage stage)
+        : profiler(Profiler::active()), profile(0), stage(stage)
+    {
+        if (profiler)
+        {
+            profile = &profiler->threadProfile();
+            if (profile->depth[stage]++ == 0)
+                start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ProfileScope()
+    {
+        if (profile && --profile->depth[stage] == 0)
+            profiler->recordStage(*profile, stage, start);
+    }
+
+private:
+    ProfileScope(const ProfileScope&);
+    ProfileScope& operator= (const ProfileScope&);
+
+    Profiler* const profiler;
+    Profiler::ThreadProfile* profile;
+    const ProfileStage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
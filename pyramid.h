@@ -0,0 +1,374 @@
+/**
+ * @file pyramid.h Provides an exact translation search that starts on downsampled
+ * edge maps and distance transforms and only refines the blocks of translations
+ * that can still win.
+ */
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+
+// Search algorithms
+#include "search.h"
+#include "hausdorff.h"
+
+/**
+ * Halves an image, setting each pixel of coarser to the smallest of the 2 x 2
+ * pixels of finer that it covers.
+ */
+template <typename T>
+void halveByMinimum(const Image<T>& finer, Image<T>& coarser)
+{
+    for (int y = 0; y < coarser.height(); ++y)
+    {
+        const T* const top = finer[2 * y];
+        const T* const bottom = finer[std::min(2 * y + 1, finer.height() - 1)];
+        T* const row = coarser[y];
+        for (int x = 0; x < coarser.width(); ++x)
+        {
+            const int right = std::min(2 * x + 1, finer.width() - 1);
+            row[x] = std::min(std::min(top[2 * x], top[right]), std::min(bottom[2 * x], bottom[right]));
+        }
+    }
+}
+
+/**
+* Successively halved copies of an edge image, with their edge points.
+*
+* Pixel (x, y) of level k is an edge if any pixel of the 2^k x 2^k block at
+* (2^k x, 2^k y) of the original is, so the edge points of level k are exactly
+* the original edge points divided by 2^k (rounding down), without duplicates.
+* Level 0 is the original.
+*/
+class EdgePyramid
+{
+public:
+    /**
+     * @param edges the edge image, with edges black (0)
+     * @param levels the number of levels, including the original
+     */
+    EdgePyramid(const Image<Intensity>& edges, int levels)
+    {
+        for (int level = 0; level < std::max(1, levels); ++level)
+        {
+            Level* const current = new Level;
+            levelData.push_back(std::unique_ptr<Level>(current));
+            if (level == 0)
+            {
+                current->edges.reset(new Image<Intensity>(edges.width(), edges.height()));
+                Image<Intensity> * src = const_cast<Image<Intensity> *>(&edges);
+                cvCopy(*src, *current->edges);
+            }
+            else
+            {
+                const Image<Intensity>& finer = *levelData[level - 1]->edges;
+                current->edges.reset(new Image<Intensity>((finer.width() + 1) / 2, (finer.height() + 1) / 2));
+                halveByMinimum(finer, *current->edges);
+            }
+
+            current->points.assign(*current->edges);
+            reorderEdgePoints(current->points, EDGE_ORDER_DISCRIMINATIVE);
+        }
+    }
+
+    // The number of levels
+    int levels() const
+    {
+        return static_cast<int>(levelData.size());
+    }
+
+    // The edges and edge points of a level
+    const Image<Intensity>& edges(int level) const
+    {
+        return *levelData[level]->edges;
+    }
+    const EdgePointList& points(int level) const
+    {
+        return levelData[level]->points;
+    }
+
+private:
+    EdgePyramid(const EdgePyramid&);
+    EdgePyramid& operator= (const EdgePyramid&);
+
+    struct Level
+    {
+        std::unique_ptr<Image<Intensity> > edges;
+        EdgePointList points;
+    };
+
+    std::vector<std::unique_ptr<Level> > levelData;
+};
+
+/**
+* Successively halved copies of a distance transform that bound the distances of
+* the original from below.
+*
+* Pixel (x, y) of level k holds the smallest distance of the original within the
+* 2^(k+1) x 2^(k+1) pixels at (2^k x, 2^k y): the block that pixel (x, y) of an
+* EdgePyramid's level k stands for, and the blocks to its right, below and below
+* right. A needle point that rounds to (x, y) on level k, translated by anything
+* up to 2^k - 1 along each axis, lands in that area, so the value is a lower bound
+* on its distance at every one of those translations.
+*/
+class DistancePyramid
+{
+public:
+    /**
+     * @param distanceTransform the distance transform of the haystack
+     * @param levels the number of levels, including the original
+     */
+    DistancePyramid(const Image<Intensity32F>& distanceTransform, int levels)
+    {
+        // Minimums of the 2^k x 2^k blocks, level by level
+        std::vector<std::unique_ptr<Image<Intensity32F> > > blocks;
+        for (int level = 1; level < std::max(1, levels); ++level)
+        {
+            const Image<Intensity32F>& finer = level == 1 ? distanceTransform : *blocks.back();
+            blocks.push_back(std::unique_ptr<Image<Intensity32F> >(
+                                 new Image<Intensity32F>((finer.width() + 1) / 2, (finer.height() + 1) / 2)));
+            halveByMinimum(finer, *blocks.back());
+
+            // Widen each block to the neighbours that a translation can reach
+            const Image<Intensity32F>& block = *blocks.back();
+            levelData.push_back(std::unique_ptr<Image<Intensity32F> >(
+                                    new Image<Intensity32F>(block.width(), block.height())));
+            Image<Intensity32F>& bound = *levelData.back();
+            for (int y = 0; y < block.height(); ++y)
+            {
+                const Intensity32F* const row = block[y];
+                const Intensity32F* const below = block[std::min(y + 1, block.height() - 1)];
+                Intensity32F* const boundRow = bound[y];
+                for (int x = 0; x < block.width(); ++x)
+                {
+                    const int right = std::min(x + 1, block.width() - 1);
+                    boundRow[x] = std::min(std::min(row[x], row[right]), std::min(below[x], below[right]));
+                }
+            }
+        }
+    }
+
+    // The number of levels, including the original, which is not stored
+    int levels() const
+    {
+        return static_cast<int>(levelData.size()) + 1;
+    }
+
+    // The lower bounds of a level above 0
+    const Image<Intensity32F>& bounds(int level) const
+    {
+        return *levelData[level - 1];
+    }
+
+private:
+    DistancePyramid(const DistancePyramid&);
+    DistancePyramid& operator= (const DistancePyramid&);
+
+    std::vector<std::unique_ptr<Image<Intensity32F> > > levelData;
+};
+
+/**
+ * Counters describing the work done by findBestTranslationPyramid().
+ */
+struct PyramidSearchStats
+{
+    PyramidSearchStats()
+        : blocksEvaluated(0), blocksPruned(0), translationsEvaluated(0)
+    {}
+
+    // Blocks of translations bounded on a downsampled level
+    unsigned long blocksEvaluated;
+
+    // Blocks discarded without looking at their translations
+    unsigned long blocksPruned;
+
+    // Translations whose distance was computed at full resolution
+    unsigned long translationsEvaluated;
+};
+
+/**
+ * A block of translations waiting to be refined: the 2^level x 2^level translations
+ * from 2^level times origin, whose distances are all at least bound.
+ */
+struct PyramidBlock
+{
+    PyramidBlock(int level, const CvPoint& origin, double bound)
+        : level(level), origin(origin), bound(bound)
+    {}
+
+    // Orders a priority queue to give the smallest bound first, and then the finest block
+    bool operator< (const PyramidBlock& rhs) const
+    {
+        if (bound != rhs.bound)
+            return bound > rhs.bound;
+        return level > rhs.level;
+    }
+
+    int level;
+    CvPoint origin;
+    double bound;
+};
+
+/**
+ * Finds a lower bound on the directed Hausdorff distance from the needle to the
+ * haystack at every translation of a block: the translations (s u.x + r.x,
+ * s u.y + r.y), 0 <= r < s, with s = 2^level, that level's translation u stands for.
+ * See DistancePyramid for why this bounds every needle point, and so their maximum.
+ *
+ * @param threshold bounds above threshold need not be exact, only above threshold
+ * @return the lower bound, or -infinity if the level has no needle points
+ */
+inline double boundTranslationBlock(
+    const EdgePyramid& needle, const DistancePyramid& haystack,
+    int level, const CvPoint& block, double threshold)
+{
+    const double distance = findHausdorffDistanceBounded(
+                                needle.points(level), haystack.bounds(level), block, threshold);
+    return distance == MAX_HAUSDORFF_DISTANCE ? -std::numeric_limits<double>::max() : distance;
+}
+
+/*
+ * Finds the translation of needle in haystack that results in the minimal Hausdorff distance,
+ * starting from downsampled copies of the edges.
+ *
+ * Every translation of the coarsest level stands for a 2^k x 2^k block of full-resolution
+ * translations, and boundTranslationBlock() bounds the distance of all of them at a fraction
+ * of the cost of evaluating one, since the coarse level has far fewer needle points. Blocks
+ * are refined best bound first: a block splits into the four blocks of the next finer
+ * level, which are bounded in turn, and full-resolution
+ * translations are evaluated exactly. Once the best remaining bound exceeds the best
+ * distance found, the search stops.
+ *
+ * The coarse distances are minimums over everything a block's translations can reach, so
+ * they are lower bounds despite the change of resolution, and no translation that could win is
+ * discarded: the result is exactly that of the exhaustive findBestTranslation(context, 1, ...),
+ * including which translation wins a tie. The coarse levels merge needle points, so the
+ * bounds only hold for full Hausdorff distances, not partial ones.
+ *
+ * Example:
+ * @code
+ *   EdgePyramid needlePyramid(needleEdges, 4);
+ *   DistancePyramid haystackPyramid(haystackDistanceTransform, 4);
+ *   double dist;
+ *   CvPoint best = findBestTranslationPyramid(context, needlePyramid, haystackPyramid, &dist);
+ * @endcode
+ *
+ * @param context the needle and haystack at full resolution
+ * @param needle a pyramid of the needle's edges
+ * @param haystack a pyramid of the haystack's distance transform
+ * @param dist if not null, receives the distance of the best translation
+ * @param stats if not null, receives counters describing the search
+ * @return the best translation
+ * @throws std::invalid_argument if the context uses partial distances
+ */
+inline CvPoint findBestTranslationPyramid(
+    const SearchContext& context,
+    const EdgePyramid& needle, const DistancePyramid& haystack,
+    double* dist = 0,
+    PyramidSearchStats* stats = 0)
+{
+    if (context.isPartial())
+        throw std::invalid_argument("A pyramid search can't use partial distances.");
+
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+    PyramidSearchStats localStats;
+    PyramidSearchStats& counters = stats ? *stats : localStats;
+    counters = PyramidSearchStats();
+
+    const int maxOffsetX = context.maxOffsetX();
+    const int maxOffsetY = context.maxOffsetY();
+    const int coarsest = std::min(needle.levels(), haystack.levels()) - 1;
+
+    CvPoint bestPoint = cvPoint(0, 0);
+    double bestDistance = std::numeric_limits<double>::max();
+
+    // Evaluates a full-resolution translation exactly
+    const auto evaluate = [&](const CvPoint& point) {
+        ++ counters.translationsEvaluated;
+        const double distance = context.distanceAt(point, bestDistance);
+
+        // Rejected translations return some value above the threshold, not their distance
+        if (distance <= bestDistance && isBetterTranslation(distance, point, bestDistance, bestPoint))
+        {
+            bestDistance = distance;
+            bestPoint = point;
+        }
+    };
+
+    // Blocks waiting to be refined, smallest bound first
+    std::priority_queue<PyramidBlock> blocks;
+    const auto push = [&](int level, const CvPoint& block, double parentBound) {
+        ++ counters.blocksEvaluated;
+        const double bound = std::max(parentBound, boundTranslationBlock(needle, haystack, level, block, bestDistance));
+        if (bound > bestDistance)
+            ++ counters.blocksPruned;
+        else
+            blocks.push(PyramidBlock(level, block, bound));
+    };
+
+    if (coarsest == 0)
+    {
+        for (int y = 0; y < maxOffsetY; ++y)
+            for (int x = 0; x < maxOffsetX; ++x)
+                evaluate(cvPoint(x, y));
+    }
+    else
+    {
+        const int size = 1 << coarsest;
+        for (int y = 0; y * size < maxOffsetY; ++y)
+            for (int x = 0; x * size < maxOffsetX; ++x)
+                push(coarsest, cvPoint(x, y), -std::numeric_limits<double>::max());
+    }
+
+    while (!blocks.empty())
+    {
+        const PyramidBlock block = blocks.top();
+        blocks.pop();
+
+        // Ties must still be looked at, since they may come first in raster order
+        if (block.bound > bestDistance)
+        {
+            counters.blocksPruned += blocks.size() + 1;
+            break;
+        }
+
+        // Split into the four blocks of the next finer level that hold any translations
+        const int level = block.level - 1;
+        const int size = 1 << level;
+        for (int dy = 0; dy < 2; ++dy)
+        {
+            for (int dx = 0; dx < 2; ++dx)
+            {
+                const CvPoint child = cvPoint(2 * block.origin.x + dx, 2 * block.origin.y + dy);
+                if (child.x * size >= maxOffsetX || child.y * size >= maxOffsetY)
+                    continue;
+                if (level == 0)
+                    evaluate(child);
+                else
+                    push(level, child, block.bound);
+            }
+        }
+    }
+
+    profileCount(PROFILE_CELLS_PRUNED, counters.blocksPruned);
+    if (dist)
+        *dist = bestDistance;
+
+    return bestPoint;
+}
+
+#endif
@@ -0,0 +1,380 @@
+/**
+ * @file search.h Provides the data and the reference (serial) algorithms for searching
+ * for the translation of a needle image in a haystack image that minimizes the
+ * Hausdorff distance.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+// Standard library
+#include <limits>
+#include <algorithm>
+#include <atomic>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "hausdorff.h"
+#include "profiler.h"
+
+/**
+* Everything a translation search reads: the edge points and distance transforms
+* of the needle and the haystack.
+*
+* A search context only refers to data owned elsewhere, so it is cheap to copy and
+* can be shared by any number of threads as long as the data does not change
+* during the search.
+*
+* DistanceT is the pixel type of the distance transforms. SearchContext uses float
+* transforms; QuantizedSearchContext uses the smaller Intensity16 transforms of
+* quantizeDistanceTransform(), whose values are distances times distanceScale.
+* Distances returned by distanceAt() and taken as thresholds are always in pixels.
+*
+* A context can also refer to an EdgeIndex of the haystack's points, which makes the
+* reverse distance visit only the haystack edges under the needle, and lets
+* densityRatio turn away windows with far more or far fewer edges than the needle.
+* With forwardFraction or reverseFraction below 1, distances ignore the worst
+* fraction of the points in that direction.
+*/
+template <typename DistanceT>
+struct BasicSearchContext
+{
+    BasicSearchContext(
+        const EdgePointList& needlePoints,
+        const Image<DistanceT>& needleDistanceTransform,
+        const EdgePointList& haystackPoints,
+        const Image<DistanceT>& haystackDistanceTransform,
+        double distanceScale = 1.0)
+        : needlePoints(&needlePoints),
+          needleDistanceTransform(&needleDistanceTransform),
+          haystackPoints(&haystackPoints),
+          haystackDistanceTransform(&haystackDistanceTransform),
+          distanceScale(distanceScale),
+          haystackIndex(0),
+          densityRatio(0),
+          forwardFraction(1.0),
+          reverseFraction(1.0)
+    {}
+
+    // Dimensions of the needle
+    int needleWidth() const
+    {
+        return needleDistanceTransform->width();
+    }
+    int needleHeight() const
+    {
+        return needleDistanceTransform->height();
+    }
+
+    // The exclusive upper bounds of the translations searched by default
+    int maxOffsetX() const
+    {
+        return haystackDistanceTransform->width() - needleDistanceTransform->width();
+    }
+    int maxOffsetY() const
+    {
+        return haystackDistanceTransform->height() - needleDistanceTransform->height();
+    }
+
+    /**
+     * Finds the Hausdorff distance between the needle at offset and the haystack,
+     * or the partial distance if forwardFraction or reverseFraction is below 1.
+     * See findBidirectionalHausdorffDistance() for the meaning of threshold.
+     * Every search evaluates translations here, so this is where the active
+     * Profiler's search counters are kept.
+     */
+    double distanceAt(
+        const CvPoint& offset,
+        double threshold = std::numeric_limits<double>::max(),
+        unsigned long* pointsEvaluated = 0) const
+    {
+        unsigned long points = 0;
+        double distance = std::numeric_limits<double>::max();
+        const bool plausible = hasPlausibleDensity(offset);
+        if (plausible)
+        {
+            distance = toPixels(haystackIndex ?
+                                distanceInUnits(*haystackIndex, offset, toUnits(threshold), &points) :
+                                distanceInUnits(*haystackPoints, offset, toUnits(threshold), &points));
+        }
+
+        if (pointsEvaluated)
+            *pointsEvaluated = points;
+        if (Profiler* const profiler = Profiler::active())
+            profiler->countDistance(points, !plausible || distance > threshold);
+        return distance;
+    }
+
+    // Whether distances are partial Hausdorff distances
+    bool isPartial() const
+    {
+        return forwardFraction < 1.0 || reverseFraction < 1.0;
+    }
+
+    /**
+     * Decides whether the haystack window at offset holds a number of edge points
+     * within densityRatio times the needle's, either way. Always true without a
+     * haystackIndex or with densityRatio at most 1.
+     */
+    bool hasPlausibleDensity(const CvPoint& offset) const
+    {
+        if (!haystackIndex || densityRatio <= 1.0)
+            return true;
+        const double windowPoints = static_cast<double>(
+                                        haystackIndex->count(cvRect(offset.x, offset.y, needleWidth(), needleHeight())));
+        const double needleCount = static_cast<double>(needlePoints->size());
+        return windowPoints <= needleCount * densityRatio && windowPoints * densityRatio >= needleCount;
+    }
+
+    // distanceAt() in the units of the distance transforms, with the haystack's
+    // points as a list or an index
+    template <typename HaystackPointsT>
+    double distanceInUnits(const HaystackPointsT& haystack, const CvPoint& offset,
+                           double threshold, unsigned long* pointsEvaluated) const
+    {
+        if (isPartial())
+        {
+            return findPartialBidirectionalHausdorffDistance(
+                       *needlePoints, *needleDistanceTransform, haystack, *haystackDistanceTransform,
+                       offset, forwardFraction, reverseFraction, threshold, pointsEvaluated);
+        }
+        return findBidirectionalHausdorffDistance(
+                   *needlePoints, *needleDistanceTransform, haystack, *haystackDistanceTransform,
+                   offset, threshold, pointsEvaluated);
+    }
+
+    // Converts between pixels and the units of the distance transforms. The
+    // kernels' special results (no points, perfect match) pass through unchanged.
+    double toUnits(double distance) const
+    {
+        if (distanceScale == 1.0 || distance == std::numeric_limits<double>::max())
+            return distance;
+        return distance * distanceScale;
+    }
+    double toPixels(double distance) const
+    {
+        if (distanceScale == 1.0 || distance == MAX_HAUSDORFF_DISTANCE ||
+                distance <= std::numeric_limits<double>::min())
+            return distance;
+        return distance / distanceScale;
+    }
+
+    const EdgePointList* needlePoints;
+    const Image<DistanceT>* needleDistanceTransform;
+    const EdgePointList* haystackPoints;
+    const Image<DistanceT>* haystackDistanceTransform;
+
+    // Distance transform units per pixel
+    double distanceScale;
+
+    // If not null, an index of haystackPoints that the reverse distance looks up
+    // the points under the needle in
+    const EdgeIndex* haystackIndex;
+
+    // If above 1 (and haystackIndex is set), windows holding more than densityRatio
+    // times as many haystack edge points as the needle has, or fewer than
+    // 1 / densityRatio times, are rejected without a distance transform lookup,
+    // reading as infinitely far. Unlike the distance bounds, this is a heuristic:
+    // a window full of clutter can still be within a small forward distance.
+    double densityRatio;
+
+    // The fractions of the needle's edge points, and of the haystack's edge points
+    // under the needle, that must be close to the other image's edges. Below 1, the
+    // distance is the partial Hausdorff distance of findPartialHausdorffDistanceBounded(),
+    // which tolerates stray and occluded edges.
+    double forwardFraction;
+    double reverseFraction;
+};
+
+typedef BasicSearchContext<Intensity32F> SearchContext;
+typedef BasicSearchContext<Intensity16> QuantizedSearchContext;
+
+/**
+ * Decides whether a translation beats the best one found so far. A smaller distance
+ * always wins; equal distances are broken in favour of the translation that comes
+ * first in raster order, which is the translation a serial scan keeps.
+ */
+inline bool isBetterTranslation(double dist, const CvPoint& point, double bestDist, const CvPoint& bestPoint)
+{
+    if (dist != bestDist)
+        return dist < bestDist;
+    return point.y < bestPoint.y || (point.y == bestPoint.y && point.x < bestPoint.x);
+}
+
+/**
+ * Lowers an atomically shared distance to dist if dist is smaller.
+ */
+inline void lowerSharedDistance(std::atomic<double>& shared, double dist)
+{
+    double current = shared.load(std::memory_order_relaxed);
+    while (dist < current &&
+            !shared.compare_exchange_weak(current, dist, std::memory_order_relaxed))
+    {
+    }
+}
+
+/*
+ * Finds the translation of needle in haystack that results in the minimal Hausdorff distance.
+ * This is the serial reference implementation that the faster search engines must agree with.
+ *
+ * If sharedBound is not null, it is a best distance shared with searches on other threads
+ * (e.g. for other poses of the needle): translations farther than it plus boundSlack are
+ * rejected, and it is lowered whenever this search finds a better one. If no translation
+ * is within it, the result is (0, 0) with a distance of std::numeric_limits<double>::max().
+ */
+template <typename DistanceT>
+CvPoint findBestTranslation(const BasicSearchContext<DistanceT>& context,
+                            int step = 2, double* dist = 0,
+                            int minX = 0, int minY = 0,
+                            int maxX = -1, int maxY = -1,
+                            std::atomic<double>* sharedBound = 0,
+                            double boundSlack = 0)
+{
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+
+    // Find the optimum translation
+    unsigned bestX = 0;
+    unsigned bestY = 0;
+    double bestDistance = std::numeric_limits<double>::max();
+
+    const int maxOffsetX = maxX != -1 ? maxX : context.maxOffsetX();
+    const int maxOffsetY = maxY != -1 ? maxY : context.maxOffsetY();
+    for (int y = minY; y < maxOffsetY; y += step)
+    {
+        for (int x = minX; x < maxOffsetX; x += step)
+        {
+            // Translations that can't beat bestDistance are rejected as early as possible
+            const double threshold = sharedBound ?
+                                     std::min(bestDistance, sharedBound->load(std::memory_order_relaxed) + boundSlack) :
+                                     bestDistance;
+            const double dist = context.distanceAt(cvPoint(x, y), threshold);
+
+            if (dist < bestDistance && dist <= threshold)
+            {
+                bestDistance = dist;
+                bestX = x;
+                bestY = y;
+                if (sharedBound)
+                    lowerSharedDistance(*sharedBound, dist);
+            }
+        }
+    }
+
+    if (dist)
+        *dist = bestDistance;
+
+    return cvPoint(bestX, bestY);
+}
+
+/**
+ * How much lower than the best distance among translations sampled every step pixels the
+ * best distance of a nearby translation can be. Moving the needle by (dx, dy) changes every
+ * distance by at most |dx| + |dy|, and the unsampled translations inside the sampled grid
+ * are at most step / 2 away along each axis.
+ */
+inline double coarseToFineSlack(int step)
+{
+    return step > 1 ? step : 0;
+}
+
+/*
+ * Drives a coarse-to-fine translation search: runs levelSearch for successively finer
+ * step sizes, narrowing the searched window to +/- step around the best translation
+ * found so far. levelSearch is called as
+ *   CvPoint levelSearch(int step, double* dist, int minX, int minY, int maxX, int maxY)
+ * and must behave like findBestTranslation().
+ *
+ * If sharedBound is not null, it is the bound the levels search within (see
+ * findBestTranslation()), relaxed at coarse levels by coarseToFineSlack() since a finer
+ * level may still find a much better translation. Once another search has lowered it so
+ * far that the finer levels can't catch up, the search is abandoned and reports (0, 0)
+ * with a distance of std::numeric_limits<double>::max(), so a hopeless search stops after
+ * its coarsest levels.
+ */
+template <typename LevelSearch>
+CvPoint searchCoarseToFine(LevelSearch& levelSearch,
+                           int absoluteMaxX, int absoluteMaxY,
+                           int initialStep = 32, double* dist = 0,
+                           std::atomic<double>* sharedBound = 0)
+{
+    ProfileScope profile(PROFILE_TRANSLATION_SEARCH);
+    double bestDistance = std::numeric_limits<double>::max();
+    CvPoint bestTranslation = cvPoint(0, 0);
+
+    int minX = 0;
+    int minY = 0;
+    int maxX = absoluteMaxX;
+    int maxY = absoluteMaxY;
+
+    for (int step = initialStep; step > 0; step /= 2)
+    {
+        double distance;
+        CvPoint translation = levelSearch(
+                                  step, &distance,
+                                  minX, minY,
+                                  maxX, maxY);
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            bestTranslation = translation;
+
+            minX = std::max<int>(0, translation.x - step);
+            minY = std::max<int>(0, translation.y - step);
+            maxX = std::min<int>(absoluteMaxX, translation.x + step);
+            maxY = std::min<int>(absoluteMaxY, translation.y + step);
+        }
+
+        if (sharedBound && bestDistance > sharedBound->load(std::memory_order_relaxed) + coarseToFineSlack(step))
+        {
+            bestDistance = std::numeric_limits<double>::max();
+            bestTranslation = cvPoint(0, 0);
+            break;
+        }
+    }
+
+    if (dist)
+        *dist = bestDistance;
+
+    return bestTranslation;
+}
+
+/*
+ * Adapts the serial findBestTranslation() to searchCoarseToFine().
+ */
+template <typename DistanceT>
+struct SerialLevelSearch
+{
+    explicit SerialLevelSearch(const BasicSearchContext<DistanceT>& context, std::atomic<double>* sharedBound = 0)
+        : context(context), sharedBound(sharedBound)
+    {}
+
+    CvPoint operator()(int step, double* dist, int minX, int minY, int maxX, int maxY)
+    {
+        return findBestTranslation(context, step, dist, minX, minY, maxX, maxY, sharedBound,
+                                   coarseToFineSlack(step));
+    }
+
+    const BasicSearchContext<DistanceT>& context;
+    std::atomic<double>* sharedBound;
+};
+
+/*
+ * Finds the translation of needle in haystack that results in the minimal Hausdorff distance
+ * by recurively calling findBestTranslation() for successively finer step sizes as we get
+ * closer and closer to a solution. See searchCoarseToFine() for sharedBound.
+ */
+template <typename DistanceT>
+CvPoint findBestTranslationRecursive(const BasicSearchContext<DistanceT>& context, int initialStep = 32, double* dist = 0,
+                                     std::atomic<double>* sharedBound = 0)
+{
+    SerialLevelSearch<DistanceT> levelSearch(context, sharedBound);
+    return searchCoarseToFine(levelSearch, context.maxOffsetX(), context.maxOffsetY(), initialStep, dist,
+                              sharedBound);
+}
+
+#endif
@@ -0,0 +1,216 @@
+/**
+ * @file synthetic.h Provides a deterministic generator of needle and haystack edge
+ * images with the needle placed at a known translation, rotation and scale, for
+ * measuring the speed and accuracy of the searches.
+ */
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+// Standard library
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "templatebank.h"
+
+/**
+* A small pseudo-random generator (SplitMix64) whose sequence is fixed by its seed
+* on every platform and standard library, unlike the distributions of <random>.
+*/
+class SyntheticRandom
+{
+public:
+    explicit SyntheticRandom(uint64_t seed)
+        : state(seed)
+    {}
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // A number in [0, n), for n > 0
+    int below(int n)
+    {
+        return static_cast<int>(next() % static_cast<uint64_t>(n));
+    }
+
+    // A number in [0, 1)
+    double unit()
+    {
+        return static_cast<double>(next() >> 11) / 9007199254740992.0;
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * Describes a synthetic scene.
+ */
+struct SyntheticSceneOptions
+{
+    SyntheticSceneOptions()
+        : haystackWidth(640), haystackHeight(480), needleWidth(64), needleHeight(64),
+          needleSegments(12), clutter(4), dropout(0), rotation(0), scale(1.0)
+    {}
+
+    // Dimensions of the images
+    int haystackWidth;
+    int haystackHeight;
+    int needleWidth;
+    int needleHeight;
+
+    // The number of line segments drawn in the needle: its edge density
+    int needleSegments;
+
+    // Line segments of clutter drawn in the haystack per 100 x 100 pixels
+    double clutter;
+
+    // The fraction of the needle's edge pixels left out of the haystack, as if occluded
+    double dropout;
+
+    // The pose of the needle in the haystack, as in NeedlePose
+    int rotation;
+    double scale;
+};
+
+/**
+ * A generated needle and haystack, with where the needle was placed.
+ */
+struct SyntheticScene
+{
+    explicit SyntheticScene(const SyntheticSceneOptions& options)
+        : needleEdges(options.needleWidth, options.needleHeight),
+          haystackEdges(options.haystackWidth, options.haystackHeight),
+          translation(cvPoint(0, 0)), rotation(options.rotation), scale(options.scale)
+    {}
+
+    // Edges black (0) on white (255), like detectEdges() produces
+    Image<Intensity> needleEdges;
+    Image<Intensity> haystackEdges;
+
+    // The ground truth: the needle, warped by warpNeedleEdges() to (rotation,
+    // scale), covers the needle-sized window of the haystack at translation
+    CvPoint translation;
+    int rotation;
+    double scale;
+};
+
+/**
+ * Draws a one pixel wide edge from (x0, y0) to (x1, y1), which must lie within the image.
+ */
+inline void drawSyntheticEdge(Image<Intensity>& image, int x0, int y0, int x1, int y1)
+{
+    const int dx = abs(x1 - x0);
+    const int dy = -abs(y1 - y0);
+    const int stepX = x0 < x1 ? 1 : -1;
+    const int stepY = y0 < y1 ? 1 : -1;
+    int error = dx + dy;
+    for (;;)
+    {
+        image[y0][x0] = 0;
+        if (x0 == x1 && y0 == y1)
+            break;
+        const int twice = 2 * error;
+        if (twice >= dy)
+        {
+            error += dy;
+            x0 += stepX;
+        }
+        if (twice <= dx)
+        {
+            error += dx;
+            y0 += stepY;
+        }
+    }
+}
+
+/**
+ * Draws segments random line segments of up to maxLength pixels in a region of an image.
+ */
+inline void drawSyntheticSegments(Image<Intensity>& image, const CvRect& region, int segments, int maxLength,
+                                  SyntheticRandom& random)
+{
+    for (int i = 0; i < segments; ++i)
+    {
+        const int x0 = region.x + random.below(region.width);
+        const int y0 = region.y + random.below(region.height);
+        const int x1 = std::max(region.x, std::min(region.x + region.width - 1,
+                                x0 + random.below(2 * maxLength + 1) - maxLength));
+        const int y1 = std::max(region.y, std::min(region.y + region.height - 1,
+                                y0 + random.below(2 * maxLength + 1) - maxLength));
+        drawSyntheticEdge(image, x0, y0, x1, y1);
+    }
+}
+
+/**
+ * Generates a scene: a needle of random line segments, and a haystack of clutter
+ * with the needle, in the pose given by options, pasted at a random translation.
+ * The same options and seed always give the same scene.
+ *
+ * The needle is warped with warpNeedleEdges(), as the pose searches warp it, so a
+ * pose search that tries the scene's pose sees the needle's edges exactly; clutter
+ * and dropout are what make the match imperfect.
+ *
+ * Example:
+ * @code
+ *   SyntheticSceneOptions options;
+ *   options.rotation = 8;
+ *   const SyntheticScene scene = generateSyntheticScene(options, 42);
+ *   // search for scene.needleEdges in scene.haystackEdges, expecting scene.translation
+ * @endcode
+ */
+inline SyntheticScene generateSyntheticScene(const SyntheticSceneOptions& options, uint64_t seed)
+{
+    SyntheticScene scene(options);
+    SyntheticRandom random(seed);
+    const int needleWidth = options.needleWidth;
+    const int needleHeight = options.needleHeight;
+
+    // Keep the needle's segments off its border, so that rotating it loses as little as possible
+    cvSet(scene.needleEdges, cvScalarAll(255));
+    const int inset = std::min(needleWidth, needleHeight) / 8;
+    const CvRect needleRegion = cvRect(inset, inset, needleWidth - 2 * inset, needleHeight - 2 * inset);
+    drawSyntheticSegments(scene.needleEdges, needleRegion, options.needleSegments,
+                          std::max(needleWidth, needleHeight) / 2, random);
+
+    cvSet(scene.haystackEdges, cvScalarAll(255));
+    const CvRect haystackRegion = cvRect(0, 0, options.haystackWidth, options.haystackHeight);
+    const int clutterSegments = static_cast<int>(
+                                    options.clutter * options.haystackWidth * options.haystackHeight / 10000.0);
+    drawSyntheticSegments(scene.haystackEdges, haystackRegion, clutterSegments,
+                          std::max(needleWidth, needleHeight) / 2, random);
+
+    // Paste the posed needle, keeping the clutter under it
+    Image<Intensity> posed(needleWidth, needleHeight);
+    warpNeedleEdges(scene.needleEdges, NeedlePose(options.rotation, options.scale), posed);
+    // The searches take maxOffsetX() and maxOffsetY(), the haystack's size less the
+    // needle's, as exclusive bounds, so the needle goes strictly below them
+    scene.translation = cvPoint(random.below(std::max(1, options.haystackWidth - needleWidth)),
+                                random.below(std::max(1, options.haystackHeight - needleHeight)));
+    for (int y = 0; y < needleHeight; ++y)
+    {
+        const Intensity* const source = posed[y];
+        Intensity* const destination = scene.haystackEdges[scene.translation.y + y] + scene.translation.x;
+        for (int x = 0; x < needleWidth; ++x)
+        {
+            if (source[x] == 0 && random.unit() >= options.dropout)
+                destination[x] = 0;
+        }
+    }
+
+    return scene;
+}
+
+#endif
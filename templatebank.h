@@ -0,0 +1,505 @@
+/**
+ * @file templatebank.h Provides a bank of pre-warped poses of a needle that can be built
+ * once, saved to a file and memory-mapped back in.
+ */
+
+#ifndef TEMPLATEBANK_H
+#define TEMPLATEBANK_H
+
+// Standard library
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "imagepool.h"
+#include "edgepoints.h"
+#include "mappedfile.h"
+#include "distancetransform.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+/**
+ * A rotation (in degrees) and scale of the needle.
+ */
+struct NeedlePose
+{
+    NeedlePose(int rotation = 0, double scale = 1.0)
+        : rotation(rotation), scale(scale)
+    {}
+
+    int rotation;
+    double scale;
+};
+
+/**
+ * Lists the poses in a rotation and scale range, rotation-major, in the order in
+ * which the search has always visited them.
+ */
+inline std::vector<NeedlePose> enumerateNeedlePoses(
+    int minRotation, int maxRotation, int rotationStep,
+    double minScale, double maxScale, double scaleStep)
+{
+    std::vector<NeedlePose> poses;
+    for (int rotation = minRotation; rotation <= maxRotation; rotation += rotationStep)
+    {
+        for (double scale = minScale; scale <= maxScale; scale += scaleStep)
+        {
+            poses.push_back(NeedlePose(rotation, scale));
+        }
+    }
+    return poses;
+}
+
+/**
+ * Rotates and scales an edge image about its centre. Pixels that come from outside
+ * of the original image become background (white).
+ *
+ * @param edges the edge image to warp
+ * @param pose the rotation and scale to apply
+ * @param warped receives the warped edges; must be the same size as edges
+ */
+inline void warpNeedleEdges(const Image<Intensity>& edges, const NeedlePose& pose, Image<Intensity>& warped)
+{
+    ProfileScope profile(PROFILE_POSE_WARP);
+    float matrixData[6];
+    CvMat rotMat = cvMat(2, 3, CV_32FC1, matrixData);
+    CvPoint2D32f center = cvPoint2D32f(edges.width() / 2, edges.height() / 2);
+    cv2DRotationMatrix(center, pose.rotation, pose.scale, &rotMat);
+
+    Image<Intensity> * src = const_cast<Image<Intensity> *>(&edges);
+    cvWarpAffine(*src, warped, &rotMat, CV_INTER_LINEAR + CV_WARP_FILL_OUTLIERS, cvScalarAll(255));
+}
+
+/**
+ * Continues a 64-bit FNV-1a hash over some bytes.
+ */
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const unsigned char* const bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+/**
+ * Computes a 64-bit FNV-1a hash of the pixels of an edge image (and its size), used
+ * to check that a saved template bank belongs to a particular needle.
+ */
+inline uint64_t hashEdgeImage(const Image<Intensity>& edges)
+{
+    const int dims[2] = { edges.width(), edges.height() };
+    uint64_t hash = hashBytes(dims, sizeof(dims));
+    for (int y = 0; y < edges.height(); ++y)
+        hash = hashBytes(edges[y], edges.width() * sizeof(Intensity), hash);
+    return hash;
+}
+
+/**
+ * The name of the file in a bank directory that holds the bank of these poses of
+ * a needle.
+ */
+inline std::string templateBankFilename(const std::string& directory, const Image<Intensity>& needleEdges,
+                                        const std::vector<NeedlePose>& poses)
+{
+    uint64_t key = hashEdgeImage(needleEdges);
+    for (size_t i = 0; i < poses.size(); ++i)
+    {
+        key = hashBytes(&poses[i].rotation, sizeof(poses[i].rotation), key);
+        key = hashBytes(&poses[i].scale, sizeof(poses[i].scale), key);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bank", static_cast<unsigned long long>(key));
+    return directory.empty() ? std::string(name) : directory + "/" + name;
+}
+
+/**
+ * Everything the search needs to know about one pose of the needle.
+ */
+struct PoseTemplate
+{
+    PoseTemplate()
+        : boundingBox(cvRect(0, 0, 0, 0)),
+          distanceTransform(static_cast<IplImage*>(0))
+    {}
+
+    // The rotation and scale the needle was warped by
+    NeedlePose pose;
+
+    // The warped needle's edge points, in EDGE_ORDER_DISCRIMINATIVE order
+    EdgePointList points;
+
+    // The smallest rectangle containing all of the edge points
+    CvRect boundingBox;
+
+    // The distance transform of the warped needle's edges
+    Image<Intensity32F> distanceTransform;
+};
+
+/**
+* The poses of one needle, warped and preprocessed ahead of time.
+*
+* Searching for a needle over a range of rotations and scales needs the warped
+* edges, edge points and distance transform of every pose. None of that depends on
+* the haystack, so a TemplateBank computes it once and keeps it for any number of
+* haystacks. A bank can be saved to a compact binary file and loaded back with
+* load(), which memory-maps the file and uses the edge points and distance
+* transforms in place, so loading costs next to nothing.
+*
+* The file format is native-endian and versioned; load() rejects files written
+* by a machine of the other byte order or by a different version of the format.
+*
+* Example:
+* @code
+*   TemplateBank bank;
+*   if (!bank.tryLoad("needle.bank") || !bank.matches(needleEdges)) {
+*       bank.build(needleEdges, enumerateNeedlePoses(-32, 32, 4, 0.5, 2.0, 0.25), &pool);
+*       bank.save("needle.bank");
+*   }
+* @endcode
+*/
+class TemplateBank
+{
+public:
+    TemplateBank()
+        : width(0), height(0), hash(0)
+    {}
+
+    /**
+     * Builds the bank from a needle's edges, replacing its contents.
+     *
+     * @param needleEdges the needle's edges in their original pose
+     * @param poses the poses to prepare
+     * @param pool if not null, the poses are prepared in parallel on this pool
+     */
+    void build(const Image<Intensity>& needleEdges, const std::vector<NeedlePose>& poses, WorkStealingPool* pool = 0)
+    {
+        std::vector<PoseTemplate> newTemplates(poses.size());
+        const WorkStealingPool::Task task = [&](size_t i, unsigned) {
+            buildPoseTemplate(needleEdges, poses[i], newTemplates[i]);
+        };
+        if (pool)
+            pool->run(poses.size(), task);
+        else
+            for (size_t i = 0; i < poses.size(); ++i)
+                task(i, 0);
+
+        templates.swap(newTemplates);
+        width = needleEdges.width();
+        height = needleEdges.height();
+        hash = hashEdgeImage(needleEdges);
+        mapping.reset();
+    }
+
+    /**
+     * Writes the bank to a file that load() can read.
+     *
+     * @throws std::runtime_error if the file can't be written
+     */
+    void save(const std::string& filename) const;
+
+    /**
+     * Replaces the contents of the bank with a file written by save(), mapping the
+     * file into memory rather than reading it.
+     *
+     * @throws std::runtime_error if the file can't be mapped or is not a valid bank
+     */
+    void load(const std::string& filename);
+
+    /**
+     * Like load(), but returns false instead of throwing if the file is missing or
+     * invalid, leaving the bank unchanged.
+     */
+    bool tryLoad(const std::string& filename)
+    {
+        try
+        {
+            load(filename);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
+    // Checks whether the bank was built from these needle edges
+    bool matches(const Image<Intensity>& needleEdges) const
+    {
+        return needleEdges.width() == width && needleEdges.height() == height &&
+               hashEdgeImage(needleEdges) == hash;
+    }
+
+    // Checks whether the bank holds exactly these poses, in this order
+    bool hasPoses(const std::vector<NeedlePose>& poses) const
+    {
+        if (poses.size() != templates.size())
+            return false;
+        for (size_t i = 0; i < poses.size(); ++i)
+        {
+            if (templates[i].pose.rotation != poses[i].rotation || templates[i].pose.scale != poses[i].scale)
+                return false;
+        }
+        return true;
+    }
+
+    // The poses in the bank
+    size_t size() const
+    {
+        return templates.size();
+    }
+    const PoseTemplate& operator[](size_t i) const
+    {
+        return templates[i];
+    }
+
+    // Dimensions of the needle
+    int needleWidth() const
+    {
+        return width;
+    }
+    int needleHeight() const
+    {
+        return height;
+    }
+
+private:
+
+    // Layout of a saved bank: a header, one record per pose, then the arrays the
+    // records point to, each starting on a 64-byte boundary.
+    enum
+    {
+        FILE_VERSION = 1,
+        BYTE_ORDER_MARK = 0x01020304,
+        ARRAY_ALIGNMENT = 64
+    };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t poseCount;
+        int32_t needleWidth;
+        int32_t needleHeight;
+        uint32_t reserved;
+        uint64_t needleHash;
+    };
+
+    struct FileRecord
+    {
+        double scale;
+        int32_t rotation;
+        int32_t boxX;
+        int32_t boxY;
+        int32_t boxWidth;
+        int32_t boxHeight;
+        uint32_t pointCount;
+        uint32_t distanceStep;
+        uint32_t reserved;
+        uint64_t pointsOffset;
+        uint64_t distanceOffset;
+    };
+
+    static const char* fileMagic()
+    {
+        return "HIFBANK";
+    }
+
+    static uint64_t alignOffset(uint64_t offset)
+    {
+        return (offset + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+    }
+
+    static void buildPoseTemplate(const Image<Intensity>& needleEdges, const NeedlePose& pose, PoseTemplate& result)
+    {
+        ScratchImage<Intensity> edges(needleEdges.width(), needleEdges.height());
+        warpNeedleEdges(needleEdges, pose, *edges);
+
+        result.pose = pose;
+        result.points.assign(*edges);
+        reorderEdgePoints(result.points, EDGE_ORDER_DISCRIMINATIVE);
+        result.boundingBox = findBoundingBox(result.points);
+        result.distanceTransform = Image<Intensity32F>(edges->width(), edges->height());
+        computeSeparableDistanceTransform(*edges, result.distanceTransform);
+    }
+
+    static CvRect findBoundingBox(const EdgePointList& points)
+    {
+        if (points.empty())
+            return cvRect(0, 0, 0, 0);
+
+        int minX = points.xs()[0];
+        int maxX = minX;
+        int minY = points.ys()[0];
+        int maxY = minY;
+        for (size_t i = 1; i < points.size(); ++i)
+        {
+            minX = std::min(minX, points.xs()[i]);
+            maxX = std::max(maxX, points.xs()[i]);
+            minY = std::min(minY, points.ys()[i]);
+            maxY = std::max(maxY, points.ys()[i]);
+        }
+        return cvRect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+    }
+
+    std::vector<PoseTemplate> templates;
+    int width;
+    int height;
+    uint64_t hash;
+
+    // The file the templates' data lives in, if they were loaded
+    std::shared_ptr<MappedFile> mapping;
+};
+
+inline void TemplateBank::save(const std::string& filename) const
+{
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, fileMagic(), sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.poseCount = static_cast<uint32_t>(templates.size());
+    header.needleWidth = width;
+    header.needleHeight = height;
+    header.needleHash = hash;
+
+    // Lay out the arrays after the records
+    std::vector<FileRecord> records(templates.size());
+    uint64_t offset = sizeof(FileHeader) + records.size() * sizeof(FileRecord);
+    for (size_t i = 0; i < templates.size(); ++i)
+    {
+        const PoseTemplate& pose = templates[i];
+        FileRecord& record = records[i];
+        std::memset(&record, 0, sizeof(record));
+        record.scale = pose.pose.scale;
+        record.rotation = pose.pose.rotation;
+        record.boxX = pose.boundingBox.x;
+        record.boxY = pose.boundingBox.y;
+        record.boxWidth = pose.boundingBox.width;
+        record.boxHeight = pose.boundingBox.height;
+        record.pointCount = static_cast<uint32_t>(pose.points.size());
+        record.distanceStep = static_cast<uint32_t>(alignOffset(width * sizeof(Intensity32F)));
+
+        record.pointsOffset = offset = alignOffset(offset);
+        offset += 2 * record.pointCount * sizeof(int32_t);
+        record.distanceOffset = offset = alignOffset(offset);
+        offset += static_cast<uint64_t>(record.distanceStep) * height;
+    }
+
+    const std::string temporary = temporaryFilename(filename);
+    std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file)
+        throw std::runtime_error("Failed to create " + temporary + ".");
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!records.empty())
+        file.write(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(FileRecord));
+
+    uint64_t written = sizeof(FileHeader) + records.size() * sizeof(FileRecord);
+    const std::vector<char> padding(std::max<size_t>(ARRAY_ALIGNMENT, width * sizeof(Intensity32F)), 0);
+    for (size_t i = 0; i < templates.size(); ++i)
+    {
+        const PoseTemplate& pose = templates[i];
+        const FileRecord& record = records[i];
+
+        file.write(&padding[0], static_cast<std::streamsize>(record.pointsOffset - written));
+        if (record.pointCount > 0)
+        {
+            file.write(reinterpret_cast<const char*>(pose.points.xs()), record.pointCount * sizeof(int32_t));
+            file.write(reinterpret_cast<const char*>(pose.points.ys()), record.pointCount * sizeof(int32_t));
+        }
+        written = record.pointsOffset + 2 * record.pointCount * sizeof(int32_t);
+
+        file.write(&padding[0], static_cast<std::streamsize>(record.distanceOffset - written));
+        for (int y = 0; y < height; ++y)
+        {
+            file.write(reinterpret_cast<const char*>(pose.distanceTransform[y]), width * sizeof(Intensity32F));
+            file.write(&padding[0], static_cast<std::streamsize>(record.distanceStep - width * sizeof(Intensity32F)));
+        }
+        written = record.distanceOffset + static_cast<uint64_t>(record.distanceStep) * height;
+    }
+
+    file.close();
+    if (!file)
+    {
+        remove(temporary.c_str());
+        throw std::runtime_error("Failed to write " + temporary + ".");
+    }
+
+    replaceFile(temporary, filename);
+}
+
+inline void TemplateBank::load(const std::string& filename)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile(filename));
+    const unsigned char* const bytes = file->data();
+    const uint64_t fileSize = file->size();
+
+    FileHeader header;
+    if (fileSize < sizeof(header))
+        throw std::runtime_error(filename + " is not a template bank.");
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::strncmp(header.magic, fileMagic(), sizeof(header.magic)) != 0)
+        throw std::runtime_error(filename + " is not a template bank.");
+    if (header.version != FILE_VERSION || header.byteOrder != BYTE_ORDER_MARK)
+        throw std::runtime_error(filename + " was written by an incompatible version or machine.");
+    if (header.needleWidth <= 0 || header.needleHeight <= 0 ||
+            fileSize < sizeof(header) + static_cast<uint64_t>(header.poseCount) * sizeof(FileRecord))
+        throw std::runtime_error(filename + " is truncated or corrupt.");
+
+    std::vector<PoseTemplate> newTemplates(header.poseCount);
+    for (uint32_t i = 0; i < header.poseCount; ++i)
+    {
+        FileRecord record;
+        std::memcpy(&record, bytes + sizeof(header) + i * sizeof(FileRecord), sizeof(record));
+
+        // Arrays must lie inside the file and be aligned for in-place use
+        const uint64_t pointsSize = 2 * static_cast<uint64_t>(record.pointCount) * sizeof(int32_t);
+        const uint64_t distanceSize = static_cast<uint64_t>(record.distanceStep) * header.needleHeight;
+        if (record.pointsOffset % ARRAY_ALIGNMENT != 0 || record.distanceOffset % ARRAY_ALIGNMENT != 0 ||
+                record.pointsOffset + pointsSize > fileSize || record.distanceOffset + distanceSize > fileSize ||
+                record.distanceStep < header.needleWidth * sizeof(Intensity32F) ||
+                record.distanceStep % sizeof(Intensity32F) != 0)
+            throw std::runtime_error(filename + " is truncated or corrupt.");
+
+        // The searches index by the edge points, as for PreprocessedImage::load()
+        const int* const xs = reinterpret_cast<const int*>(bytes + record.pointsOffset);
+        const int* const ys = xs + record.pointCount;
+        for (uint32_t j = 0; j < record.pointCount; ++j)
+        {
+            if (xs[j] < 0 || xs[j] >= header.needleWidth || ys[j] < 0 || ys[j] >= header.needleHeight)
+                throw std::runtime_error(filename + " is truncated or corrupt.");
+        }
+
+        PoseTemplate& pose = newTemplates[i];
+        pose.pose = NeedlePose(record.rotation, record.scale);
+        pose.boundingBox = cvRect(record.boxX, record.boxY, record.boxWidth, record.boxHeight);
+
+        pose.points.attach(xs, ys, record.pointCount, header.needleWidth, header.needleHeight);
+
+        // View the mapped distance transform in place
+        pose.distanceTransform = Image<Intensity32F>(ImageView<Intensity32F>(
+                                     reinterpret_cast<Intensity32F*>(file->data() + record.distanceOffset),
+                                     header.needleWidth, header.needleHeight, record.distanceStep));
+    }
+
+    templates.swap(newTemplates);
+    width = header.needleWidth;
+    height = header.needleHeight;
+    hash = header.needleHash;
+    mapping = file;
+}
+
+#endif
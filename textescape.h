@@ -0,0 +1,58 @@
+/**
+ * @file textescape.h Provides the escaping of strings written into JSON and CSV output.
+ */
+
+#ifndef TEXTESCAPE_H
+#define TEXTESCAPE_H
+
+// Standard library
+#include <string>
+#include <stdio.h>
+
+/*
+ * Escapes a string for a JSON string literal.
+ */
+inline std::string escapeJson(const std::string& text)
+{
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char code[8];
+            sprintf(code, "\\u%04x", c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += static_cast<char>(c);
+        }
+    }
+    return escaped;
+}
+
+/*
+ * Quotes a string for a CSV field if it needs it.
+ */
+inline std::string escapeCsv(const std::string& text)
+{
+    if (text.find_first_of(",\"\r\n") == std::string::npos)
+        return text;
+
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (text[i] == '"')
+            quoted += '"';
+        quoted += text[i];
+    }
+    return quoted + "\"";
+}
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ * @file threadpool.h Provides a pool of worker threads that share work by work stealing.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Standard library
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+/**
+* A fixed set of worker threads that run batches of independent tasks.
+*
+* run() splits a batch of numbered tasks into contiguous blocks, one per worker,
+* so that neighbouring tasks (e.g. neighbouring tiles of an image) tend to run on
+* the same thread. A worker that runs out of tasks steals from the far end of
+* another worker's block, which keeps every thread busy even when some tasks are
+* much cheaper than others, as happens when most of them are pruned early.
+*
+* The thread calling run() works on the batch too, so a pool of N threads starts
+* N - 1 extra threads. Concurrent calls to run() from different threads are
+* serialized, and a run() issued from inside one of the pool's own tasks runs its
+* batch serially on the calling worker rather than deadlocking.
+*
+* Example:
+* @code
+*   WorkStealingPool pool(8);
+*   std::vector<double> results(tileCount);
+*   pool.run(tileCount, [&](size_t tile, unsigned worker) {
+*       results[tile] = processTile(tile);
+*   });
+* @endcode
+*/
+class WorkStealingPool
+{
+public:
+    typedef std::function<void (size_t task, unsigned worker)> Task;
+
+    /**
+     * Starts the pool's worker threads.
+     *
+     * @param threadCount the number of threads that work on each batch, including the
+     *     thread calling run(). 0 uses one thread per hardware thread.
+     */
+    explicit WorkStealingPool(unsigned threadCount = 0)
+        : generation(0), activeWorkers(0), remainingTasks(0), stopping(false)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        for (unsigned i = 0; i < threadCount; ++i)
+            queues.push_back(new WorkerQueue);
+        for (unsigned i = 1; i < threadCount; ++i)
+            threads.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        for (size_t i = 0; i < queues.size(); ++i)
+            delete queues[i];
+    }
+
+    // Number of threads that work on each batch, including the caller of run()
+    unsigned threadCount() const
+    {
+        return static_cast<unsigned>(queues.size());
+    }
+
+    /**
+     * Runs task(i, worker) for every i in [0, taskCount) and waits for all of them to
+     * finish. worker is in [0, threadCount()) and identifies the thread running the
+     * task, so tasks can keep per-thread state in an array without locking. If any
+     * task throws, the first exception is rethrown here once the batch has finished.
+     */
+    void run(size_t taskCount, const Task& task)
+    {
+        if (taskCount == 0)
+            return;
+
+        // Nested batches and single-threaded pools just run on the calling thread
+        if (currentPool() == this || threadCount() == 1 || taskCount == 1)
+        {
+            const unsigned worker = currentPool() == this ? currentWorker() : 0;
+            for (size_t i = 0; i < taskCount; ++i)
+                task(i, worker);
+            return;
+        }
+
+        std::lock_guard<std::mutex> runLock(runMutex);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = task;
+            error = std::exception_ptr();
+            remainingTasks = taskCount;
+
+            // Hand each worker a contiguous block of the tasks. This must come after
+            // setting job, because a worker still finishing the previous batch may
+            // pick up these tasks before it notices the new generation.
+            const size_t workers = queues.size();
+            for (size_t w = 0; w < workers; ++w)
+            {
+                std::lock_guard<std::mutex> queueLock(queues[w]->mutex);
+                for (size_t i = taskCount * w / workers; i < taskCount * (w + 1) / workers; ++i)
+                    queues[w]->tasks.push_back(i);
+            }
+            ++generation;
+        }
+        wake.notify_all();
+
+        // The calling thread is worker 0
+        WorkerScope scope(this, 0);
+        drain(0);
+
+        std::exception_ptr firstError;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this] { return remainingTasks == 0 && activeWorkers == 0; });
+            job = Task();
+            firstError = error;
+        }
+
+        if (firstError)
+            std::rethrow_exception(firstError);
+    }
+
+private:
+    WorkStealingPool(const WorkStealingPool&);
+    WorkStealingPool& operator= (const WorkStealingPool&);
+
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    // Identifies the pool and worker index of the current thread while it runs tasks
+    static const WorkStealingPool*& currentPool()
+    {
+        static thread_local const WorkStealingPool* pool = 0;
+        return pool;
+    }
+    static unsigned& currentWorker()
+    {
+        static thread_local unsigned worker = 0;
+        return worker;
+    }
+
+    struct WorkerScope
+    {
+        WorkerScope(const WorkStealingPool* pool, unsigned worker)
+            : previousPool(currentPool()), previousWorker(currentWorker())
+        {
+            currentPool() = pool;
+            currentWorker() = worker;
+        }
+        ~WorkerScope()
+        {
+            currentPool() = previousPool;
+            currentWorker() = previousWorker;
+        }
+        const WorkStealingPool* previousPool;
+        unsigned previousWorker;
+    };
+
+    void workerLoop(unsigned worker)
+    {
+        WorkerScope scope(this, worker);
+        unsigned seenGeneration = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping)
+                    return;
+                seenGeneration = generation;
+                ++activeWorkers;
+            }
+
+            drain(worker);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --activeWorkers;
+            }
+            finished.notify_all();
+        }
+    }
+
+    // Takes the next task from the front of our own queue, or steals one from the
+    // back of another worker's queue
+    bool takeTask(unsigned worker, size_t& task)
+    {
+        const size_t workers = queues.size();
+        for (size_t i = 0; i < workers; ++i)
+        {
+            WorkerQueue& queue = *queues[(worker + i) % workers];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+
+            if (i == 0)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Runs tasks until there are none left to take
+    void drain(unsigned worker)
+    {
+        size_t task;
+        while (takeTask(worker, task))
+        {
+            try
+            {
+                job(task, worker);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last = --remainingTasks == 0;
+            }
+            if (last)
+                finished.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<WorkerQueue*> queues;
+
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    Task job;
+    std::exception_ptr error;
+    unsigned generation;
+    unsigned activeWorkers;
+    size_t remainingTasks;
+    bool stopping;
+};
+
+#endif
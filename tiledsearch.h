@@ -0,0 +1,297 @@
+/**
+ * @file tiledsearch.h Provides searches of haystacks too large to preprocess whole,
+ * one tile at a time.
+ */
+
+#ifndef TILEDSEARCH_H
+#define TILEDSEARCH_H
+
+// Standard library
+#include <limits>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <math.h>
+
+// Opencv
+#include "cv.h"
+
+// Image wrapper
+#include "image.h"
+#include "imagepool.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "pnmfile.h"
+#include "preprocess.h"
+#include "distancetransform.h"
+
+// Search algorithms
+#include "search.h"
+#include "parallelsearch.h"
+#include "branchandbound.h"
+#include "detection.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+/**
+ * Settings of a tiled search.
+ */
+struct TiledSearchOptions
+{
+    TiledSearchOptions()
+        : tileSize(1024), distanceCap(64), initialStep(32), exact(false), pool(0)
+    {}
+
+    // The width and height, in offsets, of the translations searched per tile
+    int tileSize;
+
+    // The largest distance, in pixels, kept in the haystack's distance transform.
+    // It bounds the halo read around each tile; distances beyond it all read as
+    // distanceCap, so it must be above any distance the search needs to tell apart.
+    double distanceCap;
+
+    // The coarsest step of the coarse-to-fine search of each tile
+    int initialStep;
+
+    // Whether to search each tile exhaustively by branch-and-bound instead
+    bool exact;
+
+    // If not null, the threads to preprocess and search each tile with
+    WorkStealingPool* pool;
+};
+
+/**
+* The preprocessed part of a large haystack that one tile's translations look at.
+*/
+struct HaystackTile
+{
+    // Position of the tile's first pixel in the haystack
+    CvPoint origin;
+
+    // Edges, edge points and distance transform of the tile
+    std::unique_ptr<Image<Intensity> > edges;
+    EdgePointList points;
+    EdgeIndex index;
+    std::unique_ptr<Image<Intensity32F> > distanceTransform;
+};
+
+/**
+* Cuts a haystack stored in a PGM or PPM file into tiles of translations and
+* preprocesses them one at a time.
+*
+* Tile i covers a tileSize x tileSize block of the needle's translations. The
+* needle at those translations covers the block plus the needle's size, which is
+* the part of the haystack that the tile's edges, edge points and distance
+* transform describe. Around that, the tile reads a halo of distanceCap pixels,
+* which holds every edge that can affect the capped distance transform, and a
+* further EDGE_CONTEXT_MARGIN pixels for the edge detector. Only one tile's
+* pixels are in memory at a time, so the memory used depends on the tile size and
+* the needle, not on the haystack.
+*
+* The edges of a tile match those of the whole image except where Canny's
+* hysteresis follows a weak edge across the margin; the distance transform is
+* exact for those edges.
+*/
+class TiledHaystack
+{
+public:
+    /**
+     * @param reader the haystack file
+     * @param needleWidth, needleHeight the size of the needle searched for
+     * @param options the tile size, distance cap and threads
+     */
+    TiledHaystack(PnmReader& reader, int needleWidth, int needleHeight, const TiledSearchOptions& options)
+        : reader(reader), needleWidth(needleWidth), needleHeight(needleHeight), options(options),
+          tileSize(std::max(1, options.tileSize)),
+          maxOffsetX(reader.width() - needleWidth), maxOffsetY(reader.height() - needleHeight),
+          tileColumns(maxOffsetX > 0 ? (maxOffsetX + tileSize - 1) / tileSize : 0),
+          tileRows(maxOffsetY > 0 ? (maxOffsetY + tileSize - 1) / tileSize : 0)
+    {}
+
+    // The number of tiles
+    size_t tileCount() const
+    {
+        return static_cast<size_t>(tileColumns) * tileRows;
+    }
+
+    // The translations searched in tile i, in haystack coordinates
+    CvRect tileTranslations(size_t i) const
+    {
+        const int x = static_cast<int>(i % tileColumns) * tileSize;
+        const int y = static_cast<int>(i / tileColumns) * tileSize;
+        return cvRect(x, y, std::min(tileSize, maxOffsetX - x), std::min(tileSize, maxOffsetY - y));
+    }
+
+    /**
+     * Reads and preprocesses tile i. Searching the tile's haystack at translations
+     * (0, 0) up to the size of tileTranslations(i) searches those translations.
+     */
+    void load(size_t i, HaystackTile& tile) const
+    {
+        const CvRect translations = tileTranslations(i);
+        const CvRect covered = cvRect(translations.x, translations.y,
+                                      translations.width + needleWidth, translations.height + needleHeight);
+        const int halo = static_cast<int>(ceil(options.distanceCap)) + 1 + EDGE_CONTEXT_MARGIN;
+        const int left = std::max(0, covered.x - halo);
+        const int top = std::max(0, covered.y - halo);
+        const CvRect source = cvRect(left, top,
+                                     std::min(reader.width(), covered.x + covered.width + halo) - left,
+                                     std::min(reader.height(), covered.y + covered.height + halo) - top);
+        const CvRect inner = cvRect(covered.x - source.x, covered.y - source.y, covered.width, covered.height);
+
+        ScratchImage<Intensity> edges(source.width, source.height);
+        {
+            ScratchImage<Rgb> pixels(source.width, source.height);
+            {
+                ProfileScope profile(PROFILE_DECODE);
+                reader.read(source, *pixels);
+            }
+            detectEdges(*pixels, *edges);
+        }
+
+        ScratchImage<Intensity32F> distances(source.width, source.height);
+        DistanceTransformOptions transformOptions;
+        transformOptions.cap = options.distanceCap;
+        transformOptions.roi = inner;
+        transformOptions.pool = options.pool;
+        computeSeparableDistanceTransform(*edges, *distances, transformOptions);
+
+        tile.origin = cvPoint(covered.x, covered.y);
+        tile.edges.reset(new Image<Intensity>(covered.width, covered.height));
+        tile.distanceTransform.reset(new Image<Intensity32F>(covered.width, covered.height));
+        copyRegion(*edges, inner, *tile.edges);
+        copyRegion(*distances, inner, *tile.distanceTransform);
+        tile.points.assign(*tile.edges);
+        reorderEdgePoints(tile.points, EDGE_ORDER_RANDOM);
+        tile.index.assign(tile.points);
+    }
+
+private:
+    template <typename T>
+    static void copyRegion(Image<T>& source, const CvRect& region, Image<T>& destination)
+    {
+        cvSetImageROI(source, region);
+        cvCopy(source, destination);
+        cvResetImageROI(source);
+    }
+
+    PnmReader& reader;
+    const int needleWidth;
+    const int needleHeight;
+    const TiledSearchOptions options;
+    const int tileSize;
+    const int maxOffsetX;
+    const int maxOffsetY;
+    const int tileColumns;
+    const int tileRows;
+};
+
+/*
+ * Finds the translation of the needle in a large haystack that results in the minimal
+ * Hausdorff distance, preprocessing and searching the haystack one tile at a time.
+ *
+ * Every translation belongs to exactly one tile, and the tiles' best translations are
+ * merged with isBetterTranslation(), so an exact search finds the translation that
+ * the exhaustive findBestTranslation(context, 1, ...) over the whole haystack (with a
+ * distance transform capped at options.distanceCap) would. The best distance found
+ * so far bounds the exact search of later tiles.
+ *
+ * @param haystack the haystack file
+ * @param needlePoints the needle's edge points
+ * @param needleDistanceTransform the distance transform of the needle's edges
+ * @param options the tile size, distance cap, search and threads
+ * @param dist if not null, receives the distance of the best translation
+ * @return the best translation
+ */
+inline CvPoint findBestTranslationTiled(
+    PnmReader& haystack,
+    const EdgePointList& needlePoints,
+    const Image<Intensity32F>& needleDistanceTransform,
+    const TiledSearchOptions& options = TiledSearchOptions(),
+    double* dist = 0)
+{
+    const TiledHaystack tiles(haystack, needleDistanceTransform.width(), needleDistanceTransform.height(), options);
+    CvPoint bestTranslation = cvPoint(0, 0);
+    double bestDistance = std::numeric_limits<double>::max();
+
+    HaystackTile tile;
+    for (size_t i = 0; i < tiles.tileCount(); ++i)
+    {
+        tiles.load(i, tile);
+        SearchContext context(needlePoints, needleDistanceTransform, tile.points, *tile.distanceTransform);
+        context.haystackIndex = &tile.index;
+
+        double distance;
+        CvPoint translation;
+        if (options.exact)
+        {
+            translation = findBestTranslationBranchAndBound(context, &distance, 0, 0, 0, -1, -1, 32, bestDistance);
+        }
+        else if (options.pool)
+        {
+            ParallelTranslationSearch search(*options.pool);
+            translation = search.findBestTranslationRecursive(context, options.initialStep, &distance);
+        }
+        else
+        {
+            translation = findBestTranslationRecursive(context, options.initialStep, &distance);
+        }
+
+        translation = cvPoint(translation.x + tile.origin.x, translation.y + tile.origin.y);
+        if (distance != std::numeric_limits<double>::max() &&
+                isBetterTranslation(distance, translation, bestDistance, bestTranslation))
+        {
+            bestDistance = distance;
+            bestTranslation = translation;
+        }
+    }
+
+    if (dist)
+        *dist = bestDistance;
+
+    return bestTranslation;
+}
+
+/*
+ * Finds every instance of the needle in a large haystack, like findDetections(), one
+ * tile at a time. The detections of each tile are offered to one DetectionSet for the
+ * whole haystack, so an instance found by two neighbouring tiles is reported once, and
+ * later tiles only look for detections that can still make the set.
+ *
+ * @return the detections, best first, in haystack coordinates
+ */
+inline std::vector<Detection> findDetectionsTiled(
+    PnmReader& haystack,
+    const EdgePointList& needlePoints,
+    const Image<Intensity32F>& needleDistanceTransform,
+    const DetectionOptions& detectionOptions = DetectionOptions(),
+    const TiledSearchOptions& options = TiledSearchOptions())
+{
+    const int needleWidth = needleDistanceTransform.width();
+    const int needleHeight = needleDistanceTransform.height();
+    const TiledHaystack tiles(haystack, needleWidth, needleHeight, options);
+    DetectionSet detections(detectionOptions, needleWidth, needleHeight);
+
+    HaystackTile tile;
+    for (size_t i = 0; i < tiles.tileCount(); ++i)
+    {
+        tiles.load(i, tile);
+        SearchContext context(needlePoints, needleDistanceTransform, tile.points, *tile.distanceTransform);
+        context.haystackIndex = &tile.index;
+
+        DetectionOptions tileOptions = detectionOptions;
+        tileOptions.maxDistance = detections.threshold();
+        const std::vector<Detection> found = findDetections(context, tileOptions);
+        for (size_t j = 0; j < found.size(); ++j)
+        {
+            const CvPoint& translation = found[j].translation;
+            detections.offer(Detection(cvPoint(translation.x + tile.origin.x, translation.y + tile.origin.y),
+                                       found[j].distance));
+        }
+    }
+
+    return detections.detections();
+}
+
+#endif
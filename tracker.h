@@ -0,0 +1,337 @@
+/**
+ * @file tracker.h Provides tracking of the needle through the frames of a video.
+ */
+
+#ifndef TRACKER_H
+#define TRACKER_H
+
+// Standard library
+#include <string>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <atomic>
+#include <stdexcept>
+#include <math.h>
+#include <stdio.h>
+#include <ctype.h>
+
+// Opencv
+#include "cv.h"
+#include "highgui.h"
+
+// Image wrapper
+#include "image.h"
+#include "edgepoints.h"
+#include "edgeindex.h"
+#include "templatebank.h"
+#include "preprocess.h"
+
+// Search algorithms
+#include "search.h"
+#include "branchandbound.h"
+#include "posesearch.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+/**
+* Reads the frames of a video file, or of a numbered sequence of image files.
+*
+* A name containing a printf-style number (e.g. "frames/%04d.png") is an image
+* sequence starting at number 0 or 1 and ending at the first missing file; any
+* other name is opened as a video file. The number must be the name's only
+* conversion, %d, %i or %u with an optional zero flag and width, and a literal
+* percent sign is written %%.
+*/
+class FrameSource
+{
+public:
+    explicit FrameSource(const std::string& name)
+        : name(name), capture(0), nextIndex(0), numberWidth(0), zeroPadded(false)
+    {
+        if (name.find('%') != std::string::npos)
+        {
+            if (!parseSequenceName())
+                throw std::runtime_error("Expected one number like %04d in " + name + ".");
+
+            // Sequences commonly start at either 0 or 1
+            if (!fileExists(frameFilename(0)))
+                nextIndex = 1;
+            if (!fileExists(frameFilename(nextIndex)))
+                throw std::runtime_error("Could not open " + frameFilename(nextIndex) + ".");
+        }
+        else
+        {
+            capture = cvCaptureFromFile(name.c_str());
+            if (!capture)
+                throw std::runtime_error("Could not open " + name + ".");
+        }
+    }
+
+    ~FrameSource()
+    {
+        if (capture)
+            cvReleaseCapture(&capture);
+    }
+
+    /**
+     * Reads the next frame.
+     *
+     * @return the frame, or null at the end of the video
+     */
+    std::unique_ptr<Image<Rgb> > read()
+    {
+        ProfileScope profile(PROFILE_DECODE);
+        std::unique_ptr<Image<Rgb> > frame;
+        if (capture)
+        {
+            // The capture owns its frames, so the image gets a copy
+            IplImage* captured = cvQueryFrame(capture);
+            if (captured)
+                frame.reset(new Image<Rgb>(cvCloneImage(captured)));
+        }
+        else
+        {
+            const std::string filename = frameFilename(nextIndex);
+            if (fileExists(filename))
+            {
+                frame.reset(new Image<Rgb>(filename));
+                ++ nextIndex;
+            }
+        }
+        return frame;
+    }
+
+private:
+    FrameSource(const FrameSource&);
+    FrameSource& operator= (const FrameSource&);
+
+    // Splits a sequence's name around its number, returning false unless it has
+    // exactly one integer conversion and no other
+    bool parseSequenceName()
+    {
+        bool found = false;
+        std::string* part = &prefix;
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            if (name[i] != '%')
+            {
+                *part += name[i];
+                continue;
+            }
+            if (++i < name.size() && name[i] == '%')
+            {
+                *part += '%';
+                continue;
+            }
+            if (found)
+                return false;
+            if (i < name.size() && name[i] == '0')
+                zeroPadded = true, ++i;
+            for (; i < name.size() && isdigit(static_cast<unsigned char>(name[i])); ++i)
+                numberWidth = numberWidth * 10 + (name[i] - '0');
+            if (i >= name.size() || (name[i] != 'd' && name[i] != 'i' && name[i] != 'u') || numberWidth > 32)
+                return false;
+            found = true;
+            part = &suffix;
+        }
+        return found;
+    }
+
+    // The name of a sequence's frame, formatted without passing the caller's name to printf
+    std::string frameFilename(int index) const
+    {
+        char number[64];
+        snprintf(number, sizeof(number), zeroPadded ? "%0*d" : "%*d", numberWidth, index);
+        return prefix + number + suffix;
+    }
+
+    static bool fileExists(const std::string& filename)
+    {
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (!file)
+            return false;
+        fclose(file);
+        return true;
+    }
+
+    const std::string name;
+    CvCapture* capture;
+    int nextIndex;
+
+    // A sequence's name before and after its number, and how the number is written
+    std::string prefix;
+    std::string suffix;
+    int numberWidth;
+    bool zeroPadded;
+};
+
+/**
+ * Parameters of a Tracker.
+ */
+struct TrackerOptions
+{
+    TrackerOptions()
+        : translationRadius(16), rotationRadius(4), scaleRadius(0.25),
+          lostDistance(8.0), maxDistanceIncrease(4.0)
+    {}
+
+    // How far from the previous frame's translation, rotation (in degrees) and
+    // scale the needle is searched for
+    int translationRadius;
+    int rotationRadius;
+    double scaleRadius;
+
+    // A local match further than lostDistance from the haystack, or further than the
+    // previous frame's match by more than maxDistanceIncrease, means the needle has
+    // been lost, and the next search covers the whole frame and every pose
+    double lostDistance;
+    double maxDistanceIncrease;
+
+    // How the whole frame is searched when the needle is lost; its distance
+    // fractions apply to the local search too
+    PoseSearchOptions globalSearch;
+};
+
+/**
+* Follows the needle from frame to frame.
+*
+* The first frame is searched over every translation and every pose of a
+* TemplateBank. After that, each frame is only searched near the previous match:
+* the poses within rotationRadius and scaleRadius of it and the translations within
+* translationRadius. That search is exact (by branch-and-bound) and shares its best
+* distance between the poses, which are searched on a WorkStealingPool. When the
+* local match gets much worse than the previous one, the needle has most likely
+* moved out of the window, and the whole frame is searched again.
+*
+* Example:
+* @code
+*   TemplateBank bank;
+*   bank.build(needleEdges, enumerateNeedlePoses(-16, 16, 4, 0.75, 1.25, 0.25), &pool);
+*   Tracker tracker(pool, bank);
+*   FramePreprocessor preprocessor;
+*   FrameSource source("video.avi");
+*   while (std::unique_ptr<Image<Rgb> > frame = source.read()) {
+*       preprocessor.update(*frame);
+*       PoseMatch match = tracker.track(preprocessor.edgePoints(), preprocessor.distanceTransform());
+*   }
+* @endcode
+*/
+class Tracker
+{
+public:
+    /**
+     * @param pool the threads to search with
+     * @param bank the needle's poses; must outlive the tracker
+     * @param options how far to search around the previous match
+     */
+    Tracker(WorkStealingPool& pool, const TemplateBank& bank, const TrackerOptions& options = TrackerOptions())
+        : pool(pool), bank(bank), options(options), hasMatch(false), searchedGlobally(false)
+    {}
+
+    /**
+     * Finds the needle in the next frame.
+     *
+     * @param haystackPoints the frame's edge points
+     * @param haystackDistanceTransform the distance transform of the frame's edges
+     * @return the best pose and translation of the needle in the frame
+     */
+    PoseMatch track(const EdgePointList& haystackPoints, const Image<Intensity32F>& haystackDistanceTransform)
+    {
+        searchedGlobally = false;
+        haystackIndex.assign(haystackPoints);
+        PoseMatch match;
+        if (hasMatch)
+            match = searchLocally(haystackPoints, haystackDistanceTransform);
+
+        if (!hasMatch || match.distance > options.lostDistance ||
+                match.distance > previous.distance + options.maxDistanceIncrease)
+        {
+            PoseMatch global;
+            PoseSearch search(pool);
+            search.findBestTranslationScaleAndRotation(bank, haystackPoints, haystackDistanceTransform,
+                    options.globalSearch, &global, 0, &haystackIndex);
+            searchedGlobally = true;
+            if (global.distance < match.distance)
+                match = global;
+        }
+
+        previous = match;
+        hasMatch = match.distance != std::numeric_limits<double>::max();
+        return match;
+    }
+
+    // Forgets the previous match, so the next frame is searched globally
+    void reset()
+    {
+        hasMatch = false;
+    }
+
+    // Whether the latest frame had to be searched globally
+    bool lastSearchWasGlobal() const
+    {
+        return searchedGlobally;
+    }
+
+private:
+    Tracker(const Tracker&);
+    Tracker& operator= (const Tracker&);
+
+    // Searches the poses and translations near the previous match
+    PoseMatch searchLocally(const EdgePointList& haystackPoints, const Image<Intensity32F>& haystackDistanceTransform)
+    {
+        std::vector<size_t> poses;
+        for (size_t i = 0; i < bank.size(); ++i)
+        {
+            const NeedlePose& pose = bank[i].pose;
+            if (abs(pose.rotation - previous.rotation) <= options.rotationRadius &&
+                    fabs(pose.scale - previous.scale) <= options.scaleRadius + 1e-9)
+                poses.push_back(i);
+        }
+
+        std::vector<PoseMatch> results(poses.size());
+        std::atomic<double> sharedBest(std::numeric_limits<double>::max());
+        const int radius = std::max(0, options.translationRadius);
+
+        pool.run(poses.size(), [&](size_t i, unsigned /*worker*/) {
+            const PoseTemplate& pose = bank[poses[i]];
+            SearchContext context(pose.points, pose.distanceTransform, haystackPoints, haystackDistanceTransform);
+            context.haystackIndex = &haystackIndex;
+            context.forwardFraction = options.globalSearch.forwardFraction;
+            context.reverseFraction = options.globalSearch.reverseFraction;
+            context.densityRatio = options.globalSearch.densityRatio;
+            PoseMatch& result = results[i];
+            result.rotation = pose.pose.rotation;
+            result.scale = pose.pose.scale;
+            result.translation = findBestTranslationBranchAndBound(
+                                     context, &result.distance, 0,
+                                     std::max(0, previous.translation.x - radius),
+                                     std::max(0, previous.translation.y - radius),
+                                     std::min(context.maxOffsetX(), previous.translation.x + radius + 1),
+                                     std::min(context.maxOffsetY(), previous.translation.y + radius + 1),
+                                     32, std::numeric_limits<double>::max(), &sharedBest);
+        });
+
+        // The first pose with the smallest distance wins, as in PoseSearch
+        PoseMatch best;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            if (results[i].distance < best.distance)
+                best = results[i];
+        }
+        return best;
+    }
+
+    WorkStealingPool& pool;
+    const TemplateBank& bank;
+    const TrackerOptions options;
+
+    // The current frame's edge points, shared by the local and global searches
+    EdgeIndex haystackIndex;
+
+    PoseMatch previous;
+    bool hasMatch;
+    bool searchedGlobally;
+};
+
+#endif